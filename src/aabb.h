@@ -78,14 +78,14 @@ class aabb {
         }
 };
 
-const aabb aabb::empty = aabb(interval::empty, interval::empty, interval::empty);
-const aabb aabb::universe = aabb(interval::universe, interval::universe, interval::universe);
+inline const aabb aabb::empty = aabb(interval::empty, interval::empty, interval::empty);
+inline const aabb aabb::universe = aabb(interval::universe, interval::universe, interval::universe);
 
-aabb operator+(const aabb &bbox, const vec3 &offset) {
+inline aabb operator+(const aabb &bbox, const vec3 &offset) {
     return aabb(bbox.x + offset.x(), bbox.y + offset.y(), bbox.z + offset.z());
 }
 
-aabb operator+(const vec3 &offset, const aabb &bbox) {
+inline aabb operator+(const vec3 &offset, const aabb &bbox) {
     return bbox + offset;
 }
 
@@ -0,0 +1,53 @@
+#ifndef BDPT_H
+#define BDPT_H
+
+#include "hittable.h"
+
+#include <atomic>
+#include <memory>
+
+// One vertex of a camera or light subpath for bidirectional path tracing. Densities are per unit area
+// (per unit solid angle at the pinhole), as Veach's MIS weights need them.
+struct path_vertex {
+    enum kind { camera_end, light_end, surface };
+
+    kind type = surface;
+    point3 p;
+    vec3 normal;                       // Faces where the subpath arrived from; zero at the pinhole
+    hit_record rec = hit_record();     // Surface vertices only
+    const hittable *light = nullptr;   // Emitter this vertex lies on, if any
+    colour emission;                   // Light it emits, if it lies on an emitter
+    colour beta;                       // Subpath throughput up to this vertex
+    bool delta = false;                // Specular scattering, or an endpoint that cannot be connected to
+    double pdf_fwd = 0;                // Density of this vertex along the subpath's own direction
+    double pdf_rev = 0;                // Density of this vertex if the path were sampled from the other end
+};
+
+// Light-tracing contributions land in arbitrary pixels from any thread, so pixels are summed with
+// compare-and-swap rather than under a lock
+class splat_film {
+    public:
+        splat_film(size_t pixels) : values(new std::atomic<double>[3 * pixels]), pixels(pixels) {
+            for (size_t i = 0; i < 3 * pixels; i++) values[i].store(0, std::memory_order_relaxed);
+        }
+
+        void add(size_t pixel, const colour &c) {
+            for (int k = 0; k < 3; k++) {
+                std::atomic<double> &v = values[3 * pixel + k];
+                double old = v.load(std::memory_order_relaxed);
+                while (!v.compare_exchange_weak(old, old + c[k], std::memory_order_relaxed)) {}
+            }
+        }
+
+        colour get(size_t pixel) const {
+            return colour(values[3 * pixel].load(), values[3 * pixel + 1].load(), values[3 * pixel + 2].load());
+        }
+
+        size_t size() const { return pixels; }
+
+    private:
+        std::unique_ptr<std::atomic<double>[]> values;
+        size_t pixels;
+};
+
+#endif
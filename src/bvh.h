@@ -39,14 +39,41 @@ class bvh_node : public hittable {
         }
 
         bool hit(const ray &r, interval ray_t, hit_record &rec) const override {
+            render_stats.nodes_visited++;
             if (!bbox.hit(r, ray_t)) return false;
             bool hit_left = left->hit(r, ray_t, rec);
             bool hit_right = right->hit(r, interval(ray_t.min, hit_left ? rec.t : ray_t.max), rec);
             return hit_left || hit_right;
         }
 
+        bool occluded(const ray &r, interval ray_t) const override {
+            render_stats.nodes_visited++;
+            if (!bbox.hit(r, ray_t)) return false;
+            return left->occluded(r, ray_t) || right->occluded(r, ray_t);
+        }
+
         aabb bounding_box() const override { return bbox; }
 
+        void account_memory(memory_report &report) const override {
+            if (!report.first_visit(this)) return;
+            report.add(memory_report::bvh, shared_bytes<bvh_node>());
+            left->account_memory(report);
+            right->account_memory(report);
+        }
+
+        // Upper bound on the node bytes a tree over object_count objects allocates
+        static size_t estimate_bytes(size_t object_count) {
+            return std::max<size_t>(object_count, 2) * shared_bytes<bvh_node>();
+        }
+
+        // Number of bvh_node objects in this subtree
+        size_t node_count() const {
+            size_t count = 1;
+            if (auto node = std::dynamic_pointer_cast<bvh_node>(left)) count += node->node_count();
+            if (auto node = std::dynamic_pointer_cast<bvh_node>(right)) count += node->node_count();
+            return count;
+        }
+
     private:
         shared_ptr<hittable> left;
         shared_ptr<hittable> right;
@@ -1,8 +1,25 @@
 #ifndef CAMERA_H
 #define CAMERA_H
 
+#include "bdpt.h"
+#include "environment_light.h"
 #include "hittable.h"
+#include "irradiance_cache.h"
+#include "light_bvh.h"
 #include "material.h"
+#include "path_guiding.h"
+#include "render_cost.h"
+#include "sampler.h"
+#include "shading_cache.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <tuple>
+#include <typeinfo>
 
 class camera {
     public:
@@ -20,44 +37,365 @@ class camera {
         double defocus_angle = 0;          // Variation angle of rays through each pixel
         double focus_dist = 10;            // Distance from camera lookfrom point to plane of perfect focus
 
+        int tile_size = 16;                // Tile edge length for cached and progressive renders
+
+        double time_budget = 0;            // Seconds for a progressive render capped at samples_per_pixel; 0 disables
+        int pass_samples = 1;              // Samples per pixel added by each progressive pass
+        double snapshot_interval = 0;      // Seconds between progressive snapshots; 0 disables
+        std::string snapshot_path = "snapshot.ppm";
+
+        shared_ptr<sampler> pixel_sampler = make_shared<independent_sampler>(); // Sample sequence source
+        int batch_size = 0;                // Paths per wavefront; 0 traces each path depth-first
+        bool sort_by_material = true;      // Sort wavefront paths by material and direction before shading
+        shared_ptr<light_bvh> lights;      // Emitters sampled directly at diffuse hits; null disables
+        std::string cost_map_prefix;       // Write per-pixel cost heatmaps under this prefix; empty disables
+        shared_ptr<environment_light> environment; // Image lighting for rays that miss; null uses background
+        bool bidirectional = false;        // Connect camera paths to light paths started from lights (BDPT)
+        shared_ptr<irradiance_cache> irradiance; // Interpolated indirect light at diffuse hits; null path traces it
+        bool path_guiding = false;         // Learn incident light over doubling passes and steer diffuse bounces with it
+
+        double shutter_open = 0;           // Camera rays get times spread evenly over [shutter_open, shutter_close],
+        double shutter_close = 0;          // within the 0 to 1 range moving objects are keyed over
+
         void render(const hittable &scene) {
+            std::vector<colour> image = render_image(scene);
+            write_image(std::cout, image);
+        }
+
+        // Render into linear colours, row-major, without writing anything out
+        std::vector<colour> render_image(const hittable &scene) {
             initialize();
+            if (bidirectional) {
+                if (lights) return render_bidirectional(scene);
+                std::cerr << "ERROR: Bidirectional rendering needs camera::lights; tracing camera paths only.\n";
+            }
+            if (path_guiding) return render_guided(scene);
+            if (batch_size > 0) return render_wavefront(scene);
+            if (time_budget > 0) return render_progressive(scene);
 
             std::vector<colour> image(image_height * image_width);
             int rows_processed = 0;        // For progress bar
 
+            // Only the depth-first render can attribute work to single pixels
+            bool record_cost = !cost_map_prefix.empty();
+            render_cost cost(record_cost ? image_width : 0, record_cost ? image_height : 0);
+
             omp_set_num_threads(8);
-            #pragma omp parallel for
-            for (int row = 0; row < image_height; row++) {
-                for (int col = 0; col < image_width; col++) {
-                    colour pixel_colour(0, 0, 0);
+            #pragma omp parallel
+            {
+                shared_ptr<sampler> thread_sampler = pixel_sampler->clone();
+                active_sampler = thread_sampler.get();
 
-                    for (int sample = 0; sample < samples_per_pixel; sample++) {
-                        ray r = get_ray(col, row);
-                        pixel_colour += ray_colour(r, max_depth, scene);
+                #pragma omp for schedule(dynamic)
+                for (int row = 0; row < image_height; row++) {
+                    for (int col = 0; col < image_width; col++) {
+                        if (!record_cost) {
+                            image[row * image_width + col] = render_pixel(col, row, scene);
+                            continue;
+                        }
+
+                        render_counters before = render_stats;
+                        auto start = std::chrono::steady_clock::now();
+
+                        image[row * image_width + col] = render_pixel(col, row, scene);
+
+                        std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+                        cost.set(render_cost::time_us, col, row, elapsed.count());
+                        cost.set(render_cost::nodes_visited, col, row, double(render_stats.nodes_visited - before.nodes_visited));
+                        cost.set(render_cost::primitive_tests, col, row, double(render_stats.primitive_tests - before.primitive_tests));
+                        cost.set(render_cost::path_depth, col, row,
+                                 double(render_stats.path_vertices - before.path_vertices) / samples_per_pixel);
+                        cost.set(render_cost::density_lookups, col, row,
+                                 double(render_stats.density_lookups - before.density_lookups));
                     }
 
-                    image[row * image_width + col] = pixel_colour * pixel_samples_scale;
+                    #pragma omp atomic
+                    rows_processed++;
+
+                    #pragma omp critical
+                    std::clog << "\rScanlines remaining: " << (image_height - rows_processed) << ' ' << std::flush;
                 }
 
-                #pragma omp atomic
-                rows_processed++;
+                active_sampler = nullptr;
+            }
+
+            std::clog << "\rDone.                       \n";
 
-                #pragma omp critical
-                std::clog << "\rScanlines remaining: " << (image_height - rows_processed) << ' ' << std::flush;
+            if (record_cost) {
+                if (!cost.write(cost_map_prefix)) std::cerr << "ERROR: Could not write cost maps to '" << cost_map_prefix << "'.\n";
+                cost.report_tiles(std::clog, tile_size, 10);
+            }
+
+            return image;
+        }
+
+        // Renders several views of one scene on one thread pool. Tiles from every view share one dynamic
+        // schedule, so threads move straight on to the next view rather than idling at the end of each.
+        // view_done gets each image, one call at a time, as soon as the view's last tile is finished.
+        // Views are rendered depth-first; their batch, progressive and cost map settings are ignored.
+        static void render_views(std::vector<camera> &views, const hittable &scene,
+                                 const std::function<void(size_t, const std::vector<colour> &)> &view_done) {
+            struct tile_job {
+                int view, x0, y0;
+            };
+
+            std::vector<tile_job> jobs;
+            std::vector<std::vector<colour>> images(views.size());
+            std::vector<int> tiles_left(views.size(), 0);
+
+            for (size_t v = 0; v < views.size(); v++) {
+                camera &cam = views[v];
+                cam.initialize();
+                images[v].assign(size_t(cam.image_width) * cam.image_height, colour(0, 0, 0));
+
+                for (int y0 = 0; y0 < cam.image_height; y0 += cam.tile_size) {
+                    for (int x0 = 0; x0 < cam.image_width; x0 += cam.tile_size) {
+                        jobs.push_back({int(v), x0, y0});
+                        tiles_left[v]++;
+                    }
+                }
+            }
+
+            int views_remaining = int(views.size());
+
+            omp_set_num_threads(8);
+            #pragma omp parallel
+            {
+                // Views may use different sample sequences, so each gets its own clone
+                std::vector<shared_ptr<sampler>> thread_samplers(views.size());
+
+                #pragma omp for schedule(dynamic)
+                for (size_t j = 0; j < jobs.size(); j++) {
+                    const tile_job &job = jobs[j];
+                    const camera &cam = views[job.view];
+                    std::vector<colour> &image = images[job.view];
+
+                    if (!thread_samplers[job.view]) thread_samplers[job.view] = cam.pixel_sampler->clone();
+                    active_sampler = thread_samplers[job.view].get();
+
+                    for (int row = job.y0; row < std::min(job.y0 + cam.tile_size, cam.image_height); row++) {
+                        for (int col = job.x0; col < std::min(job.x0 + cam.tile_size, cam.image_width); col++) {
+                            image[row * cam.image_width + col] = cam.render_pixel(col, row, scene);
+                        }
+                    }
+
+                    int left;
+                    #pragma omp atomic capture seq_cst
+                    left = --tiles_left[job.view];
+
+                    if (left == 0) {
+                        #pragma omp critical(view_output)
+                        {
+                            view_done(size_t(job.view), image);
+                            views_remaining--;
+                            std::clog << "\rViews remaining: " << views_remaining << ' ' << std::flush;
+                        }
+                    }
+                }
+
+                active_sampler = nullptr;
             }
 
             std::clog << "\rDone.                       \n";
-            std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
+        }
+
+        // Rows image_width and aspect_ratio give, i.e. the rows render_into() writes
+        int output_height() {
+            initialize();
+            return image_height;
+        }
+
+        // Hooks for render_into(). progress gets the rows finished so far and the total, one call at a time,
+        // on whichever thread finished the row; cancelled is polled before each row is started.
+        struct render_callbacks {
+            std::function<void(int, int)> progress;
+            std::function<bool()> cancelled;
+        };
+
+        // Renders depth-first straight into caller-owned memory as linear RGB floats, row r starting at
+        // pixels + r * row_stride floats, with nothing written to the standard streams. Returns false if
+        // cancelled, leaving the rows not yet started untouched.
+        bool render_into(const hittable &scene, float *pixels, size_t row_stride, const render_callbacks &callbacks = {}) {
+            initialize();
+            std::atomic<bool> stop{false};
+            int rows_done = 0;
+
+            omp_set_num_threads(8);
+            #pragma omp parallel
+            {
+                shared_ptr<sampler> thread_sampler = pixel_sampler->clone();
+                active_sampler = thread_sampler.get();
+
+                #pragma omp for schedule(dynamic)
+                for (int row = 0; row < image_height; row++) {
+                    if (stop.load(std::memory_order_relaxed)) continue;
+                    if (callbacks.cancelled && callbacks.cancelled()) {
+                        stop = true;
+                        continue;
+                    }
+
+                    float *out = pixels + size_t(row) * row_stride;
+                    for (int col = 0; col < image_width; col++) {
+                        colour c = render_pixel(col, row, scene);
+                        out[3 * col] = float(c.x());
+                        out[3 * col + 1] = float(c.y());
+                        out[3 * col + 2] = float(c.z());
+                    }
+
+                    if (callbacks.progress) {
+                        #pragma omp critical(render_progress)
+                        callbacks.progress(++rows_done, image_height);
+                    }
+                }
+
+                active_sampler = nullptr;
+            }
+
+            return !stop;
+        }
+
+        // Adds the buffers a render with the current settings allocates, and the light tree
+        void account_memory(memory_report &report) {
+            initialize();
+            size_t pixels = size_t(image_width) * image_height;
+
+            size_t buffers = pixels * sizeof(colour);
+            if (time_budget > 0) buffers += pixels * sizeof(colour);        // Running sums
+            if (!cost_map_prefix.empty()) buffers += pixels * render_cost::metric_count * sizeof(float);
+            if (bidirectional) buffers += pixels * 3 * sizeof(double);      // Light-tracing splats
+            if (batch_size > 0) {
+                size_t per_path = sizeof(ray) + sizeof(int) + 2 * sizeof(colour) + sizeof(double)
+                                + sizeof(hit_record) + 2 * sizeof(char) + 3 * sizeof(size_t);  // With sort keys
+                buffers += size_t(batch_size) * per_path;
+            }
+            report.add(memory_report::framebuffers, buffers);
+
+            // Every render runs 8 OpenMP threads, each with its own sampler clone
+            report.add(memory_report::thread_state, 8 * shared_bytes<sobol_sampler>());
+
+            if (lights) lights->account_memory(report);
+            if (environment) environment->account_memory(report);
+            if (irradiance) irradiance->account_memory(report);
+        }
+
+        void write_image(std::ostream &out, const std::vector<colour> &image) const {
+            out << "P3\n" << image_width << ' ' << image_height << "\n255\n";
             for (int row = 0; row < image_height; row++) {
                 for (int col = 0; col < image_width; col++) {
-                    write_colour(std::cout, image[row * image_width + col]);
+                    write_colour(out, image[row * image_width + col]);
                 }
             }
+        }
 
+        // Render using cached primary hits. The first call traces and caches every primary ray; later calls
+        // only reshade dirty tiles from the cache and trace their secondary rays.
+        void render(const hittable &scene, shading_cache &cache) {
+            write_image(std::cout, render_image(scene, cache));
+        }
+
+        // render(scene, cache) into linear colours, held by the cache until its next render
+        const std::vector<colour> &render_image(const hittable &scene, shading_cache &cache) {
+            initialize();
+
+            bool rebuild = !cache.valid_for(image_width, image_height, samples_per_pixel, tile_size);
+            if (rebuild) cache.reset(image_width, image_height, samples_per_pixel, tile_size);
+
+            int tile_count = int(cache.tiles.size());
+            int tiles_processed = 0;
+
+            omp_set_num_threads(8);
+            #pragma omp parallel
+            {
+                shared_ptr<sampler> thread_sampler = pixel_sampler->clone();
+                active_sampler = thread_sampler.get();
+
+                #pragma omp for schedule(dynamic)
+                for (int index = 0; index < tile_count; index++) {
+                    shading_cache::tile &t = cache.tiles[index];
+                    if (!t.dirty) continue;
+
+                    std::vector<shared_ptr<material>> local_materials;
+
+                    for (int row = t.y0; row < t.y1; row++) {
+                        for (int col = t.x0; col < t.x1; col++) {
+                            colour pixel_colour(0, 0, 0);
+
+                            for (int sample = 0; sample < samples_per_pixel; sample++) {
+                                shading_cache::first_hit &h = cache.at(col, row, sample);
+                                hit_record rec;
+                                active_sampler->start_sample(col, row, sample);
+
+                                // Drawn on reshades too, so shading starts at the sample dimension a full render does
+                                ray r = get_ray(col, row);
+
+                                if (rebuild) {
+                                    h.origin = r.origin();
+                                    h.direction = r.direction();
+                                    h.time = r.time();
+                                    h.material_id = -1;
+
+                                    if (scene.hit(r, interval(0.001, infinity), rec)) {
+                                        // Keep uv even if unused now; a replacement material may read it
+                                        complete_hit(r, rec, true);
+
+                                        auto it = std::find(local_materials.begin(), local_materials.end(), rec.mat);
+                                        if (it == local_materials.end()) {
+                                            local_materials.push_back(rec.mat);
+                                            it = local_materials.end() - 1;
+                                        }
+
+                                        h.p = rec.p;
+                                        h.normal = rec.normal;
+                                        h.t = rec.t;
+                                        h.u = rec.u;
+                                        h.v = rec.v;
+                                        h.front_face = rec.front_face;
+                                        h.material_id = int(it - local_materials.begin());
+                                    }
+                                }
+
+                                if (h.material_id < 0) {
+                                    pixel_colour += miss_colour(ray(h.origin, h.direction, h.time));
+                                    continue;
+                                }
+
+                                if (!rebuild) {
+                                    rec.p = h.p;
+                                    rec.normal = h.normal;
+                                    rec.t = h.t;
+                                    rec.u = h.u;
+                                    rec.v = h.v;
+                                    rec.front_face = h.front_face;
+                                    rec.mat = cache.materials[h.material_id];
+                                }
+
+                                rec.footprint = rec.t * h.direction.length() * pixel_spread;
+                                pixel_colour += shade(ray(h.origin, h.direction, h.time), rec, max_depth, scene);
+                            }
+
+                            cache.image[row * image_width + col] = pixel_colour * pixel_samples_scale;
+                        }
+                    }
+
+                    #pragma omp critical
+                    {
+                        if (rebuild) cache.register_materials(t, local_materials);
+                        t.dirty = false;
+                        tiles_processed++;
+                        std::clog << "\rTiles remaining: " << (tile_count - tiles_processed) << ' ' << std::flush;
+                    }
+                }
+
+                active_sampler = nullptr;
+            }
+
+            std::clog << "\rDone.                       \n";
+            return cache.image;
         }
 
     private:
+        friend class render_scheduler;
+
         int image_height;                  // Image height in pixels
         double pixel_samples_scale;        // Colour scale factor for a sum of pixel samples
         point3 center;                     // Camera center
@@ -67,6 +405,8 @@ class camera {
         vec3 u, v, w;                      // Camera frame orthonormal basis vectors
         vec3 defocus_disk_u;               // Defocus disk horizontal radius
         vec3 defocus_disk_v;               // Defocus disk vertical radius
+        double pixel_spread;               // Angle subtended by one pixel, for ray cone footprints
+        shared_ptr<guiding_field> guide;   // Set only during a guided render
 
         void initialize() {
             // Calculate image height based on aspect ratio
@@ -99,6 +439,7 @@ class camera {
             // Location of upper left pixel
             point3 viewport_upper_left = center - (focus_dist * w) - (viewport_u / 2) - (viewport_v / 2);
             pixel00_loc = viewport_upper_left + 0.5 * (pixel_delta_u + pixel_delta_v);
+            pixel_spread = pixel_delta_u.length() / focus_dist;
 
             // Camera defocus disk basis vectors
             double defocus_radius = focus_dist * std::tan(degrees_to_radians(defocus_angle / 2));
@@ -106,6 +447,17 @@ class camera {
             defocus_disk_v = v * defocus_radius;
         }
 
+        // Mean of the pixel's camera samples; the caller sets active_sampler
+        colour render_pixel(int col, int row, const hittable &scene) const {
+            colour pixel_colour(0, 0, 0);
+            for (int sample = 0; sample < samples_per_pixel; sample++) {
+                active_sampler->start_sample(col, row, sample);
+                ray r = get_ray(col, row);
+                pixel_colour += ray_colour(r, max_depth, scene);
+            }
+            return pixel_colour * pixel_samples_scale;
+        }
+
         ray get_ray(int i, int j) const {
             vec3 offset = sample_square();
             point3 pixel_sample = pixel00_loc 
@@ -114,35 +466,915 @@ class camera {
 
             point3 ray_origin = (defocus_angle <= 0) ? center : defocus_disk_sample();
             vec3 ray_direction = pixel_sample - ray_origin;
+            double ray_time = shutter_close > shutter_open ? shutter_open + (shutter_close - shutter_open) * sample_1d() : shutter_open;
 
-            return ray(ray_origin, ray_direction);
+            return ray(ray_origin, ray_direction, ray_time);
         }
 
         vec3 sample_square() const {
-            return vec3(random_double() - 0.5, random_double() - 0.5, 0);
+            double u1, u2;
+            sample_2d(u1, u2);
+            return vec3(u1 - 0.5, u2 - 0.5, 0);
         }
 
         point3 defocus_disk_sample() const {
-            vec3 p = random_in_unit_disk();
+            vec3 p = sample_in_unit_disk();
             return center + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
         }
 
-        colour ray_colour(const ray &r, int depth, const hittable &scene) const {
+        // bsdf_pdf and prev_normal describe the scattering that produced r, for weighting emission it hits
+        // against light sampling; a zero bsdf_pdf (camera or specular) takes the emission in full.
+        colour ray_colour(const ray &r, int depth, const hittable &scene, double cone_width = 0,
+                          double bsdf_pdf = 0, const vec3 &prev_normal = vec3(0, 0, 0)) const {
             if (depth <= 0) return colour(0, 0, 0);
 
             hit_record rec;
 
-            if (!scene.hit(r, interval(0.001, infinity), rec)) return background;
+            if (!scene.hit(r, interval(0.001, infinity), rec)) return miss_colour(r, bsdf_pdf);
+            return hit_colour(r, rec, depth, scene, cone_width, bsdf_pdf, prev_normal);
+        }
+
+        // ray_colour() for a ray already known to hit rec
+        colour hit_colour(const ray &r, hit_record &rec, int depth, const hittable &scene, double cone_width,
+                          double bsdf_pdf, const vec3 &prev_normal) const {
+            complete_hit(r, rec);
+            render_stats.path_vertices++;
 
+            // Ray cone grown by the pixel spread; bounces keep the spread rather than modelling curvature
+            rec.footprint = cone_width + rec.t * r.direction().length() * pixel_spread;
+
+            double emission_weight = 1;
+            if (lights && bsdf_pdf > 0 && rec.prim) {
+                double light_pdf = lights->pmf(r.origin(), prev_normal, rec.prim)
+                                 * rec.prim->pdf_value(r.origin(), r.direction());
+                emission_weight = power_heuristic(bsdf_pdf, light_pdf);
+            }
+
+            return shade(r, rec, depth, scene, emission_weight);
+        }
+
+        // Emission plus scattered light at a known hit
+        colour shade(const ray &r, const hit_record &rec, int depth, const hittable &scene,
+                     double emission_weight = 1) const {
             ray scattered;
             colour attenuation;
-            colour colour_from_emission = rec.mat->emitted(rec.u, rec.v, rec.p);
+            colour colour_from_emission = emission_weight * rec.mat->emitted(rec.u, rec.v, rec.p);
 
             if (!rec.mat->scatter(r, rec, attenuation, scattered)) return colour_from_emission;
 
-            colour colour_from_scatter = attenuation * ray_colour(scattered, depth - 1, scene);
-            return colour_from_emission + colour_from_scatter;
+            double bsdf_pdf = rec.mat->scattering_pdf(r, rec, scattered);
+            colour colour_from_lights(0, 0, 0);
+            int region = -1;
+            if (bsdf_pdf > 0) {
+                if (guide) region = guide->region(rec.p);
+                colour_from_lights = sample_lights(r, rec, attenuation, scene, region)
+                                   + sample_environment(r, rec, attenuation, scene, region);
+                // Points in media have no normal to cache irradiance about
+                if (irradiance && !gathering_irradiance && rec.normal.length_squared() > 0) {
+                    return colour_from_emission + colour_from_lights + attenuation * cached_irradiance(rec, r.time(), depth, scene) / pi;
+                }
+                if (guide) {
+                    bsdf_pdf = guided_scatter(r, rec, region, scattered, attenuation);
+                    if (bsdf_pdf <= 0) return colour_from_emission + colour_from_lights;
+                }
+            }
+
+            colour incoming = ray_colour(scattered, depth - 1, scene, rec.footprint, bsdf_pdf, rec.normal);
+            if (region >= 0) guide->record(region, scattered.direction(), luminance(incoming) / bsdf_pdf);
+
+            return colour_from_emission + colour_from_lights + attenuation * incoming;
+        }
+
+        // Irradiance at rec from the cache, gathering a new record there if none is close enough. The
+        // record's rays take the light-sampled share of direct light out by MIS, as a BSDF sample would,
+        // and leave at the time of the path that reached rec.
+        colour cached_irradiance(const hit_record &rec, double time, int depth, const hittable &scene) const {
+            // No bounces left to gather with, and a black record would darken later lookups nearby
+            if (depth <= 1) return colour(0, 0, 0);
+
+            colour result;
+            if (irradiance->lookup(rec.p, rec.normal, result)) return result;
+
+            const int m = irradiance_cache::theta_strata, n = irradiance_cache::phi_strata;
+            std::vector<colour> radiance(m * n, colour(0, 0, 0));
+            std::vector<double> distance(m * n, infinity);
+            onb frame(rec.normal);
+
+            // The pixel's sample sequence is not meant for hundreds of extra rays
+            sampler *pixel_sequence = active_sampler;
+            active_sampler = nullptr;
+            gathering_irradiance = true;
+
+            for (int j = 0; j < m; j++) {
+                for (int k = 0; k < n; k++) {
+                    double sin_squared = (j + random_double()) / m;
+                    double cos_theta = std::sqrt(1 - sin_squared), sin_theta = std::sqrt(sin_squared);
+                    double phi = 2 * pi * (k + random_double()) / n;
+                    ray r(rec.p, frame.transform(vec3(sin_theta * std::cos(phi), sin_theta * std::sin(phi), cos_theta)), time);
+
+                    hit_record h;
+                    if (!scene.hit(r, interval(0.001, infinity), h)) {
+                        radiance[j * n + k] = miss_colour(r, cos_theta / pi);
+                        continue;
+                    }
+                    distance[j * n + k] = h.t;
+                    radiance[j * n + k] = hit_colour(r, h, depth - 1, scene, rec.footprint, cos_theta / pi, rec.normal);
+                }
+            }
+
+            gathering_irradiance = false;
+            active_sampler = pixel_sequence;
+
+            irradiance_cache::record fresh = irradiance_cache::from_samples(rec.p, frame, radiance, distance);
+            irradiance->insert(fresh, rec.footprint);
+            return fresh.irradiance;
+        }
+
+        // With a trained guiding field, replaces the BSDF's direction by one from the learned light at rec
+        // half the time. Sets attenuation for the direction taken and returns the density of the mixture,
+        // or 0 for a guided direction the material cannot scatter into, which is then not traced.
+        double guided_scatter(const ray &r, const hit_record &rec, int region, ray &scattered, colour &attenuation) const {
+            const directional_tree *learned = guide->distribution(region);
+            if (!learned) return rec.mat->scattering_pdf(r, rec, scattered);
+
+            if (sample_1d() < guided_fraction) {
+                double u1, u2;
+                sample_2d(u1, u2);
+                scattered = ray(rec.p, learned->sample(u1, u2), r.time());
+            }
+
+            double bsdf_pdf = rec.mat->scattering_pdf(r, rec, scattered);
+            if (bsdf_pdf <= 0) return 0;
+
+            double pdf = guided_fraction * learned->pdf(scattered.direction()) + (1 - guided_fraction) * bsdf_pdf;
+            attenuation = rec.mat->scattering_value(r, rec, scattered) / pdf;
+            return pdf;
+        }
+
+        // Density of the bounce direction at rec, including guided sampling, for MIS against light sampling
+        double sampling_pdf(const ray &r, const hit_record &rec, int region, const ray &scattered) const {
+            double bsdf_pdf = rec.mat->scattering_pdf(r, rec, scattered);
+            const directional_tree *learned = guide->distribution(region);
+            if (!learned) return bsdf_pdf;
+            return guided_fraction * learned->pdf(scattered.direction()) + (1 - guided_fraction) * bsdf_pdf;
+        }
+
+        // One light picked by the light BVH, MIS-weighted against the BSDF sample that hit() may also find.
+        // region is where rec lies in the guiding field, or -1 without one.
+        colour sample_lights(const ray &r, const hit_record &rec, const colour &attenuation, const hittable &scene,
+                             int region = -1) const {
+            if (!lights) return colour(0, 0, 0);
+
+            const hittable *light;
+            double pmf;
+            if (!lights->sample(rec.p, rec.normal, sample_1d(), light, pmf)) return colour(0, 0, 0);
+
+            ray shadow(rec.p, unit_vector(light->random(rec.p)), r.time());
+            double light_pdf = pmf * light->pdf_value(shadow.origin(), shadow.direction());
+            if (light_pdf <= 0) return colour(0, 0, 0);
+
+            double scattering_pdf = rec.mat->scattering_pdf(r, rec, shadow);
+            if (scattering_pdf <= 0) return colour(0, 0, 0);
+
+            hit_record light_rec;
+            if (!light->hit(shadow, interval(0.001, infinity), light_rec)) return colour(0, 0, 0);
+            if (scene.occluded(shadow, interval(0.001, light_rec.t - 0.001))) return colour(0, 0, 0);
+            complete_hit(shadow, light_rec, true);
+
+            colour emitted = light_rec.mat->emitted(light_rec.u, light_rec.v, light_rec.p);
+            double weight = power_heuristic(light_pdf, region >= 0 ? sampling_pdf(r, rec, region, shadow) : scattering_pdf);
+            if (region >= 0) guide->record(region, shadow.direction(), weight * luminance(emitted) / light_pdf);
+            return weight * attenuation * emitted * (scattering_pdf / light_pdf);
+        }
+
+        // Light from the environment along a ray that escaped, weighted like emission against its sampling
+        colour miss_colour(const ray &r, double bsdf_pdf = 0) const {
+            if (!environment) return background;
+            double weight = bsdf_pdf > 0 ? power_heuristic(bsdf_pdf, environment->pdf(r.direction())) : 1;
+            return weight * environment->value(r.direction());
+        }
+
+        // One direction drawn from the environment map, MIS-weighted against the BSDF sample that may escape
+        colour sample_environment(const ray &r, const hit_record &rec, const colour &attenuation,
+                                  const hittable &scene, int region = -1) const {
+            if (!environment) return colour(0, 0, 0);
+
+            double u1, u2, env_pdf;
+            sample_2d(u1, u2);
+            ray shadow(rec.p, environment->sample(u1, u2, env_pdf), r.time());
+            if (env_pdf <= 0) return colour(0, 0, 0);
+
+            double scattering_pdf = rec.mat->scattering_pdf(r, rec, shadow);
+            if (scattering_pdf <= 0) return colour(0, 0, 0);
+            if (scene.occluded(shadow, interval(0.001, infinity))) return colour(0, 0, 0);
+
+            colour incoming = environment->value(shadow.direction());
+            double weight = power_heuristic(env_pdf, region >= 0 ? sampling_pdf(r, rec, region, shadow) : scattering_pdf);
+            if (region >= 0) guide->record(region, shadow.direction(), weight * luminance(incoming) / env_pdf);
+            return weight * attenuation * incoming * (scattering_pdf / env_pdf);
+        }
+
+        static double power_heuristic(double f_pdf, double g_pdf) {
+            double f = f_pdf * f_pdf, g = g_pdf * g_pdf;
+            return f + g > 0 ? f / (f + g) : 0;
+        }
+
+        // Bidirectional path tracing (Veach 1997). Each camera sample also traces a light subpath from an
+        // emitter picked by power; every pair of prefixes of the two is connected, and each connection is
+        // weighted by the power heuristic over all the ways the same path could have been sampled. Light
+        // subpaths joined straight to the pinhole land in arbitrary pixels and are splatted there.
+        std::vector<colour> render_bidirectional(const hittable &scene) {
+            std::vector<colour> image(image_height * image_width, colour(0, 0, 0));
+            splat_film splats(image.size());
+            int rows_processed = 0;
+
+            omp_set_num_threads(8);
+            #pragma omp parallel
+            {
+                shared_ptr<sampler> thread_sampler = pixel_sampler->clone();
+                active_sampler = thread_sampler.get();
+                std::vector<path_vertex> camera_path, light_path;
+
+                #pragma omp for schedule(dynamic)
+                for (int row = 0; row < image_height; row++) {
+                    for (int col = 0; col < image_width; col++) {
+                        colour pixel_colour(0, 0, 0);
+                        for (int sample = 0; sample < samples_per_pixel; sample++) {
+                            active_sampler->start_sample(col, row, sample);
+                            pixel_colour += bidirectional_sample(col, row, scene, splats, camera_path, light_path);
+                        }
+                        image[row * image_width + col] = pixel_colour * pixel_samples_scale;
+                    }
+
+                    #pragma omp atomic
+                    rows_processed++;
+
+                    #pragma omp critical
+                    std::clog << "\rScanlines remaining: " << (image_height - rows_processed) << ' ' << std::flush;
+                }
+
+                active_sampler = nullptr;
+            }
+
+            std::clog << "\rDone.                       \n";
+
+            // One light subpath was traced per camera sample, so splats average over the same count
+            for (size_t i = 0; i < image.size(); i++) image[i] += pixel_samples_scale * splats.get(i);
+            return image;
+        }
+
+        colour bidirectional_sample(int col, int row, const hittable &scene, splat_film &splats,
+                                    std::vector<path_vertex> &camera_path, std::vector<path_vertex> &light_path) const {
+            colour radiance(0, 0, 0);
+
+            ray r = get_ray(col, row);
+            double time = r.time();
+            path_vertex eye;
+            eye.type = path_vertex::camera_end;
+            eye.p = r.origin();
+            eye.normal = vec3(0, 0, 0);
+            eye.beta = colour(1, 1, 1);
+            eye.delta = defocus_angle > 0;         // Only a pinhole can be connected to
+            camera_path.assign(1, eye);
+
+            int image_col, image_row;
+            double pdf_dir;
+            camera_importance(r.direction(), pdf_dir, image_col, image_row);
+
+            // Nothing samples the background, so paths escaping to it take it in full
+            colour beta(1, 1, 1);
+            if (trace_subpath(scene, r, beta, pdf_dir, size_t(max_depth) + 1, camera_path)) {
+                radiance += beta * miss_colour(r);
+            }
+
+            light_path.clear();
+            const hittable *light;
+            double pmf;
+            if (lights->sample_emitter(sample_1d(), light, pmf)) start_light_path(scene, light, pmf, time, light_path);
+
+            for (int t = 1; t <= int(camera_path.size()); t++) {
+                for (int s = 0; s <= int(light_path.size()); s++) {
+                    if (s + t < 2 || (s == 1 && t == 1) || s + t - 1 > max_depth) continue;
+                    radiance += connect(scene, light_path, s, camera_path, t, time, splats);
+                }
+            }
+
+            return radiance;
+        }
+
+        // Point, normal and emitted light of a point sampled on light; false if the light cannot be sampled
+        bool sample_emitter_point(const hittable *light, double pmf, path_vertex &v) const {
+            point3 p;
+            vec3 n;
+            double u1, u2;
+            sample_2d(u1, u2);
+            double area = light->surface_area();
+            if (area <= 0 || !light->sample_surface(u1, u2, p, n)) return false;
+
+            // Hit the point from outside to find its material and texture coordinates
+            hit_record rec;
+            ray probe(p + n, -n);
+            if (!light->hit(probe, interval(0.5, 1.5), rec)) return false;
+            complete_hit(probe, rec);
+
+            v = path_vertex();
+            v.type = path_vertex::light_end;
+            v.p = p;
+            v.normal = n;
+            v.light = light;
+            v.emission = rec.mat->emitted(rec.u, rec.v, rec.p);
+            v.pdf_fwd = pmf / area;
+            v.beta = v.emission / v.pdf_fwd;
+            return true;
+        }
+
+        // Emitters shine from both faces, so the first direction is cosine-distributed about a random side
+        void start_light_path(const hittable &scene, const hittable *light, double pmf, double time,
+                              std::vector<path_vertex> &path) const {
+            path_vertex v;
+            if (!sample_emitter_point(light, pmf, v)) return;
+            if (sample_1d() < 0.5) v.normal = -v.normal;
+            path.push_back(v);
+
+            vec3 direction = v.normal + sample_unit_vector();
+            if (direction.near_zero()) direction = v.normal;
+            double cos_theta = dot(v.normal, unit_vector(direction));
+            double pdf_dir = cos_theta / (2 * pi);
+            if (pdf_dir <= 0) return;
+
+            ray r(v.p, direction, time);
+            colour beta = v.beta * cos_theta / pdf_dir;
+            trace_subpath(scene, r, beta, pdf_dir, size_t(max_depth), path);
+        }
+
+        // Extends path, whose last vertex sent r with solid-angle density pdf_dir and throughput beta, until
+        // it has max_vertices vertices or reaches a surface that does not scatter. Returns true if it escapes,
+        // leaving r and beta as they were for the escaping ray.
+        bool trace_subpath(const hittable &scene, ray &r, colour &beta, double pdf_dir, size_t max_vertices,
+                           std::vector<path_vertex> &path) const {
+            while (path.size() < max_vertices) {
+                hit_record rec;
+                if (!scene.hit(r, interval(0.001, infinity), rec)) return true;
+                complete_hit(r, rec);
+
+                path_vertex v;
+                v.p = rec.p;
+                v.normal = rec.normal;
+                v.rec = rec;
+                v.beta = beta;
+                v.emission = rec.mat->emitted(rec.u, rec.v, rec.p);
+                if (v.emission.length_squared() > 0) v.light = rec.prim;
+                v.pdf_fwd = area_density(pdf_dir, path.back(), v);
+                path.push_back(v);
+                if (path.size() >= max_vertices) break;
+
+                ray scattered;
+                colour attenuation;
+                if (!rec.mat->scatter(r, rec, attenuation, scattered)) break;
+
+                // Specular scattering has no density to weigh against, and is never connected to
+                double pdf_next = rec.mat->scattering_pdf(r, rec, scattered);
+                double pdf_back = 0;
+                if (pdf_next > 0) {
+                    pdf_back = rec.mat->scattering_pdf(ray(scattered.at(1), -scattered.direction()), rec,
+                                                       ray(rec.p, -r.direction()));
+                } else {
+                    path.back().delta = true;
+                }
+                path[path.size() - 2].pdf_rev = area_density(pdf_back, path.back(), path[path.size() - 2]);
+
+                beta = beta * attenuation;
+                pdf_dir = pdf_next;
+                r = scattered;
+            }
+
+            return false;
+        }
+
+        // Contribution of the path made of the first s light and first t camera vertices, both traced at
+        // time. With t == 1 it is splatted to the pixel the light vertex projects to and nothing is returned.
+        colour connect(const hittable &scene, std::vector<path_vertex> &light_path, int s,
+                       std::vector<path_vertex> &camera_path, int t, double time, splat_film &splats) const {
+            const path_vertex &pt = camera_path[t - 1];
+            path_vertex sampled;                   // New endpoint when s or t is 1
+            colour contribution(0, 0, 0);
+            size_t splat_pixel = 0;
+
+            if (s == 0) {
+                if (!pt.light) return colour(0, 0, 0);
+                contribution = pt.beta * pt.emission;
+            } else if (t == 1) {
+                const path_vertex &qs = light_path[s - 1];
+                if (qs.delta || camera_path[0].delta) return colour(0, 0, 0);
+
+                vec3 to_camera = center - qs.p;
+                double distance = to_camera.length();
+                double pdf_camera;
+                int col, row;
+                double importance = camera_importance(-to_camera, pdf_camera, col, row);
+                if (importance <= 0) return colour(0, 0, 0);
+
+                double cos_camera = dot(-to_camera / distance, -w);
+                sampled = camera_path[0];
+                sampled.beta = colour(1, 1, 1) * (importance * cos_camera / (distance * distance));
+
+                const path_vertex &before = light_path[s - 2];
+                colour f = qs.rec.mat->scattering_value(ray(before.p, qs.p - before.p), qs.rec, ray(qs.p, to_camera));
+                contribution = qs.beta * f * sampled.beta;
+                if (contribution.length_squared() == 0) return colour(0, 0, 0);
+                if (scene.occluded(ray(qs.p, to_camera / distance, time), interval(0.001, distance - 0.001))) return colour(0, 0, 0);
+                splat_pixel = size_t(row) * image_width + col;
+            } else if (s == 1) {
+                if (pt.delta) return colour(0, 0, 0);
+
+                const hittable *light;
+                double pmf;
+                if (!lights->sample_emitter(sample_1d(), light, pmf) || !sample_emitter_point(light, pmf, sampled)) {
+                    return colour(0, 0, 0);
+                }
+
+                vec3 to_light = sampled.p - pt.p;
+                double distance = to_light.length();
+                if (distance <= 0) return colour(0, 0, 0);
+
+                const path_vertex &before = camera_path[t - 2];
+                colour f = pt.rec.mat->scattering_value(ray(before.p, pt.p - before.p), pt.rec, ray(pt.p, to_light));
+                double cos_light = std::fabs(dot(sampled.normal, to_light)) / distance;
+                contribution = pt.beta * f * sampled.beta * (cos_light / (distance * distance));
+                if (contribution.length_squared() == 0) return colour(0, 0, 0);
+                if (scene.occluded(ray(pt.p, to_light / distance, time), interval(0.001, distance - 0.001))) return colour(0, 0, 0);
+            } else {
+                const path_vertex &qs = light_path[s - 1];
+                if (qs.delta || pt.delta) return colour(0, 0, 0);
+
+                vec3 d = qs.p - pt.p;
+                double distance = d.length();
+                if (distance <= 0) return colour(0, 0, 0);
+
+                const path_vertex &camera_before = camera_path[t - 2];
+                const path_vertex &light_before = light_path[s - 2];
+                colour fp = pt.rec.mat->scattering_value(ray(camera_before.p, pt.p - camera_before.p), pt.rec, ray(pt.p, d));
+                colour fq = qs.rec.mat->scattering_value(ray(light_before.p, qs.p - light_before.p), qs.rec, ray(qs.p, -d));
+                contribution = qs.beta * fq * pt.beta * fp / (distance * distance);
+                if (contribution.length_squared() == 0) return colour(0, 0, 0);
+                if (scene.occluded(ray(pt.p, d / distance, time), interval(0.001, distance - 0.001))) return colour(0, 0, 0);
+            }
+
+            double weight = mis_weight(light_path, s, camera_path, t, sampled);
+            if (t == 1) {
+                splats.add(splat_pixel, weight * contribution);
+                return colour(0, 0, 0);
+            }
+            return weight * contribution;
+        }
+
+        // Power heuristic over every strategy that could have made this path. The vertices at the join and
+        // their neighbours briefly take the densities this strategy implies (PBRT's formulation).
+        double mis_weight(std::vector<path_vertex> &light_path, int s, std::vector<path_vertex> &camera_path, int t,
+                          const path_vertex &sampled) const {
+            if (s + t == 2) return 1;
+
+            path_vertex *qs = s > 0 ? &light_path[s - 1] : nullptr;
+            path_vertex *pt = &camera_path[t - 1];
+            path_vertex *qs_minus = s > 1 ? &light_path[s - 2] : nullptr;
+            path_vertex *pt_minus = t > 1 ? &camera_path[t - 2] : nullptr;
+
+            // Emitters outside the light BVH can only be found by hitting them
+            if (s == 0 && emitter_origin_pdf(*pt) <= 0) return 1;
+
+            path_vertex saved_qs = qs ? *qs : path_vertex(), saved_pt = *pt;
+            double saved_qs_minus = qs_minus ? qs_minus->pdf_rev : 0;
+            double saved_pt_minus = pt_minus ? pt_minus->pdf_rev : 0;
+
+            if (s == 1) *qs = sampled;
+            if (t == 1) *pt = sampled;
+            pt->delta = false;
+            if (qs) qs->delta = false;
+
+            pt->pdf_rev = s > 0 ? vertex_pdf(*qs, qs_minus, *pt) : emitter_origin_pdf(*pt);
+            if (pt_minus) pt_minus->pdf_rev = s > 0 ? vertex_pdf(*pt, qs, *pt_minus) : emission_pdf(*pt, *pt_minus);
+            if (qs) qs->pdf_rev = vertex_pdf(*pt, pt_minus, *qs);
+            if (qs_minus) qs_minus->pdf_rev = vertex_pdf(*qs, pt, *qs_minus);
+
+            auto remap = [](double pdf) { return pdf != 0 ? pdf : 1; };
+            double sum = 0;
+            double ratio = 1;
+            for (int i = t - 1; i > 0; i--) {
+                double r = remap(camera_path[i].pdf_rev) / remap(camera_path[i].pdf_fwd);
+                ratio *= r * r;
+                if (!camera_path[i].delta && !camera_path[i - 1].delta) sum += ratio;
+            }
+            ratio = 1;
+            for (int i = s - 1; i >= 0; i--) {
+                double r = remap(light_path[i].pdf_rev) / remap(light_path[i].pdf_fwd);
+                ratio *= r * r;
+                bool delta_before = i > 0 && light_path[i - 1].delta;
+                if (!light_path[i].delta && !delta_before) sum += ratio;
+            }
+
+            if (qs) *qs = saved_qs;
+            *pt = saved_pt;
+            if (qs_minus) qs_minus->pdf_rev = saved_qs_minus;
+            if (pt_minus) pt_minus->pdf_rev = saved_pt_minus;
+
+            return 1 / (1 + sum);
+        }
+
+        // Area density at next of v sending a path there, having been reached from prev
+        double vertex_pdf(const path_vertex &v, const path_vertex *prev, const path_vertex &next) const {
+            if (v.type == path_vertex::light_end) return emission_pdf(v, next);
+
+            vec3 to_next = next.p - v.p;
+            double pdf_dir = 0;
+            if (v.type == path_vertex::camera_end) {
+                int col, row;
+                camera_importance(to_next, pdf_dir, col, row);
+            } else if (prev) {
+                pdf_dir = v.rec.mat->scattering_pdf(ray(prev->p, v.p - prev->p), v.rec, ray(v.p, to_next));
+            }
+            return area_density(pdf_dir, v, next);
+        }
+
+        // Area density at next of light leaving emitter vertex v towards it
+        double emission_pdf(const path_vertex &v, const path_vertex &next) const {
+            vec3 direction = unit_vector(next.p - v.p);
+            return area_density(std::fabs(dot(v.normal, direction)) / (2 * pi), v, next);
+        }
+
+        // Area density of a light subpath starting at v
+        double emitter_origin_pdf(const path_vertex &v) const {
+            double area = v.light ? v.light->surface_area() : 0;
+            return area > 0 ? lights->emitter_pmf(v.light) / area : 0;
+        }
+
+        // Solid-angle density pdf_dir of a direction leaving from, as a density per unit area at to
+        static double area_density(double pdf_dir, const path_vertex &from, const path_vertex &to) {
+            vec3 d = to.p - from.p;
+            double distance_squared = d.length_squared();
+            if (distance_squared == 0) return 0;
+
+            double pdf = pdf_dir / distance_squared;
+            if (to.normal.length_squared() > 0) pdf *= std::fabs(dot(to.normal, d)) / std::sqrt(distance_squared);
+            return pdf;
+        }
+
+        // Importance of a pinhole camera ray along direction, normalised over the whole image, and the
+        // solid-angle density of camera rays along it; zero outside the frame. col and row get the pixel.
+        double camera_importance(const vec3 &direction, double &pdf, int &col, int &row) const {
+            pdf = 0;
+            double along = dot(direction, -w);
+            if (along <= 0) return 0;
+
+            point3 on_viewport = center + direction * (focus_dist / along);
+            vec3 offset = on_viewport - (pixel00_loc - 0.5 * (pixel_delta_u + pixel_delta_v));
+            double x = dot(offset, pixel_delta_u) / pixel_delta_u.length_squared();
+            double y = dot(offset, pixel_delta_v) / pixel_delta_v.length_squared();
+            if (x < 0 || x >= image_width || y < 0 || y >= image_height) return 0;
+            col = int(x);
+            row = int(y);
+
+            // Image area at unit distance from the pinhole
+            double area = image_width * pixel_delta_u.length() * image_height * pixel_delta_v.length()
+                        / (focus_dist * focus_dist);
+            double cos_theta = along / direction.length();
+            double cos2 = cos_theta * cos_theta;
+            pdf = 1 / (area * cos2 * cos_theta);
+            return 1 / (area * cos2 * cos2);
+        }
+
+        // Repeated low-sample passes over every tile until the time budget or samples_per_pixel runs out.
+        // A pass only starts if the measured time per pass says it will finish within the budget.
+        std::vector<colour> render_progressive(const hittable &scene) {
+            using clock = std::chrono::steady_clock;
+
+            std::vector<colour> sum(image_height * image_width, colour(0, 0, 0));
+            std::vector<colour> image(image_height * image_width, colour(0, 0, 0));
+            int tiles_x = (image_width + tile_size - 1) / tile_size;
+            int tiles_y = (image_height + tile_size - 1) / tile_size;
+            int spp_done = 0;
+
+            auto start = clock::now();
+            auto last_snapshot = start;
+            auto seconds_since = [](clock::time_point t) {
+                return std::chrono::duration<double>(clock::now() - t).count();
+            };
+
+            omp_set_num_threads(8);
+            while (spp_done < samples_per_pixel) {
+                int pass = std::min(std::max(pass_samples, 1), samples_per_pixel - spp_done);
+                double elapsed = seconds_since(start);
+                if (spp_done > 0 && elapsed + elapsed / spp_done * pass > time_budget) break;
+
+                #pragma omp parallel
+                {
+                    shared_ptr<sampler> thread_sampler = pixel_sampler->clone();
+                    active_sampler = thread_sampler.get();
+
+                    #pragma omp for schedule(dynamic)
+                    for (int tile = 0; tile < tiles_x * tiles_y; tile++) {
+                        int x0 = (tile % tiles_x) * tile_size;
+                        int y0 = (tile / tiles_x) * tile_size;
+
+                        for (int row = y0; row < std::min(y0 + tile_size, image_height); row++) {
+                            for (int col = x0; col < std::min(x0 + tile_size, image_width); col++) {
+                                for (int sample = spp_done; sample < spp_done + pass; sample++) {
+                                    active_sampler->start_sample(col, row, sample);
+                                    sum[row * image_width + col] += ray_colour(get_ray(col, row), max_depth, scene);
+                                }
+                            }
+                        }
+                    }
+
+                    active_sampler = nullptr;
+                }
+
+                spp_done += pass;
+                elapsed = seconds_since(start);
+
+                // Whichever comes first: the sample cap at the measured rate, or the end of the budget
+                double predicted = std::fmin(time_budget, samples_per_pixel * elapsed / spp_done);
+                std::clog << "\rSamples per pixel: " << spp_done << ", elapsed " << elapsed
+                          << "s, estimated completion " << predicted << "s " << std::flush;
+
+                if (snapshot_interval > 0 && seconds_since(last_snapshot) >= snapshot_interval) {
+                    resolve(sum, spp_done, image);
+                    std::ofstream out(snapshot_path);
+                    write_image(out, image);
+                    last_snapshot = clock::now();
+                }
+            }
+
+            resolve(sum, spp_done, image);
+            std::clog << "\nDone: " << spp_done << " samples per pixel in " << seconds_since(start) << "s\n";
+            return image;
+        }
+
+        static void resolve(const std::vector<colour> &sum, int spp, std::vector<colour> &image) {
+            for (size_t i = 0; i < sum.size(); i++) image[i] = sum[i] / spp;
+        }
+
+        static constexpr double guided_fraction = 0.5;  // Share of guided bounces drawn from the learned light
+
+        // Path guiding (Müller et al. 2017). Passes of 4, 8, 16... samples per pixel each guide diffuse
+        // bounces with the light learned in the pass before and record into a refined field for the next;
+        // the last pass takes whatever the doubling leaves over and, with no pass after it, records nothing.
+        // Passes are averaged weighted by their sample counts over their measured variance, so the early,
+        // poorly guided ones count for little.
+        std::vector<colour> render_guided(const hittable &scene) {
+            guide = make_shared<guiding_field>(scene.bounding_box());
+
+            std::vector<colour> weighted(image_height * image_width, colour(0, 0, 0));
+            std::vector<colour> sum(image_height * image_width);
+            std::vector<double> luminance_sum(image_height * image_width);
+            std::vector<double> luminance_squares(image_height * image_width);
+            double total_weight = 0;
+            double unguided_variance = 0;
+            int spp_done = 0;
+
+            omp_set_num_threads(8);
+            for (int pass = 0, pass_spp = 4; spp_done < samples_per_pixel; pass++, pass_spp *= 2) {
+                int remaining = samples_per_pixel - spp_done;
+                int spp = remaining < 3 * pass_spp ? remaining : pass_spp;
+                if (spp == remaining) guide->freeze();
+
+                std::fill(sum.begin(), sum.end(), colour(0, 0, 0));
+                std::fill(luminance_sum.begin(), luminance_sum.end(), 0.0);
+                std::fill(luminance_squares.begin(), luminance_squares.end(), 0.0);
+
+                #pragma omp parallel
+                {
+                    shared_ptr<sampler> thread_sampler = pixel_sampler->clone();
+                    active_sampler = thread_sampler.get();
+
+                    #pragma omp for schedule(dynamic)
+                    for (int row = 0; row < image_height; row++) {
+                        for (int col = 0; col < image_width; col++) {
+                            int pixel = row * image_width + col;
+                            for (int sample = spp_done; sample < spp_done + spp; sample++) {
+                                active_sampler->start_sample(col, row, sample);
+                                colour c = ray_colour(get_ray(col, row), max_depth, scene);
+                                sum[pixel] += c;
+                                luminance_sum[pixel] += luminance(c);
+                                luminance_squares[pixel] += luminance(c) * luminance(c);
+                            }
+                        }
+                    }
+
+                    active_sampler = nullptr;
+                }
+
+                // Mean over pixels of the variance of one sample, which does not depend on the pass length
+                double variance = 0;
+                for (size_t i = 0; i < sum.size(); i++) {
+                    double mean = luminance_sum[i] / spp;
+                    variance += std::fmax(0.0, luminance_squares[i] - spp * mean * mean) / std::max(spp - 1, 1);
+                }
+                variance /= sum.size();
+                if (pass == 0) unguided_variance = variance;
+
+                double weight = variance > 0 ? 1 / variance : 1;
+                for (size_t i = 0; i < sum.size(); i++) weighted[i] += weight * sum[i];
+                total_weight += weight * spp;
+                spp_done += spp;
+
+                std::clog << "Guiding pass " << pass << ": " << spp << " spp, " << guide->leaf_count()
+                          << " regions, variance per sample " << variance;
+                if (pass > 0 && variance > 0) std::clog << ", reduction over unguided pass 0 " << unguided_variance / variance << 'x';
+                std::clog << '\n';
+
+                if (spp_done < samples_per_pixel) guide->refine(pass);
+            }
+
+            guide.reset();
+            for (auto &c : weighted) c = c / total_weight;
+            return weighted;
+        }
+
+        static constexpr size_t shade_run = 256;  // Most hits one wavefront shading run scatters at once
+
+        // Structure-of-arrays state for one wavefront of paths
+        struct path_queue {
+            std::vector<ray> rays;
+            std::vector<int> pixels;
+            std::vector<colour> throughput;
+            std::vector<colour> radiance;
+            std::vector<double> cone_width;
+            std::vector<hit_record> recs;
+            std::vector<char> hits;
+            std::vector<char> alive;
+
+            size_t size() const { return rays.size(); }
+
+            // Reorders every per-path array by order[new index] = old index
+            void permute(const std::vector<size_t> &order) {
+                apply(rays, order);
+                apply(pixels, order);
+                apply(throughput, order);
+                apply(radiance, order);
+                apply(cone_width, order);
+                apply(recs, order);
+                apply(hits, order);
+            }
+
+            template <typename T>
+            static void apply(std::vector<T> &values, const std::vector<size_t> &order) {
+                std::vector<T> sorted(order.size());
+                for (size_t i = 0; i < order.size(); i++) sorted[i] = std::move(values[order[i]]);
+                values.swap(sorted);
+            }
+        };
+
+        // Wavefront path tracing. Batches of paths move through separate stages: generate camera rays,
+        // extend them to their closest hits with one hit_batch() call, sort by material and direction,
+        // shade, then collect finished paths into the image. Samples come from independent randoms here,
+        // since a path's dimensions are not consumed on one thread.
+        std::vector<colour> render_wavefront(const hittable &scene) {
+            std::vector<colour> image(image_height * image_width, colour(0, 0, 0));
+            size_t total = size_t(image_width) * image_height * samples_per_pixel;
+            path_queue queue;
+
+            for (size_t first = 0; first < total; first += batch_size) {
+                size_t count = std::min(total - first, size_t(batch_size));
+                generate_paths(queue, first, count);
+
+                for (int depth = 0; depth < max_depth && queue.size() > 0; depth++) {
+                    extend_paths(queue, scene);
+                    if (sort_by_material) sort_paths(queue);
+                    shade_paths(queue);
+                    collect_paths(queue, image);
+                }
+
+                // Paths cut off at max_depth keep what they gathered so far
+                for (size_t k = 0; k < queue.size(); k++) image[queue.pixels[k]] += queue.radiance[k];
+
+                std::clog << "\rSamples remaining: " << (total - std::min(total, first + count)) << ' ' << std::flush;
+            }
+
+            for (auto &pixel : image) pixel *= pixel_samples_scale;
+
+            std::clog << "\rDone.                       \n";
+            return image;
+        }
+
+        void generate_paths(path_queue &queue, size_t first, size_t count) const {
+            queue.rays.resize(count);
+            queue.pixels.resize(count);
+            queue.throughput.assign(count, colour(1, 1, 1));
+            queue.radiance.assign(count, colour(0, 0, 0));
+            queue.cone_width.assign(count, 0);
+
+            for (size_t k = 0; k < count; k++) {
+                int pixel = int((first + k) / samples_per_pixel);
+                queue.pixels[k] = pixel;
+                queue.rays[k] = get_ray(pixel % image_width, pixel / image_width);
+            }
+        }
+
+        // Closest hits for the whole wavefront, then the surface data for each of them
+        void extend_paths(path_queue &queue, const hittable &scene) const {
+            scene.hit_batch(queue.rays, interval(0.001, infinity), queue.recs, queue.hits);
+
+            #pragma omp parallel for schedule(static)
+            for (size_t k = 0; k < queue.size(); k++) {
+                if (queue.hits[k]) complete_hit(queue.rays[k], queue.recs[k]);
+            }
+        }
+
+        // Groups hits by material type, then material instance, then ray direction octant, with misses last
+        void sort_paths(path_queue &queue) const {
+            size_t n = queue.size();
+            std::vector<std::tuple<size_t, uintptr_t, int>> keys(n);
+
+            for (size_t k = 0; k < n; k++) {
+                if (!queue.hits[k]) {
+                    keys[k] = {SIZE_MAX, 0, 0};
+                    continue;
+                }
+
+                const material &mat = *queue.recs[k].mat;
+                const vec3 &dir = queue.rays[k].direction();
+                int octant = (dir.x() < 0 ? 1 : 0) | (dir.y() < 0 ? 2 : 0) | (dir.z() < 0 ? 4 : 0);
+                // Halved type hash keeps SIZE_MAX free for misses
+                keys[k] = {typeid(mat).hash_code() >> 1, reinterpret_cast<uintptr_t>(&mat), octant};
+            }
+
+            std::vector<size_t> order(n);
+            for (size_t k = 0; k < n; k++) order[k] = k;
+            std::sort(order.begin(), order.end(), [&keys](size_t a, size_t b) { return keys[a] < keys[b]; });
+
+            queue.permute(order);
+        }
+
+        // Hits are scattered in runs of one material instance, so its textures are evaluated as a batch;
+        // sorting by material makes the runs long, and capping them keeps the threads balanced
+        void shade_paths(path_queue &queue) const {
+            size_t n = queue.size();
+            queue.alive.assign(n, 0);
+
+            std::vector<std::pair<size_t, size_t>> runs;
+            for (size_t first = 0; first < n;) {
+                size_t last = first + 1;
+                while (last < n && last - first < shade_run && queue.hits[last] == queue.hits[first]
+                       && (!queue.hits[first] || queue.recs[last].mat == queue.recs[first].mat)) last++;
+                runs.push_back({first, last});
+                first = last;
+            }
+
+            #pragma omp parallel for schedule(dynamic)
+            for (size_t i = 0; i < runs.size(); i++) {
+                size_t first = runs[i].first, count = runs[i].second - first;
+                if (!queue.hits[first]) {
+                    for (size_t k = first; k < first + count; k++) {
+                        queue.radiance[k] += queue.throughput[k] * miss_colour(queue.rays[k]);
+                    }
+                    continue;
+                }
+
+                for (size_t k = first; k < first + count; k++) {
+                    hit_record &rec = queue.recs[k];
+                    rec.footprint = queue.cone_width[k] + rec.t * queue.rays[k].direction().length() * pixel_spread;
+                    queue.radiance[k] += queue.throughput[k] * rec.mat->emitted(rec.u, rec.v, rec.p);
+                }
+
+                ray scattered[shade_run];
+                colour attenuation[shade_run];
+                bool did_scatter[shade_run];
+                queue.recs[first].mat->scatter_batch(&queue.rays[first], &queue.recs[first], count, attenuation,
+                                                     scattered, did_scatter);
+
+                for (size_t j = 0; j < count; j++) {
+                    if (!did_scatter[j]) continue;
+                    size_t k = first + j;
+                    queue.throughput[k] = queue.throughput[k] * attenuation[j];
+                    queue.cone_width[k] = queue.recs[k].footprint;
+                    queue.rays[k] = scattered[j];
+                    queue.alive[k] = 1;
+                }
+            }
+        }
+
+        // Retires finished paths into the image and compacts the survivors
+        void collect_paths(path_queue &queue, std::vector<colour> &image) const {
+            size_t live = 0;
+            for (size_t k = 0; k < queue.size(); k++) {
+                if (!queue.alive[k]) {
+                    image[queue.pixels[k]] += queue.radiance[k];
+                    continue;
+                }
+
+                queue.rays[live] = queue.rays[k];
+                queue.pixels[live] = queue.pixels[k];
+                queue.throughput[live] = queue.throughput[k];
+                queue.radiance[live] = queue.radiance[k];
+                queue.cone_width[live] = queue.cone_width[k];
+                live++;
+            }
 
+            queue.rays.resize(live);
+            queue.pixels.resize(live);
+            queue.throughput.resize(live);
+            queue.radiance.resize(live);
+            queue.cone_width.resize(live);
         }
 };
 
@@ -1,11 +1,16 @@
 #ifndef COLOUR_H
 #define COLOUR_H
 
+#include "fast_math.h"
 #include "interval.h"
 #include "vec3.h"
 
 using colour = vec3;
 
+inline double luminance(const colour &c) {
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
 inline double linear_to_gamma(double linear_component) {
     if (linear_component > 0) {
         return std::sqrt(linear_component);
@@ -14,19 +19,11 @@ inline double linear_to_gamma(double linear_component) {
     }
 }
 
-void write_colour(std::ostream &out, const colour &pixel_colour) {
-    double r = pixel_colour.x();
-    double g = pixel_colour.y();
-    double b = pixel_colour.z();
-
-    r = linear_to_gamma(r);
-    g = linear_to_gamma(g);
-    b = linear_to_gamma(b);
-
-    static const interval intensity(0.000, 0.999);
-    int rbyte = int(256 * intensity.clamp(r));
-    int gbyte = int(256 * intensity.clamp(g));
-    int bbyte = int(256 * intensity.clamp(b));
+// Gamma-encodes with linear_to_gamma and quantizes to [0, 255], through a table that gives the same bytes
+inline void write_colour(std::ostream &out, const colour &pixel_colour) {
+    int rbyte = gamma_encoder::encode(pixel_colour.x());
+    int gbyte = gamma_encoder::encode(pixel_colour.y());
+    int bbyte = gamma_encoder::encode(pixel_colour.z());
 
     out << rbyte << ' ' << gbyte << ' ' << bbyte << '\n';
 }
@@ -0,0 +1,204 @@
+#ifndef COMPACT_BVH_H
+#define COMPACT_BVH_H
+
+#include "aabb.h"
+#include "hittable.h"
+#include "hittable_list.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// Flattened BVH with child boxes quantized to Q (uint8_t or uint16_t) relative to the parent's box and
+// 32-bit child references. A node is 20 bytes with 8-bit bounds and 32 bytes with 16-bit bounds.
+// Quantization rounds outwards, so boxes only ever grow slightly.
+template <typename Q>
+class compact_bvh : public hittable {
+    public:
+        compact_bvh(hittable_list list) : owned(list.objects) {
+            bbox = aabb::empty;
+            for (const auto &object : owned) bbox = aabb(bbox, object->bounding_box());
+
+            if (owned.empty()) return;
+
+            std::vector<const hittable *> objects;
+            for (const auto &object : owned) objects.push_back(object.get());
+
+            nodes.reserve(owned.size());
+            primitives.reserve(owned.size());
+            root = build(objects, 0, objects.size(), bbox);
+        }
+
+        bool hit(const ray &r, interval ray_t, hit_record &rec) const override {
+            if (owned.empty() || !bbox.hit(r, ray_t)) return false;
+            if (root & leaf_flag) return primitives[root & ~leaf_flag]->hit(r, ray_t, rec);
+
+            struct entry {
+                uint32_t node;
+                aabb box;
+            };
+
+            entry stack[64];
+            int top = 0;
+            stack[top++] = {root, bbox};
+
+            bool hit_anything = false;
+            double closest = ray_t.max;
+
+            while (top > 0) {
+                entry current = stack[--top];
+                const node &n = nodes[current.node];
+                render_stats.nodes_visited++;
+
+                for (int c = 0; c < 2; c++) {
+                    aabb child_box = decode(current.box, n, c);
+                    if (!child_box.hit(r, interval(ray_t.min, closest))) continue;
+
+                    if (n.child[c] & leaf_flag) {
+                        if (primitives[n.child[c] & ~leaf_flag]->hit(r, interval(ray_t.min, closest), rec)) {
+                            hit_anything = true;
+                            closest = rec.t;
+                        }
+                    } else {
+                        stack[top++] = {n.child[c], child_box};
+                    }
+                }
+            }
+
+            return hit_anything;
+        }
+
+        bool occluded(const ray &r, interval ray_t) const override {
+            if (owned.empty() || !bbox.hit(r, ray_t)) return false;
+            if (root & leaf_flag) return primitives[root & ~leaf_flag]->occluded(r, ray_t);
+
+            struct entry {
+                uint32_t node;
+                aabb box;
+            };
+
+            entry stack[64];
+            int top = 0;
+            stack[top++] = {root, bbox};
+
+            while (top > 0) {
+                entry current = stack[--top];
+                const node &n = nodes[current.node];
+                render_stats.nodes_visited++;
+
+                for (int c = 0; c < 2; c++) {
+                    aabb child_box = decode(current.box, n, c);
+                    if (!child_box.hit(r, ray_t)) continue;
+
+                    if (n.child[c] & leaf_flag) {
+                        if (primitives[n.child[c] & ~leaf_flag]->occluded(r, ray_t)) return true;
+                    } else {
+                        stack[top++] = {n.child[c], child_box};
+                    }
+                }
+            }
+
+            return false;
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        size_t node_count() const { return nodes.size(); }
+
+        size_t node_bytes() const { return nodes.size() * sizeof(node); }
+
+        void account_memory(memory_report &report) const override {
+            if (!report.first_visit(this)) return;
+            report.add(memory_report::bvh, shared_bytes<compact_bvh>() + vector_bytes(nodes) + vector_bytes(primitives));
+            report.add(memory_report::geometry, vector_bytes(owned));
+            for (const auto &object : owned) object->account_memory(report);
+        }
+
+        // Bytes a tree over object_count objects allocates, including its copy of the object list
+        static size_t estimate_bytes(size_t object_count) {
+            return shared_bytes<compact_bvh>() + object_count * (sizeof(node) + sizeof(const hittable *) + sizeof(shared_ptr<hittable>));
+        }
+
+    private:
+        static constexpr uint32_t leaf_flag = 0x80000000u;
+        static constexpr double q_max = std::numeric_limits<Q>::max();
+
+        struct node {
+            Q lo[2][3];
+            Q hi[2][3];
+            uint32_t child[2];             // Node index, or primitive index with leaf_flag set
+        };
+
+        std::vector<node> nodes;
+        std::vector<const hittable *> primitives;
+        std::vector<shared_ptr<hittable>> owned;
+        aabb bbox;
+        uint32_t root = 0;
+
+        // Children are quantized against the decoded (not the exact) parent box, which is what traversal sees
+        uint32_t build(std::vector<const hittable *> &objects, size_t start, size_t end, const aabb &box) {
+            if (end - start == 1) {
+                primitives.push_back(objects[start]);
+                return uint32_t(primitives.size() - 1) | leaf_flag;
+            }
+
+            int axis = box.longest_axis();
+            std::sort(objects.begin() + start, objects.begin() + end, [axis](const hittable *a, const hittable *b) {
+                return a->bounding_box().axis_interval(axis).min < b->bounding_box().axis_interval(axis).min;
+            });
+
+            size_t mid = start + (end - start) / 2;
+            size_t ranges[2][2] = {{start, mid}, {mid, end}};
+
+            uint32_t index = uint32_t(nodes.size());
+            nodes.emplace_back();
+
+            for (int c = 0; c < 2; c++) {
+                aabb child_box = aabb::empty;
+                for (size_t i = ranges[c][0]; i < ranges[c][1]; i++) {
+                    child_box = aabb(child_box, objects[i]->bounding_box());
+                }
+
+                for (int a = 0; a < 3; a++) {
+                    const interval &parent = box.axis_interval(a);
+                    const interval &exact = child_box.axis_interval(a);
+                    double extent = parent.size();
+
+                    double lo = extent > 0 ? std::floor((exact.min - parent.min) / extent * q_max) : 0;
+                    double hi = extent > 0 ? std::ceil((exact.max - parent.min) / extent * q_max) : q_max;
+                    Q qlo = Q(std::clamp(lo, 0.0, q_max));
+                    Q qhi = Q(std::clamp(hi, 0.0, q_max));
+
+                    // Step outwards if rounding in the decode would cut into the exact box
+                    while (qlo > 0 && dequantize(parent, qlo) > exact.min) qlo--;
+                    while (qhi < Q(q_max) && dequantize(parent, qhi) < exact.max) qhi++;
+
+                    nodes[index].lo[c][a] = qlo;
+                    nodes[index].hi[c][a] = qhi;
+                }
+
+                uint32_t child = build(objects, ranges[c][0], ranges[c][1], decode(box, nodes[index], c));
+                nodes[index].child[c] = child;
+            }
+
+            return index;
+        }
+
+        static double dequantize(const interval &parent, Q q) {
+            return parent.min + parent.size() * (q / q_max);
+        }
+
+        static aabb decode(const aabb &parent, const node &n, int c) {
+            aabb box;
+            box.x = interval(dequantize(parent.x, n.lo[c][0]), dequantize(parent.x, n.hi[c][0]));
+            box.y = interval(dequantize(parent.y, n.lo[c][1]), dequantize(parent.y, n.hi[c][1]));
+            box.z = interval(dequantize(parent.z, n.lo[c][2]), dequantize(parent.z, n.hi[c][2]));
+            return box;
+        }
+};
+
+using compact_bvh8 = compact_bvh<uint8_t>;
+using compact_bvh16 = compact_bvh<uint16_t>;
+
+#endif
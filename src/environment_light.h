@@ -0,0 +1,216 @@
+#ifndef ENVIRONMENT_LIGHT_H
+#define ENVIRONMENT_LIGHT_H
+
+#include "colour.h"
+#include "memory_report.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Walker's alias table: picks index i with probability weights[i] / sum(weights) in constant time
+class alias_table {
+    public:
+        alias_table() {}
+
+        alias_table(const std::vector<double> &weights) {
+            size_t n = weights.size();
+            double total = 0;
+            for (double w : weights) total += w;
+            if (n == 0 || total <= 0) return;
+
+            probability.assign(n, 1.0f);
+            alias.resize(n);
+            for (size_t i = 0; i < n; i++) alias[i] = uint32_t(i);
+
+            // Vose's method: pair each under-full bucket with an over-full one
+            std::vector<double> scaled(n);
+            std::vector<uint32_t> small, large;
+            for (size_t i = 0; i < n; i++) {
+                scaled[i] = weights[i] * n / total;
+                (scaled[i] < 1 ? small : large).push_back(uint32_t(i));
+            }
+            while (!small.empty() && !large.empty()) {
+                uint32_t s = small.back(), l = large.back();
+                small.pop_back();
+                probability[s] = float(scaled[s]);
+                alias[s] = l;
+                scaled[l] -= 1 - scaled[s];
+                if (scaled[l] < 1) {
+                    large.pop_back();
+                    small.push_back(l);
+                }
+            }
+        }
+
+        bool empty() const { return alias.empty(); }
+        size_t size() const { return alias.size(); }
+
+        // Index for u in [0, 1), and u rescaled to [0, 1) for reuse
+        size_t sample(double u, double &remapped) const {
+            size_t n = alias.size();
+            double scaled = u * n;
+            size_t i = std::min(size_t(scaled), n - 1);
+            double coin = scaled - i;
+
+            if (coin < probability[i]) {
+                remapped = std::fmin(coin / probability[i], 0.99999999999999989);
+                return i;
+            }
+            remapped = std::fmin((coin - probability[i]) / (1 - probability[i]), 0.99999999999999989);
+            return alias[i];
+        }
+
+        size_t bytes() const { return vector_bytes(probability) + vector_bytes(alias); }
+
+    private:
+        std::vector<float> probability;    // Chance of keeping bucket i rather than taking its alias
+        std::vector<uint32_t> alias;
+};
+
+// Distant light from an equirectangular HDR image in PFM format; row 0 is straight up (+y) and the
+// horizontal angle follows sphere's uv mapping. Texels are importance sampled in proportion to their
+// luminance times the solid angle they cover, so directions towards the sun are found by light sampling
+// rather than by chance. Lookups by direction are a single texel fetch.
+class environment_light {
+    public:
+        environment_light(const std::string &path, double scale = 1) : scale(scale) {
+            if (!read_pfm(path)) {
+                std::cerr << "ERROR: Could not load environment map '" << path << "'.\n";
+                width = height = 0;
+                texels.clear();
+                return;
+            }
+            build_distribution();
+        }
+
+        environment_light(int width, int height, std::vector<colour> texels, double scale = 1)
+          : width(width), height(height), scale(scale), texels(std::move(texels)) {
+            build_distribution();
+        }
+
+        bool valid() const { return !texels.empty(); }
+
+        // Radiance arriving from direction, which need not be normalised
+        colour value(const vec3 &direction) const {
+            if (!valid()) return colour(0, 0, 0);
+            return scale * texels[texel_index(unit_vector(direction))];
+        }
+
+        // Direction drawn from the luminance distribution, with its solid-angle density
+        vec3 sample(double u1, double u2, double &pdf) const {
+            pdf = 0;
+            if (distribution.empty()) return vec3(0, 1, 0);
+
+            double u_col;
+            size_t i = distribution.sample(u1, u_col);
+            int row = int(i / width), col = int(i % width);
+
+            double theta = pi * (row + u2) / height;
+            double phi = 2 * pi * (col + u_col) / width;
+            double sin_theta = std::sin(theta);
+            if (sin_theta <= 0) return vec3(0, 1, 0);
+
+            pdf = texel_pmf(i) * width * height / (2 * pi * pi * sin_theta);
+            return vec3(-sin_theta * std::cos(phi), std::cos(theta), sin_theta * std::sin(phi));
+        }
+
+        // Solid-angle density of sample() returning direction
+        double pdf(const vec3 &direction) const {
+            if (distribution.empty()) return 0;
+            vec3 d = unit_vector(direction);
+            double sin_theta = std::sqrt(std::fmax(0.0, 1 - d.y() * d.y()));
+            if (sin_theta <= 0) return 0;
+            return texel_pmf(texel_index(d)) * width * height / (2 * pi * pi * sin_theta);
+        }
+
+        void account_memory(memory_report &report) const {
+            if (!report.first_visit(this)) return;
+            report.add(memory_report::textures, shared_bytes<environment_light>() + vector_bytes(texels)
+                                              + distribution.bytes());
+        }
+
+    private:
+        int width = 0;
+        int height = 0;
+        double scale;
+        std::vector<colour> texels;        // Row-major, top row first
+        alias_table distribution;
+        double total_weight = 0;
+
+        // Luminance times the sine of the row's polar angle, proportional to radiant power per texel
+        double texel_weight(size_t i) const {
+            double theta = pi * (int(i / width) + 0.5) / height;
+            return std::fmax(0.0, luminance(texels[i])) * std::sin(theta);
+        }
+
+        double texel_pmf(size_t i) const { return total_weight > 0 ? texel_weight(i) / total_weight : 0; }
+
+        void build_distribution() {
+            std::vector<double> weights(texels.size());
+            total_weight = 0;
+            for (size_t i = 0; i < texels.size(); i++) {
+                weights[i] = texel_weight(i);
+                total_weight += weights[i];
+            }
+            distribution = alias_table(weights);
+        }
+
+        size_t texel_index(const vec3 &d) const {
+            double theta = fast_math_kernels ? fast_acos(d.y()) : std::acos(std::clamp(d.y(), -1.0, 1.0));
+            double phi = (fast_math_kernels ? fast_atan2(-d.z(), d.x()) : std::atan2(-d.z(), d.x())) + pi;
+            int row = std::min(int(theta / pi * height), height - 1);
+            int col = std::min(int(phi / (2 * pi) * width), width - 1);
+            return size_t(row) * width + col;
+        }
+
+        // "PF" is RGB and "Pf" greyscale; a negative scale marks little-endian data, stored bottom row first
+        bool read_pfm(const std::string &path) {
+            std::ifstream in(path, std::ios::binary);
+            std::string magic;
+            double endian;
+            in >> magic >> width >> height >> endian;
+            in.get();
+            if (!in || (magic != "PF" && magic != "Pf") || width <= 0 || height <= 0) return false;
+
+            int channels = magic == "PF" ? 3 : 1;
+            bool swap = (endian < 0) != is_little_endian();
+            std::vector<float> row_data(size_t(width) * channels);
+            texels.assign(size_t(width) * height, colour(0, 0, 0));
+
+            for (int row = height - 1; row >= 0; row--) {
+                in.read(reinterpret_cast<char *>(row_data.data()), std::streamsize(row_data.size() * sizeof(float)));
+                if (!in) return false;
+                if (swap) for (float &f : row_data) f = byte_swap(f);
+
+                for (int col = 0; col < width; col++) {
+                    const float *p = &row_data[size_t(col) * channels];
+                    texels[size_t(row) * width + col] = channels == 3 ? colour(p[0], p[1], p[2]) : colour(p[0], p[0], p[0]);
+                }
+            }
+            return true;
+        }
+
+        static bool is_little_endian() {
+            uint16_t one = 1;
+            unsigned char first;
+            std::memcpy(&first, &one, 1);
+            return first == 1;
+        }
+
+        static float byte_swap(float f) {
+            unsigned char bytes[4];
+            std::memcpy(bytes, &f, 4);
+            std::swap(bytes[0], bytes[3]);
+            std::swap(bytes[1], bytes[2]);
+            std::memcpy(&f, bytes, 4);
+            return f;
+        }
+};
+
+#endif
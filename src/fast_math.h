@@ -0,0 +1,122 @@
+#ifndef FAST_MATH_H
+#define FAST_MATH_H
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+// Branch-light replacements for libm calls on the hot path. The polynomial approximations only replace
+// libm while fast_math_kernels is set, which RAYTRACER_FAST_MATH makes the default; pow5() and the gamma
+// encoder are exact and always used. Error bounds are checked by `raytracer fast-math-accuracy`.
+
+#ifdef RAYTRACER_FAST_MATH
+inline bool fast_math_kernels = true;
+#else
+inline bool fast_math_kernels = false;
+#endif
+
+// x^5 with multiplies rather than a general pow()
+inline double pow5(double x) {
+    double x2 = x * x;
+    return x2 * x2 * x;
+}
+
+// acos on [-1, 1], Abramowitz and Stegun 4.4.46; maximum absolute error 2.2e-8 rad
+inline double fast_acos(double x) {
+    double a = std::fabs(x);
+    double p = -0.0012624911;
+    p = p * a + 0.0066700901;
+    p = p * a - 0.0170881256;
+    p = p * a + 0.0308918810;
+    p = p * a - 0.0501743046;
+    p = p * a + 0.0889789874;
+    p = p * a - 0.2145988016;
+    p = p * a + 1.5707963050;
+    double r = std::sqrt(std::fmax(0.0, 1 - a)) * p;
+    return x < 0 ? 3.14159265358979323846 - r : r;
+}
+
+// atan2 from an odd polynomial for atan on [0, 1] and octant folding; maximum absolute error 2e-6 rad
+inline double fast_atan2(double y, double x) {
+    double ax = std::fabs(x), ay = std::fabs(y);
+    double hi = std::fmax(ax, ay), lo = std::fmin(ax, ay);
+    double a = hi > 0 ? lo / hi : 0;
+    double s = a * a;
+
+    double p = -0.01172120;
+    p = p * s + 0.05265332;
+    p = p * s - 0.11643287;
+    p = p * s + 0.19354346;
+    p = p * s - 0.33262347;
+    p = p * s + 0.99997726;
+    double r = a * p;
+
+    r = ay > ax ? 1.57079632679489661923 - r : r;
+    r = x < 0 ? 3.14159265358979323846 - r : r;
+    return std::copysign(r, y);
+}
+
+// Bit-exact table version of the byte encoding write_colour has always used, int(256 * clamp(sqrt(x),
+// 0, 0.999)). Inputs are bucketed by their exponent and top 8 mantissa bits; a bucket is narrower than
+// the gap between two output levels, so one comparison against the next level's threshold finishes it.
+class gamma_encoder {
+    public:
+        static unsigned char encode(double linear) { return table.lookup(linear); }
+
+        // The libm formulation, kept as the reference for the table
+        static unsigned char encode_exact(double linear) {
+            double gamma = linear > 0 ? std::sqrt(linear) : 0;
+            gamma = gamma < 0.000 ? 0.000 : gamma > 0.999 ? 0.999 : gamma;
+            return (unsigned char)(int(256 * gamma));
+        }
+
+    private:
+        static const gamma_encoder table;
+
+        static constexpr int mantissa_bits = 8;
+        static constexpr double smallest = 1.0 / 65536;   // Below this the output is always 0
+        static constexpr int buckets = 16 << mantissa_bits;
+
+        std::array<unsigned char, buckets> base;
+        std::array<double, 257> threshold;                // Smallest input encoding to each level
+
+        gamma_encoder() {
+            for (int k = 0; k < 256; k++) {
+                double t = (k / 256.0) * (k / 256.0);
+                while (t > 0 && encode_exact(std::nextafter(t, 0.0)) >= k) t = std::nextafter(t, 0.0);
+                while (encode_exact(t) < k) t = std::nextafter(t, 1.0);
+                threshold[k] = t;
+            }
+            threshold[256] = INFINITY;
+
+            for (int i = 0; i < buckets; i++) {
+                uint64_t bits = first_bits() + (uint64_t(i) << shift());
+                double edge;
+                std::memcpy(&edge, &bits, sizeof(edge));
+                base[i] = encode_exact(edge);
+            }
+        }
+
+        static constexpr int shift() { return 52 - mantissa_bits; }
+
+        static uint64_t first_bits() {
+            uint64_t bits;
+            std::memcpy(&bits, &smallest, sizeof(bits));
+            return bits;
+        }
+
+        unsigned char lookup(double linear) const {
+            if (!(linear >= smallest)) return 0;          // Also catches NaN
+            if (linear >= 1) return 255;
+
+            uint64_t bits;
+            std::memcpy(&bits, &linear, sizeof(bits));
+            unsigned char level = base[(bits - first_bits()) >> shift()];
+            return level + (linear >= threshold[level + 1] ? 1 : 0);
+        }
+};
+
+inline const gamma_encoder gamma_encoder::table;
+
+#endif
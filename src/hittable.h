@@ -3,9 +3,17 @@
 
 #include "utils.h"
 #include "aabb.h"
+#include "memory_report.h"
+
+#include <cstdint>
+#include <utility>
+#include <vector>
 
 class material;
+class hittable;
 
+// Traversal only fills t, prim and any local parameters the primitive needs; complete_hit() builds the
+// rest of the surface interaction once, for the closest hit.
 class hit_record {
     public:
         point3 p;
@@ -14,12 +22,59 @@ class hit_record {
         double t;
         double u;
         double v;
+        double footprint = 0;              // World-space width of the ray cone at p, for texture filtering
         bool front_face;
+        const hittable *prim = nullptr;    // Primitive that was hit, or null once nothing is left to complete
+
+        // What each instance around prim hit inside it, innermost first. Instances push as their hits
+        // return and pop as they complete, so the entries for the closest hit are always on top; older
+        // entries left by hits that were later beaten fall off the bottom.
+        static constexpr int max_instance_depth = 4;
+        const hittable *instanced[max_instance_depth];
+        int instance_depth = 0;
 
         void set_face_normal(const ray &r, const vec3 &outward_normal) {
             front_face = dot(r.direction(), outward_normal) < 0;
             normal = front_face ? outward_normal : -outward_normal;
         }
+
+        // Called by an instance whose child reported this hit: keeps the child's prim and reports the instance
+        void push_instance(const hittable *instance) {
+            if (instance_depth == max_instance_depth) {
+                for (int i = 1; i < max_instance_depth; i++) instanced[i - 1] = instanced[i];
+                instance_depth--;
+            }
+            instanced[instance_depth++] = prim;
+            prim = instance;
+        }
+
+        // Called by that instance when completing: hands the hit back to its child
+        void pop_instance() {
+            prim = instance_depth > 0 ? instanced[--instance_depth] : nullptr;
+        }
+};
+
+// Work done by the current thread, read by the camera's cost maps. Counting is a plain thread-local
+// increment, cheap enough to leave on.
+struct render_counters {
+    uint64_t nodes_visited = 0;        // Acceleration structure nodes entered
+    uint64_t primitive_tests = 0;      // Ray-primitive intersection tests
+    uint64_t path_vertices = 0;        // Surface hits shaded by the camera
+    uint64_t medium_queries = 0;       // Rays tracked through participating media
+    uint64_t density_lookups = 0;      // Medium density evaluations made while tracking them
+};
+
+inline thread_local render_counters render_stats;
+
+// Conservative description of an emitter or group of emitters for light importance sampling: where the
+// light is, how much it emits, and a cone (axis, spread cos_theta_o) bounding its surface normals, with
+// emission reaching at most theta_e beyond those normals.
+struct light_bound {
+    aabb bounds;
+    double power = 0;
+    vec3 axis = vec3(0, 0, 1);
+    double cos_theta_o = 1;
+    double cos_theta_e = 0;
 };
 
 class hittable {
@@ -28,9 +83,80 @@ class hittable {
 
         virtual bool hit(const ray &r, interval ray_t, hit_record &rec) const = 0;
 
+        // Whether anything intersects the ray within ray_t. Stops at the first intersection found, in any
+        // order, and never builds surface data.
+        virtual bool occluded(const ray &r, interval ray_t) const {
+            hit_record rec;
+            return hit(r, ray_t, rec);
+        }
+
+        // Closest hits for a whole batch of rays. Scenes that stream geometry in override this to group
+        // rays by the data they need.
+        virtual void hit_batch(const std::vector<ray> &rays, interval ray_t,
+                               std::vector<hit_record> &recs, std::vector<char> &hits) const {
+            recs.resize(rays.size());
+            hits.resize(rays.size());
+
+            #pragma omp parallel for schedule(dynamic, 64)
+            for (size_t i = 0; i < rays.size(); i++) {
+                hits[i] = hit(rays[i], ray_t, recs[i]) ? 1 : 0;
+            }
+        }
+
+        // Bounds over the whole shutter
         virtual aabb bounding_box() const = 0;
+
+        // Boxes at times 0 and 1 whose linear interpolation holds the object at every time between, so
+        // a BVH over moving objects can bound them at the ray's time; both are bounding_box() for
+        // objects that stay still
+        virtual void motion_bounds(aabb &start, aabb &end) const { start = end = bounding_box(); }
+
+        // Bounds of the part of this object inside box; shapes that can do better than the bounding box
+        // override it so spatial splits get tight boxes
+        virtual aabb clipped_bounds(const aabb &box) const {
+            aabb b = bounding_box();
+            return aabb(interval(std::fmax(b.x.min, box.x.min), std::fmin(b.x.max, box.x.max)),
+                        interval(std::fmax(b.y.min, box.y.min), std::fmin(b.y.max, box.y.max)),
+                        interval(std::fmax(b.z.min, box.z.min), std::fmin(b.z.max, box.z.max)));
+        }
+
+        // Fills p, normal, front_face, mat and, when asked for or read by the material, u and v for a hit
+        // this object reported through rec.prim
+        virtual void complete(const ray &r, hit_record &rec, bool need_uv) const {}
+
+        // Solid-angle density, from origin, of the directions random() returns
+        virtual double pdf_value(const point3 &origin, const vec3 &direction) const {
+            return 0.0;
+        }
+
+        // Direction from origin towards a point sampled on this object
+        virtual vec3 random(const point3 &origin) const {
+            return vec3(1, 0, 0);
+        }
+
+        // Point drawn uniformly over the surface with the outward normal there, for starting light paths;
+        // false for shapes that cannot do this
+        virtual bool sample_surface(double u1, double u2, point3 &p, vec3 &normal) const {
+            return false;
+        }
+
+        virtual double surface_area() const {
+            return 0.0;
+        }
+
+        // Fills bound and returns true if this object emits light
+        virtual bool emission_bound(light_bound &bound) const {
+            return false;
+        }
+
+        // Adds the estimated heap bytes of this object and everything it references
+        virtual void account_memory(memory_report &report) const {}
 };
 
+inline void complete_hit(const ray &r, hit_record &rec, bool need_uv = false) {
+    if (rec.prim) rec.prim->complete(r, rec, need_uv);
+}
+
 class translate : public hittable {
     public:
         translate(shared_ptr<hittable> object, const vec3 &offset) : object(object), offset(offset) {
@@ -38,13 +164,36 @@ class translate : public hittable {
         }
 
         bool hit(const ray &r, interval ray_t, hit_record &rec) const override {
-            ray offset_r(r.origin() - offset, r.direction());
-            if (!object->hit(offset_r, ray_t, rec)) return false;
-            rec.p += offset;
+            if (!object->hit(ray(r.origin() - offset, r.direction(), r.time()), ray_t, rec)) return false;
+            rec.push_instance(this);
             return true;
         }
 
+        bool occluded(const ray &r, interval ray_t) const override {
+            return object->occluded(ray(r.origin() - offset, r.direction(), r.time()), ray_t);
+        }
+
+        // The child completes in object space, then the surface data is moved back to world space
+        void complete(const ray &r, hit_record &rec, bool need_uv) const override {
+            rec.pop_instance();
+            complete_hit(ray(r.origin() - offset, r.direction(), r.time()), rec, need_uv);
+            rec.p += offset;
+            rec.prim = this;
+        }
+
+        void account_memory(memory_report &report) const override {
+            if (!report.first_visit(this)) return;
+            report.add(memory_report::geometry, shared_bytes<translate>());
+            object->account_memory(report);
+        }
+
         aabb bounding_box() const override { return bbox; }
+
+        void motion_bounds(aabb &start, aabb &end) const override {
+            object->motion_bounds(start, end);
+            start = start + offset;
+            end = end + offset;
+        }
     
     private:
         shared_ptr<hittable> object;
@@ -52,6 +201,89 @@ class translate : public hittable {
         aabb bbox;
 };
 
+// Translation that moves through keyframes (time, offset), sorted by time within the shutter's 0 to 1;
+// the offset is interpolated linearly between them and held before the first and after the last
+class keyframed_translate : public hittable {
+    public:
+        keyframed_translate(shared_ptr<hittable> object, std::vector<std::pair<double, vec3>> keyframes)
+          : object(object), keyframes(keyframes) {
+            bbox = aabb::empty;
+            for (const auto &key : keyframes) bbox = aabb(bbox, object->bounding_box() + key.second);
+            bbox = aabb(bbox, object->bounding_box() + offset_at(0));
+            bbox = aabb(bbox, object->bounding_box() + offset_at(1));
+        }
+
+        bool hit(const ray &r, interval ray_t, hit_record &rec) const override {
+            if (!object->hit(ray(r.origin() - offset_at(r.time()), r.direction(), r.time()), ray_t, rec)) return false;
+            rec.push_instance(this);
+            return true;
+        }
+
+        bool occluded(const ray &r, interval ray_t) const override {
+            return object->occluded(ray(r.origin() - offset_at(r.time()), r.direction(), r.time()), ray_t);
+        }
+
+        void complete(const ray &r, hit_record &rec, bool need_uv) const override {
+            vec3 offset = offset_at(r.time());
+            rec.pop_instance();
+            complete_hit(ray(r.origin() - offset, r.direction(), r.time()), rec, need_uv);
+            rec.p += offset;
+            rec.prim = this;
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        // The line through the offsets at 0 and 1, widened until it reaches past every keyframe between
+        void motion_bounds(aabb &start, aabb &end) const override {
+            object->motion_bounds(start, end);
+            vec3 first = offset_at(0), last = offset_at(1);
+
+            interval widen[3] = {interval(0, 0), interval(0, 0), interval(0, 0)};
+            for (const auto &key : keyframes) {
+                if (key.first <= 0 || key.first >= 1) continue;
+                vec3 deviation = key.second - (first + key.first * (last - first));
+                for (int a = 0; a < 3; a++) {
+                    widen[a] = interval(std::fmin(widen[a].min, deviation[a]), std::fmax(widen[a].max, deviation[a]));
+                }
+            }
+
+            auto moved = [&](const aabb &box, const vec3 &offset) {
+                interval axes[3];
+                for (int a = 0; a < 3; a++) {
+                    const interval &extent = box.axis_interval(a);
+                    axes[a] = interval(extent.min + offset[a] + widen[a].min, extent.max + offset[a] + widen[a].max);
+                }
+                return aabb(axes[0], axes[1], axes[2]);
+            };
+            start = moved(start, first);
+            end = moved(end, last);
+        }
+
+        void account_memory(memory_report &report) const override {
+            if (!report.first_visit(this)) return;
+            report.add(memory_report::geometry, shared_bytes<keyframed_translate>() + vector_bytes(keyframes));
+            object->account_memory(report);
+        }
+
+    private:
+        shared_ptr<hittable> object;
+        std::vector<std::pair<double, vec3>> keyframes;
+        aabb bbox;
+
+        vec3 offset_at(double time) const {
+            if (keyframes.empty()) return vec3(0, 0, 0);
+            if (time <= keyframes.front().first) return keyframes.front().second;
+
+            for (size_t k = 1; k < keyframes.size(); k++) {
+                if (time > keyframes[k].first) continue;
+                double span = keyframes[k].first - keyframes[k - 1].first;
+                double s = span > 0 ? (time - keyframes[k - 1].first) / span : 1;
+                return keyframes[k - 1].second + s * (keyframes[k].second - keyframes[k - 1].second);
+            }
+            return keyframes.back().second;
+        }
+};
+
 class rotate_y : public hittable {
     public:
         rotate_y(shared_ptr<hittable> object, double angle) : object(object) {
@@ -87,17 +319,18 @@ class rotate_y : public hittable {
         }
 
         bool hit(const ray &r, interval ray_t, hit_record &rec) const override {
-            point3 origin = point3((cos_theta * r.origin().x()) - (sin_theta * r.origin().z()),
-                                   r.origin().y(),
-                                   (sin_theta * r.origin().x()) + (cos_theta * r.origin().z()));
-
-            vec3 direction = vec3((cos_theta * r.direction().x()) - (sin_theta * r.direction().z()),
-                                  r.direction().y(),
-                                  (sin_theta * r.direction().x()) + (cos_theta * r.direction().z()));
+            if (!object->hit(to_object(r), ray_t, rec)) return false;
+            rec.push_instance(this);
+            return true;
+        }
 
-            ray rotated_r(origin, direction);
+        bool occluded(const ray &r, interval ray_t) const override {
+            return object->occluded(to_object(r), ray_t);
+        }
 
-            if (!object->hit(rotated_r, ray_t, rec)) return false;
+        void complete(const ray &r, hit_record &rec, bool need_uv) const override {
+            rec.pop_instance();
+            complete_hit(to_object(r), rec, need_uv);
 
             rec.p = point3((cos_theta * rec.p.x()) + (sin_theta * rec.p.z()),
                            rec.p.y(),
@@ -107,12 +340,30 @@ class rotate_y : public hittable {
                               rec.normal.y(),
                               (-sin_theta * rec.normal.x()) + (cos_theta * rec.normal.z()));
 
-            return true;
+            rec.prim = this;
+        }
+
+        void account_memory(memory_report &report) const override {
+            if (!report.first_visit(this)) return;
+            report.add(memory_report::geometry, shared_bytes<rotate_y>());
+            object->account_memory(report);
         }
 
         aabb bounding_box() const override { return bbox; }
 
     private:
+        ray to_object(const ray &r) const {
+            point3 origin = point3((cos_theta * r.origin().x()) - (sin_theta * r.origin().z()),
+                                   r.origin().y(),
+                                   (sin_theta * r.origin().x()) + (cos_theta * r.origin().z()));
+
+            vec3 direction = vec3((cos_theta * r.direction().x()) - (sin_theta * r.direction().z()),
+                                  r.direction().y(),
+                                  (sin_theta * r.direction().x()) + (cos_theta * r.direction().z()));
+
+            return ray(origin, direction, r.time());
+        }
+
         shared_ptr<hittable> object;
         double sin_theta;
         double cos_theta;
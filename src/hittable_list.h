@@ -21,23 +21,35 @@ class hittable_list: public hittable {
             bbox = aabb(bbox, object->bounding_box());
         }
 
+        // Objects only write to rec when they report a hit, so closer hits simply overwrite it
         bool hit(const ray &r, interval ray_t, hit_record &rec) const override {
-            hit_record temp_rec;
             bool hit_anything = false;
             double closest = ray_t.max;
 
             for (const auto &object: objects) {
-                if (object->hit(r, interval(ray_t.min, closest), temp_rec)) {
+                if (object->hit(r, interval(ray_t.min, closest), rec)) {
                     hit_anything = true;
-                    closest = temp_rec.t;
-                    rec = temp_rec;
+                    closest = rec.t;
                 }
             }
 
             return hit_anything;
         }
 
+        bool occluded(const ray &r, interval ray_t) const override {
+            for (const auto &object : objects) {
+                if (object->occluded(r, ray_t)) return true;
+            }
+            return false;
+        }
+
         aabb bounding_box() const override { return bbox; }
+
+        void account_memory(memory_report &report) const override {
+            if (!report.first_visit(this)) return;
+            report.add(memory_report::geometry, shared_bytes<hittable_list>() + vector_bytes(objects));
+            for (const auto &object : objects) object->account_memory(report);
+        }
     
     private:
         aabb bbox;
@@ -0,0 +1,277 @@
+#ifndef IRRADIANCE_CACHE_H
+#define IRRADIANCE_CACHE_H
+
+#include "colour.h"
+#include "memory_report.h"
+#include "onb.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Set while the rays for a cache record are traced, so the diffuse hits they find are path traced
+// rather than served from the cache the record is about to join
+inline thread_local bool gathering_irradiance = false;
+
+// Indirect irradiance at sparse points on diffuse surfaces, interpolated between them (Ward et al. 1988)
+// with rotation and translation gradients (Ward and Heckbert 1992). A record is valid out to accuracy
+// times the harmonic mean distance of what its rays hit, clamped to a range of pixel footprints, so
+// records crowd into corners and spread out over open floors.
+//
+// Records live in a hashed grid with one level per power-of-two cell size; each is filed under the cells
+// of the level that just holds its valid region, so a lookup probes one cell per level in use. Buckets are
+// lock-free lists that only ever grow at the head, so any number of threads can look up and insert.
+class irradiance_cache {
+    public:
+        static constexpr int theta_strata = 8;
+        static constexpr int phi_strata = 32;
+
+        struct record {
+            point3 p;
+            vec3 normal;
+            colour irradiance;
+            double radius;                 // Harmonic mean distance to the surfaces the rays hit, clamped
+            vec3 rotation_gradient[3];     // One per colour channel
+            vec3 translation_gradient[3];
+        };
+
+        // Records are trusted out to accuracy times their radius, which lies between min_spacing and
+        // max_spacing pixel footprints; smaller values cost more records and blur less.
+        irradiance_cache(double accuracy = 0.5, double min_spacing = 3, double max_spacing = 40)
+          : accuracy(accuracy), min_spacing(min_spacing), max_spacing(max_spacing),
+            buckets(new std::atomic<entry *>[bucket_count]) {
+            for (size_t i = 0; i < bucket_count; i++) buckets[i].store(nullptr, std::memory_order_relaxed);
+        }
+
+        irradiance_cache(const irradiance_cache &) = delete;
+        irradiance_cache &operator=(const irradiance_cache &) = delete;
+
+        ~irradiance_cache() {
+            for (size_t i = 0; i < bucket_count; i++) {
+                for (entry *e = buckets[i].load(); e;) {
+                    entry *next = e->next;
+                    delete e;
+                    e = next;
+                }
+            }
+            for (owned_record *r = records.load(); r;) {
+                owned_record *next = r->next;
+                delete r;
+                r = next;
+            }
+        }
+
+        size_t size() const { return record_count; }
+
+        // Weighted extrapolation of the records valid at p with normal n; false if there are none
+        bool lookup(const point3 &p, const vec3 &n, colour &irradiance) const {
+            double weight_sum = 0;
+            colour sum(0, 0, 0);
+
+            int first = min_level.load(std::memory_order_relaxed);
+            int last = max_level.load(std::memory_order_relaxed);
+            for (int level = first; level <= last; level++) {
+                double size = cell_size(level);
+                int64_t key[3];
+                for (int a = 0; a < 3; a++) key[a] = int64_t(std::floor(p[a] / size));
+
+                for (const entry *e = buckets[bucket(level, key)].load(std::memory_order_acquire); e; e = e->next) {
+                    if (e->level != level || e->key[0] != key[0] || e->key[1] != key[1] || e->key[2] != key[2]) continue;
+
+                    const record &r = *e->data;
+                    double w = weight(r, p, n);
+                    if (w <= 0) continue;
+
+                    vec3 rotation = cross(r.normal, n);
+                    vec3 offset = p - r.p;
+                    for (int c = 0; c < 3; c++) {
+                        double value = r.irradiance[c] + dot(rotation, r.rotation_gradient[c])
+                                     + dot(offset, r.translation_gradient[c]);
+                        sum[c] += w * std::fmax(value, 0.0);
+                    }
+                    weight_sum += w;
+                }
+            }
+
+            if (weight_sum <= 0) return false;
+            irradiance = sum / weight_sum;
+            return true;
+        }
+
+        // Files r under every cell of its level that its valid region overlaps. footprint is the width of
+        // a pixel at r.p, which bounds r's radius.
+        void insert(record r, double footprint) {
+            if (footprint > 0) r.radius = std::clamp(r.radius, min_spacing * footprint, max_spacing * footprint);
+            double reach = accuracy * r.radius;
+            if (!(reach > 0) || !std::isfinite(reach)) return;
+
+            auto owned = new owned_record{r, records.load(std::memory_order_relaxed)};
+            while (!records.compare_exchange_weak(owned->next, owned, std::memory_order_release)) {}
+            record_count.fetch_add(1, std::memory_order_relaxed);
+
+            // Cells at least twice the reach, so the valid region spans at most two per axis
+            int level = std::clamp(int(std::ceil(std::log2(2 * reach / base_cell))), 0, max_levels - 1);
+            double size = cell_size(level);
+            int64_t low[3], high[3];
+            for (int a = 0; a < 3; a++) {
+                low[a] = int64_t(std::floor((r.p[a] - reach) / size));
+                high[a] = int64_t(std::floor((r.p[a] + reach) / size));
+            }
+
+            for (int64_t x = low[0]; x <= high[0]; x++) {
+                for (int64_t y = low[1]; y <= high[1]; y++) {
+                    for (int64_t z = low[2]; z <= high[2]; z++) {
+                        int64_t key[3] = {x, y, z};
+                        std::atomic<entry *> &head = buckets[bucket(level, key)];
+                        auto e = new entry{&owned->data, level, {x, y, z}, head.load(std::memory_order_relaxed)};
+                        while (!head.compare_exchange_weak(e->next, e, std::memory_order_release)) {}
+                    }
+                }
+            }
+
+            // Widen the probed levels after the record is reachable
+            int current = min_level.load(std::memory_order_relaxed);
+            while (level < current && !min_level.compare_exchange_weak(current, level)) {}
+            current = max_level.load(std::memory_order_relaxed);
+            while (level > current && !max_level.compare_exchange_weak(current, level)) {}
+        }
+
+        // Record from theta_strata x phi_strata cosine-distributed rays about frame.w(), ray (j, k) having
+        // polar angle asin(sqrt((j + u) / theta_strata)) and azimuth 2 pi (k + v) / phi_strata in frame.
+        // radiance and distance are indexed j * phi_strata + k; distance is infinite for rays that escaped.
+        static record from_samples(const point3 &p, const onb &frame, const std::vector<colour> &radiance,
+                                   const std::vector<double> &distance) {
+            const int m = theta_strata, n = phi_strata;
+            auto at = [&](int j, int k) { return size_t(j) * n + ((k + n) % n); };
+
+            record r;
+            r.p = p;
+            r.normal = frame.w();
+            r.irradiance = colour(0, 0, 0);
+            double inverse_distances = 0;
+            for (size_t i = 0; i < radiance.size(); i++) {
+                r.irradiance += radiance[i];
+                inverse_distances += 1 / distance[i];
+            }
+            r.irradiance = r.irradiance * (pi / (m * n));
+            r.radius = inverse_distances > 0 ? m * n / inverse_distances : infinity;
+
+            // Gradients are taken in the tangent plane and moved to world space at the end
+            colour rotation[3], translation[3];
+            for (int a = 0; a < 3; a++) rotation[a] = translation[a] = colour(0, 0, 0);
+
+            for (int k = 0; k < n; k++) {
+                double phi = 2 * pi * (k + 0.5) / n;
+                double phi_minus = 2 * pi * k / n;
+                vec3 u_k(std::cos(phi), std::sin(phi), 0);
+                vec3 v_k(-std::sin(phi), std::cos(phi), 0);
+                vec3 v_minus(-std::sin(phi_minus), std::cos(phi_minus), 0);
+
+                colour tangent_sum(0, 0, 0);
+                for (int j = 0; j < m; j++) {
+                    double sin_theta = std::sqrt((j + 0.5) / m);
+                    double tan_theta = sin_theta / std::sqrt(1 - sin_theta * sin_theta);
+                    tangent_sum += -tan_theta * radiance[at(j, k)];
+                }
+                add_scaled(rotation, v_k, tangent_sum * (pi / (m * n)));
+
+                // Change across the boundary with the previous polar stratum
+                colour polar(0, 0, 0);
+                for (int j = 1; j < m; j++) {
+                    double sin_minus = std::sqrt(double(j) / m);
+                    double cos_minus_squared = 1 - double(j) / m;
+                    double closest = std::fmin(distance[at(j, k)], distance[at(j - 1, k)]);
+                    polar += (sin_minus * cos_minus_squared / closest) * (radiance[at(j, k)] - radiance[at(j - 1, k)]);
+                }
+                add_scaled(translation, u_k, polar * (2 * pi / n));
+
+                // Change across the boundary with the previous azimuthal stratum
+                colour azimuthal(0, 0, 0);
+                for (int j = 0; j < m; j++) {
+                    double sin_minus = std::sqrt(double(j) / m);
+                    double sin_plus = std::sqrt(double(j + 1) / m);
+                    double closest = std::fmin(distance[at(j, k)], distance[at(j, k - 1)]);
+                    azimuthal += ((sin_plus - sin_minus) / closest) * (radiance[at(j, k)] - radiance[at(j, k - 1)]);
+                }
+                add_scaled(translation, v_minus, azimuthal);
+            }
+
+            for (int c = 0; c < 3; c++) {
+                r.rotation_gradient[c] = frame.transform(vec3(rotation[0][c], rotation[1][c], rotation[2][c]));
+                r.translation_gradient[c] = frame.transform(vec3(translation[0][c], translation[1][c], translation[2][c]));
+            }
+
+            // A steep gradient means the irradiance changes faster than the geometry suggests
+            double slope = std::sqrt(dot(r.translation_gradient[0], r.translation_gradient[0])
+                                   + dot(r.translation_gradient[1], r.translation_gradient[1])
+                                   + dot(r.translation_gradient[2], r.translation_gradient[2]));
+            double level = r.irradiance.length();
+            if (slope > 0 && level > 0) r.radius = std::fmin(r.radius, level / slope);
+            return r;
+        }
+
+        void account_memory(memory_report &report) const {
+            if (!report.first_visit(this)) return;
+            size_t entries = 0;
+            for (size_t i = 0; i < bucket_count; i++) {
+                for (const entry *e = buckets[i].load(); e; e = e->next) entries++;
+            }
+            report.add(memory_report::framebuffers, shared_bytes<irradiance_cache>() + bucket_count * sizeof(void *)
+                                                  + record_count * sizeof(owned_record) + entries * sizeof(entry));
+        }
+
+    private:
+        struct owned_record {
+            record data;
+            owned_record *next;
+        };
+
+        struct entry {
+            const record *data;
+            int level;
+            int64_t key[3];
+            entry *next;
+        };
+
+        static constexpr size_t bucket_count = size_t(1) << 16;
+        static constexpr int max_levels = 48;
+        static constexpr double base_cell = 1.0 / 4096;
+
+        double accuracy;
+        double min_spacing;
+        double max_spacing;
+        std::unique_ptr<std::atomic<entry *>[]> buckets;
+        std::atomic<owned_record *> records{nullptr};
+        std::atomic<size_t> record_count{0};
+        std::atomic<int> min_level{max_levels};
+        std::atomic<int> max_level{-1};
+
+        static double cell_size(int level) { return std::ldexp(base_cell, level); }
+
+        static size_t bucket(int level, const int64_t key[3]) {
+            uint64_t h = uint64_t(level) * 0x9e3779b97f4a7c15ull;
+            for (int a = 0; a < 3; a++) h = (h ^ uint64_t(key[a])) * 0xff51afd7ed558ccdull;
+            return size_t(h ^ (h >> 29)) & (bucket_count - 1);
+        }
+
+        // Tabellion and Lamorlette's weight, which falls to zero at the edge of the valid region rather
+        // than jumping there. Zero for records in front of p, which may not see what p sees.
+        double weight(const record &r, const point3 &p, const vec3 &n) const {
+            vec3 offset = p - r.p;
+            if (dot(offset, r.normal + n) < -0.1 * r.radius) return 0;
+
+            static const double normal_tolerance = std::sqrt(1 - std::cos(degrees_to_radians(10)));
+            double position_error = offset.length() / r.radius;
+            double normal_error = std::sqrt(std::fmax(0.0, 1 - dot(r.normal, n))) / normal_tolerance;
+            return 1 - std::fmax(position_error, normal_error) / accuracy;
+        }
+
+        static void add_scaled(colour gradient[3], const vec3 &direction, const colour &amount) {
+            for (int a = 0; a < 3; a++) gradient[a] += direction[a] * amount;
+        }
+};
+
+#endif
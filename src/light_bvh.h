@@ -0,0 +1,268 @@
+#ifndef LIGHT_BVH_H
+#define LIGHT_BVH_H
+
+#include "aabb.h"
+#include "hittable.h"
+#include "hittable_list.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Hierarchy over emitters for choosing one light per shading point in proportion to its estimated
+// contribution there (Conty Estevez and Kulla 2018). Each node bounds its lights' extent, total power and
+// the cone of their emission directions; sampling walks from the root, picking a child with probability
+// proportional to its importance, so the cost is logarithmic in the number of lights.
+class light_bvh {
+    public:
+        // Objects that do not emit light are skipped
+        light_bvh(const hittable_list &list) {
+            std::vector<int> order;
+            for (const auto &object : list.objects) {
+                light_bound bound;
+                if (!object->emission_bound(bound)) continue;
+                order.push_back(int(lights.size()));
+                lights.push_back(object);
+                bounds.push_back(bound);
+            }
+
+            if (lights.empty()) return;
+            nodes.reserve(2 * lights.size());
+            build(order, 0, order.size(), 0, 0);
+        }
+
+        size_t size() const { return lights.size(); }
+
+        void account_memory(memory_report &report) const {
+            if (!report.first_visit(this)) return;
+            size_t trail_bytes = trails.size() * (sizeof(const hittable *) + sizeof(trail) + 2 * sizeof(void *))
+                               + trails.bucket_count() * sizeof(void *);
+            report.add(memory_report::bvh, shared_bytes<light_bvh>() + vector_bytes(lights) + vector_bytes(bounds)
+                                         + vector_bytes(nodes) + trail_bytes);
+        }
+
+        // Picks a light for a point p with surface normal n (zero for points not on a surface) using u in
+        // [0, 1). Returns false if no light can reach p.
+        bool sample(const point3 &p, const vec3 &n, double u, const hittable *&light, double &pmf) const {
+            if (nodes.empty()) return false;
+
+            int index = 0;
+            pmf = 1;
+            while (nodes[index].light < 0) {
+                const node &current = nodes[index];
+                double left = importance(nodes[current.left].bound, p, n);
+                double right = importance(nodes[current.right].bound, p, n);
+                if (left <= 0 && right <= 0) return false;
+
+                double p_left = left / (left + right);
+                if (u < p_left) {
+                    u = std::fmin(u / p_left, 0.99999999999999989);
+                    pmf *= p_left;
+                    index = current.left;
+                } else {
+                    u = std::fmin((u - p_left) / (1 - p_left), 0.99999999999999989);
+                    pmf *= 1 - p_left;
+                    index = current.right;
+                }
+            }
+
+            if (importance(nodes[index].bound, p, n) <= 0) return false;
+            light = lights[nodes[index].light].get();
+            return true;
+        }
+
+        // Probability that sample() picks light at p, following its recorded path from the root
+        double pmf(const point3 &p, const vec3 &n, const hittable *light) const {
+            auto it = trails.find(light);
+            if (it == trails.end()) return 0;
+
+            uint64_t bits = it->second.bits;
+            int index = 0;
+            double result = 1;
+            for (int level = 0; level < it->second.depth; level++) {
+                const node &current = nodes[index];
+                double left = importance(nodes[current.left].bound, p, n);
+                double right = importance(nodes[current.right].bound, p, n);
+                if (left <= 0 && right <= 0) return 0;
+
+                bool go_right = (bits >> level) & 1;
+                result *= (go_right ? right : left) / (left + right);
+                index = go_right ? current.right : current.left;
+            }
+
+            return importance(nodes[index].bound, p, n) > 0 ? result : 0;
+        }
+
+        // Picks a light in proportion to its power alone, for starting light paths
+        bool sample_emitter(double u, const hittable *&light, double &pmf) const {
+            if (nodes.empty()) return false;
+
+            int index = 0;
+            pmf = 1;
+            while (nodes[index].light < 0) {
+                const node &current = nodes[index];
+                double left = nodes[current.left].bound.power;
+                double p_left = left / (left + nodes[current.right].bound.power);
+                if (u < p_left) {
+                    u = std::fmin(u / p_left, 0.99999999999999989);
+                    pmf *= p_left;
+                    index = current.left;
+                } else {
+                    u = std::fmin((u - p_left) / (1 - p_left), 0.99999999999999989);
+                    pmf *= 1 - p_left;
+                    index = current.right;
+                }
+            }
+
+            light = lights[nodes[index].light].get();
+            return true;
+        }
+
+        // Probability that sample_emitter() picks light
+        double emitter_pmf(const hittable *light) const {
+            auto it = trails.find(light);
+            if (it == trails.end()) return 0;
+
+            int index = 0;
+            double result = 1;
+            for (int level = 0; level < it->second.depth; level++) {
+                const node &current = nodes[index];
+                double left = nodes[current.left].bound.power;
+                double right = nodes[current.right].bound.power;
+                bool go_right = (it->second.bits >> level) & 1;
+                result *= (go_right ? right : left) / (left + right);
+                index = go_right ? current.right : current.left;
+            }
+            return result;
+        }
+
+    private:
+        struct node {
+            light_bound bound;
+            int left = -1;
+            int right = -1;
+            int light = -1;                // Index into lights for a leaf
+        };
+
+        struct trail {
+            uint64_t bits;                 // Bit i set where the path to the light goes right at depth i
+            int depth;
+        };
+
+        std::vector<shared_ptr<hittable>> lights;
+        std::vector<light_bound> bounds;
+        std::vector<node> nodes;
+        std::unordered_map<const hittable *, trail> trails;
+
+        int build(std::vector<int> &order, size_t start, size_t end, uint64_t bits, int depth) {
+            int index = int(nodes.size());
+            nodes.emplace_back();
+
+            // Median splits keep the depth near log2 of the light count, well inside the 64 trail bits
+            if (end - start == 1) {
+                int light = order[start];
+                nodes[index].bound = bounds[light];
+                nodes[index].light = light;
+                trails[lights[light].get()] = {bits, depth};
+                return index;
+            }
+
+            aabb centroids = aabb::empty;
+            for (size_t i = start; i < end; i++) {
+                point3 c = centre(bounds[order[i]].bounds);
+                centroids = aabb(centroids, aabb(c, c));
+            }
+
+            int axis = centroids.longest_axis();
+            size_t mid = start + (end - start) / 2;
+            std::nth_element(order.begin() + start, order.begin() + mid, order.begin() + end, [&](int a, int b) {
+                return centre(bounds[a].bounds)[axis] < centre(bounds[b].bounds)[axis];
+            });
+
+            int left = build(order, start, mid, bits, depth + 1);
+            int right = build(order, mid, end, bits | (uint64_t(1) << depth), depth + 1);
+
+            nodes[index].left = left;
+            nodes[index].right = right;
+            nodes[index].bound = merge(nodes[left].bound, nodes[right].bound);
+            return index;
+        }
+
+        static point3 centre(const aabb &box) {
+            return point3(0.5 * (box.x.min + box.x.max), 0.5 * (box.y.min + box.y.max), 0.5 * (box.z.min + box.z.max));
+        }
+
+        static double safe_acos(double x) { return std::acos(std::clamp(x, -1.0, 1.0)); }
+
+        static light_bound merge(const light_bound &a, const light_bound &b) {
+            light_bound result;
+            result.bounds = aabb(a.bounds, b.bounds);
+            result.power = a.power + b.power;
+            result.cos_theta_e = std::fmin(a.cos_theta_e, b.cos_theta_e);
+
+            // Smallest cone holding both normal cones
+            double theta_a = safe_acos(a.cos_theta_o);
+            double theta_b = safe_acos(b.cos_theta_o);
+            double theta_d = safe_acos(dot(a.axis, b.axis));
+
+            if (std::fmin(theta_d + theta_b, pi) <= theta_a) {
+                result.axis = a.axis;
+                result.cos_theta_o = a.cos_theta_o;
+                return result;
+            }
+            if (std::fmin(theta_d + theta_a, pi) <= theta_b) {
+                result.axis = b.axis;
+                result.cos_theta_o = b.cos_theta_o;
+                return result;
+            }
+
+            double theta_o = 0.5 * (theta_a + theta_d + theta_b);
+            vec3 w = cross(a.axis, b.axis);
+            if (theta_o >= pi || w.length_squared() == 0) {
+                result.axis = a.axis;
+                result.cos_theta_o = -1;
+                return result;
+            }
+
+            // Rotate a's axis towards b's by theta_o - theta_a
+            double theta_r = theta_o - theta_a;
+            w = unit_vector(w);
+            result.axis = unit_vector(std::cos(theta_r) * a.axis + std::sin(theta_r) * cross(w, a.axis));
+            result.cos_theta_o = std::cos(theta_o);
+            return result;
+        }
+
+        // Conservative estimate of the light a node can send to p: power over squared distance, scaled by
+        // the smallest angle any of its lights could make with the direction to p, and by the cosine at p
+        static double importance(const light_bound &b, const point3 &p, const vec3 &n) {
+            point3 pc = centre(b.bounds);
+            vec3 diagonal(b.bounds.x.size(), b.bounds.y.size(), b.bounds.z.size());
+            vec3 to_p = p - pc;
+            double distance_squared = to_p.length_squared();
+            double radius_squared = diagonal.length_squared() / 4;
+
+            // Angle the bounds subtend from p; inside them every direction is possible
+            double theta_b = pi;
+            if (distance_squared > radius_squared) theta_b = std::asin(std::sqrt(radius_squared / distance_squared));
+
+            vec3 wi = distance_squared > 0 ? to_p / std::sqrt(distance_squared) : b.axis;
+            double theta_w = safe_acos(dot(b.axis, wi));
+            double theta_o = safe_acos(b.cos_theta_o);
+            double theta = std::fmax(0.0, theta_w - theta_o - theta_b);
+            if (std::cos(theta) <= b.cos_theta_e) return 0;
+
+            double result = b.power * std::cos(theta) / std::fmax(distance_squared, diagonal.length() / 2);
+
+            if (n.length_squared() > 0) {
+                double theta_i = safe_acos(dot(n, -wi));
+                double cos_i = std::cos(std::fmax(0.0, theta_i - theta_b));
+                if (cos_i <= 0) return 0;
+                result *= cos_i;
+            }
+
+            return result;
+        }
+};
+
+#endif
@@ -1,13 +1,29 @@
 #include "utils.h"
 #include "bvh.h"
 #include "camera.h"
+#include "compact_bvh.h"
+#include "environment_light.h"
 #include "hittable.h"
 #include "hittable_list.h"
+#include "irradiance_cache.h"
+#include "light_bvh.h"
 #include "material.h"
+#include "medium.h"
+#include "motion_bvh.h"
+#include "paged_scene.h"
+#include "scene_budget.h"
 #include "sphere.h"
 #include "quad.h"
+#include "render_scheduler.h"
+#include "sbvh.h"
 #include "texture.h"
 
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <string>
+
 void in_one_weekend() {
     hittable_list scene;
 
@@ -98,7 +114,7 @@ void checkered_spheres() {
     cam.render(scene);
 }
 
-void infinity_room() {
+hittable_list infinity_room_scene() {
     hittable_list scene;
 
     auto mirror = make_shared<metal>(colour(0.5, 0.55, 0.53), 0.0);
@@ -127,9 +143,16 @@ void infinity_room() {
         scene.add(make_shared<sphere>(center, radius, ball));
     }
 
-    scene = hittable_list(make_shared<bvh_node>(scene));
+    return scene;
+}
+
+void infinity_room(double time_budget = 0) {
+    hittable_list scene = infinity_room_scene();
 
     camera cam;
+    cam.lights = make_shared<light_bvh>(scene);
+
+    scene = hittable_list(make_shared<bvh_node>(scene));
 
     cam.aspect_ratio = 1.0;
     cam.image_width = 1000;
@@ -143,9 +166,1448 @@ void infinity_room() {
     cam.vup = vec3(0, 1, 0);
     cam.defocus_angle = 0;
 
+    // Progressive passes, with a snapshot every half minute, when rendering against a deadline
+    cam.time_budget = time_budget;
+    cam.pass_samples = 4;
+    cam.snapshot_interval = 30;
+
     cam.render(scene);
 }
 
-int main() {
-    infinity_room();
+// Prints RMSE against a high sample count reference for each sampler, at doubling sample counts
+void sampler_convergence() {
+    hittable_list scene;
+
+    auto checker = make_shared<checker_texture>(0.32, colour(0.2, 0.3, 0.1), colour(0.9, 0.9, 0.9));
+    scene.add(make_shared<sphere>(point3(0, -1000, 0), 1000, make_shared<lambertian>(checker)));
+    scene.add(make_shared<sphere>(point3(0, 1, 0), 1.0, make_shared<dielectric>(1.5)));
+    scene.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, make_shared<lambertian>(colour(0.4, 0.2, 0.1))));
+    scene.add(make_shared<sphere>(point3(4, 1, 0), 1.0, make_shared<metal>(colour(0.7, 0.6, 0.5), 0.2)));
+    scene = hittable_list(make_shared<bvh_node>(scene));
+
+    camera cam;
+
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.image_width = 200;
+    cam.max_depth = 20;
+    cam.background = colour(0.70, 0.80, 1.00);
+
+    cam.vfov = 20;
+    cam.lookfrom = point3(13, 2, 3);
+    cam.lookat = point3(0, 0, 0);
+    cam.vup = vec3(0, 1, 0);
+
+    cam.defocus_angle = 0.6;
+    cam.focus_dist = 10.0;
+
+    cam.samples_per_pixel = 2048;
+    std::vector<colour> reference = cam.render_image(scene);
+
+    auto rmse = [&](const std::vector<colour> &image) {
+        double sum = 0;
+        for (size_t i = 0; i < image.size(); i++) sum += (image[i] - reference[i]).length_squared() / 3;
+        return std::sqrt(sum / image.size());
+    };
+
+    std::vector<std::pair<std::string, shared_ptr<sampler>>> samplers = {
+        {"independent", make_shared<independent_sampler>()},
+        {"sobol", make_shared<sobol_sampler>(false)},
+        {"sobol_blue_noise", make_shared<sobol_sampler>(true)},
+    };
+
+    std::cout << "spp";
+    for (const auto &entry : samplers) std::cout << ' ' << entry.first;
+    std::cout << '\n';
+
+    for (int spp = 1; spp <= 128; spp *= 2) {
+        cam.samples_per_pixel = spp;
+        std::cout << spp;
+
+        for (const auto &entry : samplers) {
+            cam.pixel_sampler = entry.second;
+            std::cout << ' ' << rmse(cam.render_image(scene));
+        }
+        std::cout << std::endl;
+    }
+}
+
+// A sphere field written to a paged file and rendered through a small geometry cache
+void out_of_core_spheres() {
+    std::vector<shared_ptr<material>> materials = {
+        make_shared<lambertian>(colour(0.2, 0.3, 0.1)),
+        make_shared<lambertian>(colour(0.7, 0.3, 0.3)),
+        make_shared<metal>(colour(0.8, 0.8, 0.9), 0.1),
+        make_shared<dielectric>(1.5),
+    };
+
+    paged_scene_writer writer("spheres.rtpg", 2048);
+    writer.add_sphere(point3(0, -1000, 0), 1000, 0);
+    for (int a = -100; a < 100; a++) {
+        for (int b = -100; b < 100; b++) {
+            point3 center(a + 0.9 * random_double(), 0.2, b + 0.9 * random_double());
+            writer.add_sphere(center, 0.2, 1 + random_int(0, 2));
+        }
+    }
+    writer.finish();
+
+    // About a third of the pages fit, so a frame that sweeps the field has to evict and reload them
+    paged_scene scene("spheres.rtpg", materials, size_t(4) << 20);
+
+    camera cam;
+
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.image_width = 400;
+    cam.samples_per_pixel = 16;
+    cam.max_depth = 20;
+    cam.background = colour(0.70, 0.80, 1.00);
+    cam.batch_size = 1 << 18;
+
+    cam.vfov = 30;
+    cam.lookat = point3(0, 0, 0);
+    cam.vup = vec3(0, 1, 0);
+
+    std::vector<colour> image;
+    for (int frame = 0; frame < 3; frame++) {
+        double angle = 0.22 + 0.1 * frame;
+        cam.lookfrom = point3(13.5 * std::cos(angle), 3, 13.5 * std::sin(angle));
+
+        size_t loads = scene.page_loads(), reloads = scene.page_reloads();
+        auto start = std::chrono::steady_clock::now();
+        image = cam.render_image(scene);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::clog << "Frame " << frame << ": " << seconds << " s, " << scene.page_loads() - loads << " page loads, "
+                  << scene.page_reloads() - reloads << " of them reloads\n";
+    }
+    scene.report(std::clog);
+
+    std::ofstream out("out_of_core.ppm");
+    cam.write_image(out, image);
+}
+
+// Shadow-ray throughput in the infinity room: closest-hit queries against any-hit occlusion queries
+void shadow_ray_benchmark() {
+    hittable_list objects = infinity_room_scene();
+    bvh_node scene(objects);
+
+    std::vector<ray> rays;
+    for (int i = 0; i < 2000000; i++) {
+        point3 from(random_double(1, 554), random_double(1, 553), random_double(1, 554));
+        point3 to(random_double(5, 550), 554, random_double(5, 550));
+        rays.push_back(ray(from, to - from));
+    }
+
+    // Rays span exactly the segment to the light sample, so t stops short of the light itself
+    interval segment(0.001, 0.999);
+
+    auto start = std::chrono::steady_clock::now();
+    size_t blocked_hit = 0;
+    for (const ray &r : rays) {
+        hit_record rec;
+        if (scene.hit(r, segment, rec)) blocked_hit++;
+    }
+    std::chrono::duration<double> hit_time = std::chrono::steady_clock::now() - start;
+
+    start = std::chrono::steady_clock::now();
+    size_t blocked_occluded = 0;
+    for (const ray &r : rays) {
+        if (scene.occluded(r, segment)) blocked_occluded++;
+    }
+    std::chrono::duration<double> occluded_time = std::chrono::steady_clock::now() - start;
+
+    std::cout << "hit():      " << rays.size() / hit_time.count() / 1e6 << " Mrays/s, " << blocked_hit << " blocked\n";
+    std::cout << "occluded(): " << rays.size() / occluded_time.count() / 1e6 << " Mrays/s, " << blocked_occluded << " blocked\n";
+}
+
+// Node memory and closest-hit throughput of bvh_node against the quantized compact_bvh layouts
+void bvh_layout_comparison() {
+    hittable_list scene;
+    auto mat = make_shared<lambertian>(colour(0.5, 0.5, 0.5));
+    for (int i = 0; i < 200000; i++) {
+        scene.add(make_shared<sphere>(point3::random(-100, 100), random_double(0.05, 0.5), mat));
+    }
+
+    std::vector<ray> rays;
+    for (int i = 0; i < 200000; i++) {
+        point3 origin = point3::random(-100, 100);
+        rays.push_back(ray(origin, vec3::random(-1, 1)));
+    }
+
+    auto measure = [&](const char *name, const hittable &accel, size_t node_bytes) {
+        auto start = std::chrono::steady_clock::now();
+        size_t hits = 0;
+        double t_sum = 0;
+        for (const ray &r : rays) {
+            hit_record rec;
+            if (accel.hit(r, interval(0.001, infinity), rec)) {
+                hits++;
+                t_sum += rec.t;
+            }
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        std::cout << name << ": " << node_bytes / 1024 << " KiB nodes, "
+                  << rays.size() / elapsed.count() / 1e6 << " Mrays/s, "
+                  << hits << " hits, t sum " << t_sum << '\n';
+    };
+
+    bvh_node tree(scene);
+    compact_bvh16 tree16(scene);
+    compact_bvh8 tree8(scene);
+
+    // shared_ptr control blocks add roughly two counters per make_shared allocation
+    size_t bvh_node_bytes = tree.node_count() * (sizeof(bvh_node) + 2 * sizeof(long));
+    measure("bvh_node", tree, bvh_node_bytes);
+    measure("compact_bvh16", tree16, tree16.node_bytes());
+    measure("compact_bvh8", tree8, tree8.node_bytes());
+}
+
+// Memory report for 200k spheres that each get their own lambertian, then the
+// same scene under budgets that force compact BVHs and finally a failure
+void memory_budget() {
+    hittable_list objects;
+    for (int i = 0; i < 200000; i++) {
+        point3 center(random_double(-100, 100), random_double(-100, 100), random_double(-100, 100));
+        objects.add(make_shared<sphere>(center, 0.2, make_shared<lambertian>(colour::random())));
+    }
+
+    camera cam;
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.image_width = 1920;
+
+    // Budgets a quarter MiB below each structure's estimated total, so every fallback is reached in turn
+    memory_report base;
+    objects.account_memory(base);
+    cam.account_memory(base);
+    size_t count = objects.objects.size();
+    size_t below = size_t(1) << 18;
+    size_t budgets[] = {
+        0,
+        base.total() + bvh_node::estimate_bytes(count) - below,
+        base.total() + compact_bvh16::estimate_bytes(count) - below,
+        base.total() + compact_bvh8::estimate_bytes(count) - below,
+    };
+
+    for (size_t budget : budgets) {
+        memory_report report;
+        shared_ptr<hittable> scene = build_within_budget(objects, cam, budget, budget_policy::degrade, report);
+
+        std::cout << "Budget ";
+        if (budget) {
+            std::cout << memory_report::mebibytes(budget) << " MiB";
+        } else {
+            std::cout << "unlimited";
+        }
+        std::cout << (scene ? "" : " (does not fit)") << ":\n";
+        report.print(std::cout);
+    }
+}
+
+// 36-view turntable of a small sphere scene, rendered view by view and then as one batch sharing the
+// thread pool; the batch writes turntable_NN.ppm as each view finishes.
+void turntable() {
+    hittable_list world;
+
+    auto checker = make_shared<checker_texture>(0.32, colour(0.2, 0.3, 0.1), colour(0.9, 0.9, 0.9));
+    world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, make_shared<lambertian>(checker)));
+    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, make_shared<dielectric>(1.5)));
+    world.add(make_shared<sphere>(point3(-2.5, 1, 0), 1.0, make_shared<lambertian>(colour(0.4, 0.2, 0.1))));
+    world.add(make_shared<sphere>(point3(2.5, 1, 0), 1.0, make_shared<metal>(colour(0.7, 0.6, 0.5), 0.0)));
+    for (int i = 0; i < 60; i++) {
+        point3 center(random_double(-6, 6), 0.2, random_double(-6, 6));
+        world.add(make_shared<sphere>(center, 0.2, make_shared<lambertian>(colour::random() * colour::random())));
+    }
+    hittable_list scene(make_shared<bvh_node>(world));
+
+    std::vector<camera> views(36);
+    for (size_t i = 0; i < views.size(); i++) {
+        camera &cam = views[i];
+        double angle = 2 * pi * i / views.size();
+
+        cam.aspect_ratio = 16.0 / 9.0;
+        cam.image_width = 240;
+        cam.samples_per_pixel = 16;
+        cam.max_depth = 20;
+        cam.background = colour(0.70, 0.80, 1.00);
+
+        cam.vfov = 30;
+        cam.lookfrom = point3(12 * std::cos(angle), 3, 12 * std::sin(angle));
+        cam.lookat = point3(0, 0.5, 0);
+        cam.vup = vec3(0, 1, 0);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (camera &cam : views) cam.render_image(scene);
+    std::chrono::duration<double> one_by_one = std::chrono::steady_clock::now() - start;
+
+    start = std::chrono::steady_clock::now();
+    camera::render_views(views, scene, [&](size_t view, const std::vector<colour> &image) {
+        std::ofstream out("turntable_" + std::string(view < 10 ? "0" : "") + std::to_string(view) + ".ppm");
+        views[view].write_image(out, image);
+    });
+    std::chrono::duration<double> batched = std::chrono::steady_clock::now() - start;
+
+    std::cout << "View by view: " << one_by_one.count() << " s\n";
+    std::cout << "Batched:      " << batched.count() << " s (including writing every view)\n";
+}
+
+// Clear sky with a small sun 30 degrees up, about 200 times brighter than the sky in total
+bool write_sky_pfm(const std::string &path, int width, int height) {
+    vec3 sun = unit_vector(vec3(-1, std::tan(pi / 6), -1));
+
+    std::ofstream out(path, std::ios::binary);
+    out << "PF\n" << width << ' ' << height << "\n-1.0\n";
+    for (int row = height - 1; row >= 0; row--) {
+        for (int col = 0; col < width; col++) {
+            double theta = pi * (row + 0.5) / height;
+            double phi = 2 * pi * (col + 0.5) / width;
+            vec3 d(-std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi));
+
+            double up = std::fmax(0.0, d.y());
+            colour sky = d.y() > 0 ? (1 - up) * colour(0.9, 0.9, 1.0) + up * colour(0.3, 0.5, 1.0) : colour(0.2, 0.2, 0.2);
+            if (dot(d, sun) > std::cos(0.05)) sky = colour(8000, 7000, 5500);
+
+            float rgb[3] = {float(sky.x()), float(sky.y()), float(sky.z())};
+            out.write(reinterpret_cast<const char *>(rgb), sizeof(rgb));
+        }
+    }
+    return bool(out);
+}
+
+// Checks the fast-math kernels against libm: worst-case errors, the worst texel shift they cause in sphere
+// uv lookups on an 8k x 4k texture, that the table gamma encoder never differs from the exact one, and
+// how far the encoded bytes of a textured, sky-lit render move when the kernels are switched on.
+void fast_math_accuracy() {
+    auto time_ns = [](auto &&f, int n) {
+        auto start = std::chrono::steady_clock::now();
+        double sink = 0;
+        for (int i = 0; i < n; i++) sink += f(i);
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        if (sink == 1234.5) std::cout << ' ';
+        return elapsed.count() / n;
+    };
+
+    const int n = 4000000;
+    std::vector<double> xs(n), ys(n);
+    for (int i = 0; i < n; i++) {
+        xs[i] = random_double(-1, 1);
+        ys[i] = random_double(-1, 1);
+    }
+
+    double acos_error = 0, atan2_error = 0, pow5_error = 0;
+    for (int i = 0; i < n; i++) {
+        acos_error = std::fmax(acos_error, std::fabs(fast_acos(xs[i]) - std::acos(xs[i])));
+        atan2_error = std::fmax(atan2_error, std::fabs(fast_atan2(ys[i], xs[i]) - std::atan2(ys[i], xs[i])));
+        double x = std::fabs(xs[i]);
+        pow5_error = std::fmax(pow5_error, std::fabs(pow5(x) - std::pow(x, 5)));
+    }
+    for (double edge : {-1.0, -0.0, 0.0, 1.0}) {
+        acos_error = std::fmax(acos_error, std::fabs(fast_acos(edge) - std::acos(edge)));
+        for (double other : {-1.0, -0.0, 0.0, 1.0}) {
+            if (edge == 0 && other == 0) continue;
+            atan2_error = std::fmax(atan2_error, std::fabs(fast_atan2(edge, other) - std::atan2(edge, other)));
+        }
+    }
+
+    std::cout << "acos:  max error " << acos_error << " rad, "
+              << time_ns([&](int i) { return std::acos(xs[i]); }, n) << " ns libm, "
+              << time_ns([&](int i) { return fast_acos(xs[i]); }, n) << " ns fast\n";
+    std::cout << "atan2: max error " << atan2_error << " rad, "
+              << time_ns([&](int i) { return std::atan2(ys[i], xs[i]); }, n) << " ns libm, "
+              << time_ns([&](int i) { return fast_atan2(ys[i], xs[i]); }, n) << " ns fast\n";
+    std::cout << "pow5:  max error " << pow5_error << ", "
+              << time_ns([&](int i) { return std::pow(xs[i], 5); }, n) << " ns libm, "
+              << time_ns([&](int i) { return pow5(xs[i]); }, n) << " ns fast\n";
+
+    double texel_shift = 0;
+    for (int i = 0; i < n; i++) {
+        vec3 p = sample_unit_vector();
+        double u = (std::atan2(-p.z(), p.x()) + pi) / (2 * pi), v = std::acos(-p.y()) / pi;
+        double fu = (fast_atan2(-p.z(), p.x()) + pi) / (2 * pi), fv = fast_acos(-p.y()) / pi;
+        double du = std::fabs(u - fu);
+        du = std::fmin(du, 1 - du);                // Across the seam
+        texel_shift = std::fmax(texel_shift, std::fmax(du * 8192, std::fabs(v - fv) * 4096));
+    }
+    std::cout << "sphere uv: max shift " << texel_shift << " texels on an 8192x4096 texture\n";
+
+    std::vector<double> linear;
+    for (int k = 0; k <= 256; k++) {
+        double t = (k / 256.0) * (k / 256.0);
+        for (int step = 0; step < 4; step++) t = std::nextafter(t, 0.0);
+        for (int step = 0; step < 8; step++, t = std::nextafter(t, 2.0)) linear.push_back(t);
+    }
+    for (int i = 0; i < n; i++) {
+        double x = random_double();
+        linear.push_back(x);
+        linear.push_back(x * x * x * x);
+        linear.push_back(4 * x - 1);
+    }
+    linear.push_back(std::nan(""));
+    linear.push_back(infinity);
+
+    size_t mismatches = 0;
+    for (double x : linear) mismatches += gamma_encoder::encode(x) != gamma_encoder::encode_exact(x) ? 1 : 0;
+    int m = int(linear.size());
+    std::cout << "gamma encoder: " << mismatches << " of " << linear.size() << " bytes differ, "
+              << time_ns([&](int i) { return double(gamma_encoder::encode_exact(linear[i])); }, m) << " ns libm, "
+              << time_ns([&](int i) { return double(gamma_encoder::encode(linear[i])); }, m) << " ns table\n";
+
+    // The same scene rendered with the fast kernels and with libm. Globe-textured spheres take their uv
+    // from acos/atan2 and the sky is looked up the same way; the Sobol sampler makes the renders repeat
+    // exactly, so the exact render against itself should show no difference.
+    const int globe_width = 2048, globe_height = 1024;
+    std::vector<colour> globe(size_t(globe_width) * globe_height);
+    for (int y = 0; y < globe_height; y++) {
+        for (int x = 0; x < globe_width; x++) {
+            bool line = x % 64 < 2 || y % 64 < 2;
+            double shade = 0.3 + 0.6 * ((x / 64 * 5 + y / 64 * 3) % 7) / 6.0;
+            globe[size_t(y) * globe_width + x] = line ? colour(0.9, 0.9, 0.9) : shade * colour(0.2, 0.4, 0.8);
+        }
+    }
+    if (!write_tiled_texture("globe.rtmt", globe_width, globe_height, globe) || !write_sky_pfm("sky.pfm", 1024, 512)) {
+        std::cerr << "ERROR: Could not write the textures for the render comparison.\n";
+        return;
+    }
+    auto environment = make_shared<environment_light>("sky.pfm");
+    if (!environment->valid()) return;
+
+    auto globe_material = make_shared<lambertian>(make_shared<image_texture>("globe.rtmt", 2 * pi));
+    hittable_list objects;
+    objects.add(make_shared<quad>(point3(-20, 0, -20), vec3(40, 0, 0), vec3(0, 0, 40),
+                                  make_shared<lambertian>(colour(0.5, 0.5, 0.5))));
+    for (int i = -1; i <= 1; i++) objects.add(make_shared<sphere>(point3(2.2 * i, 1, 0), 1, globe_material));
+    hittable_list scene(make_shared<bvh_node>(objects));
+
+    camera cam;
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.image_width = 320;
+    cam.samples_per_pixel = 16;
+    cam.max_depth = 6;
+    cam.vfov = 40;
+    cam.lookfrom = point3(0, 3, 9);
+    cam.lookat = point3(0, 0.8, 0);
+    cam.vup = vec3(0, 1, 0);
+    cam.environment = environment;
+    cam.pixel_sampler = make_shared<sobol_sampler>();
+
+    bool default_kernels = fast_math_kernels;
+    fast_math_kernels = false;
+    std::vector<colour> exact = cam.render_image(scene);
+    std::vector<colour> exact_again = cam.render_image(scene);
+    fast_math_kernels = true;
+    std::vector<colour> fast = cam.render_image(scene);
+    fast_math_kernels = default_kernels;
+
+    auto compare = [&](const std::string &name, const std::vector<colour> &image) {
+        int max_difference = 0;
+        double total = 0;
+        size_t differing = 0;
+        for (size_t i = 0; i < image.size(); i++) {
+            for (int k = 0; k < 3; k++) {
+                int d = std::abs(int(gamma_encoder::encode(image[i][k])) - int(gamma_encoder::encode(exact[i][k])));
+                max_difference = std::max(max_difference, d);
+                total += d;
+                differing += d > 0 ? 1 : 0;
+            }
+        }
+        std::cout << name << ": max " << max_difference << ", mean " << total / (3 * image.size())
+                  << " per 8-bit channel, " << differing << " of " << 3 * image.size() << " channels differ\n";
+    };
+    compare("render, exact against exact", exact_again);
+    compare("render, fast against exact ", fast);
+}
+
+// Small infinity room render that also writes cost_*.ppm/.pfm heatmaps and lists the costliest tiles
+void cost_maps() {
+    hittable_list scene = infinity_room_scene();
+
+    camera cam;
+    cam.lights = make_shared<light_bvh>(scene);
+
+    scene = hittable_list(make_shared<bvh_node>(scene));
+
+    cam.aspect_ratio = 1.0;
+    cam.image_width = 300;
+    cam.samples_per_pixel = 16;
+    cam.max_depth = 50;
+    cam.background = colour(0, 0, 0);
+
+    cam.vfov = 20;
+    cam.lookfrom = point3(200, 278, 5);
+    cam.lookat = point3(278, 278, 100);
+    cam.vup = vec3(0, 1, 0);
+    cam.tile_size = 32;
+
+    cam.cost_map_prefix = "cost";
+    cam.render(scene);
+}
+
+// Night-time street grid with a growing number of small lights of fixed total power. Relative noise is
+// estimated from two independent renders; with the light BVH it should barely change with the light count.
+void many_lights_benchmark() {
+    auto ground = make_shared<lambertian>(colour(0.5, 0.5, 0.5));
+    auto wall = make_shared<lambertian>(colour(0.6, 0.55, 0.5));
+
+    for (int count : {16, 256, 4096}) {
+        hittable_list objects;
+        objects.add(make_shared<quad>(point3(-60, 0, -60), vec3(120, 0, 0), vec3(0, 0, 120), ground));
+        for (int i = 0; i < 40; i++) {
+            point3 corner(random_double(-50, 45), 0, random_double(-50, 45));
+            objects.add(make_shared<quad>(corner, vec3(5, 0, 0), vec3(0, random_double(3, 12), 0), wall));
+        }
+
+        // Emitting area, and so total power, stays the same as the lights shrink
+        int side = int(std::sqrt(double(count)));
+        double radius = 0.15 * std::sqrt(4096.0 / count);
+        for (int a = 0; a < side; a++) {
+            for (int b = 0; b < side; b++) {
+                point3 center(-50 + 100.0 * (a + random_double()) / side, radius + random_double(0, 6),
+                              -50 + 100.0 * (b + random_double()) / side);
+                colour tint(random_double(0.5, 1), random_double(0.4, 0.9), random_double(0.2, 0.6));
+                objects.add(make_shared<sphere>(center, radius, make_shared<diffuse_light>(20 * tint)));
+            }
+        }
+
+        hittable_list scene(make_shared<bvh_node>(objects));
+
+        camera cam;
+        cam.aspect_ratio = 16.0 / 9.0;
+        cam.image_width = 320;
+        cam.samples_per_pixel = 4;
+        cam.max_depth = 4;
+        cam.background = colour(0, 0, 0);
+        cam.vfov = 50;
+        cam.lookfrom = point3(0, 30, 70);
+        cam.lookat = point3(0, 0, 0);
+        cam.vup = vec3(0, 1, 0);
+
+        for (bool use_bvh : {false, true}) {
+            cam.lights = use_bvh ? make_shared<light_bvh>(objects) : nullptr;
+
+            auto start = std::chrono::steady_clock::now();
+            std::vector<colour> a = cam.render_image(scene);
+            std::vector<colour> b = cam.render_image(scene);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+            // Pixels that see a light directly only add edge aliasing, so just lit surfaces are measured
+            double difference = 0, mean = 0;
+            size_t lit = 0;
+            for (size_t i = 0; i < a.size(); i++) {
+                if (std::fmax(luminance(a[i]), luminance(b[i])) > 5) continue;
+                difference += luminance((a[i] - b[i]) * (a[i] - b[i])) / 2;
+                mean += luminance(a[i] + b[i]) / 2;
+                lit++;
+            }
+            mean /= lit;
+            double relative_noise = std::sqrt(difference / lit) / mean;
+
+            std::cout << count << " lights, " << (use_bvh ? "light BVH:   " : "BSDF only:   ")
+                      << "mean " << mean << ", relative noise " << relative_noise << ", " << elapsed.count() << " s\n";
+        }
+    }
+}
+
+// Sun and sky lighting on diffuse objects, with and without sampling the environment map directly
+void environment_lighting(const std::string &map_path) {
+    std::string path = map_path;
+    if (path.empty()) {
+        path = "sky.pfm";
+        if (!write_sky_pfm(path, 1024, 512)) {
+            std::cerr << "ERROR: Could not write '" << path << "'.\n";
+            return;
+        }
+    }
+
+    auto environment = make_shared<environment_light>(path);
+    if (!environment->valid()) return;
+
+    hittable_list objects;
+    objects.add(make_shared<quad>(point3(-20, 0, -20), vec3(40, 0, 0), vec3(0, 0, 40),
+                                  make_shared<lambertian>(colour(0.5, 0.5, 0.5))));
+    objects.add(make_shared<sphere>(point3(-2.2, 1, 0), 1, make_shared<lambertian>(colour(0.7, 0.3, 0.2))));
+    objects.add(make_shared<sphere>(point3(0, 1, 0), 1, make_shared<lambertian>(colour(0.3, 0.6, 0.3))));
+    objects.add(make_shared<sphere>(point3(2.2, 1, 0), 1, make_shared<lambertian>(colour(0.2, 0.3, 0.7))));
+    hittable_list scene(make_shared<bvh_node>(objects));
+
+    camera cam;
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.image_width = 320;
+    cam.samples_per_pixel = 8;
+    cam.max_depth = 6;
+    cam.vfov = 40;
+    cam.lookfrom = point3(0, 3, 9);
+    cam.lookat = point3(0, 0.8, 0);
+    cam.vup = vec3(0, 1, 0);
+    cam.environment = environment;
+
+    // The wavefront renderer never samples lights, so it gives the BSDF-only estimate of the same image.
+    // Pixels that see the sun directly are masked out using the first, low-noise render.
+    std::vector<char> sees_sun;
+    for (bool sample_map : {true, false}) {
+        cam.batch_size = sample_map ? 0 : 1 << 16;
+
+        auto start = std::chrono::steady_clock::now();
+        std::vector<colour> a = cam.render_image(scene);
+        std::vector<colour> b = cam.render_image(scene);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        if (sees_sun.empty()) {
+            for (size_t i = 0; i < a.size(); i++) sees_sun.push_back(luminance(a[i] + b[i]) > 200);
+        }
+
+        double difference = 0, mean = 0;
+        size_t lit = 0;
+        for (size_t i = 0; i < a.size(); i++) {
+            if (sees_sun[i]) continue;
+            difference += luminance((a[i] - b[i]) * (a[i] - b[i])) / 2;
+            mean += luminance(a[i] + b[i]) / 2;
+            lit++;
+        }
+        mean /= lit;
+        double relative_noise = std::sqrt(difference / lit) / mean;
+
+        std::cout << (sample_map ? "Environment MIS: " : "BSDF only:       ") << "mean " << mean
+                  << ", relative noise " << relative_noise << ", " << elapsed.count() << " s\n";
+
+        if (sample_map) {
+            std::ofstream out("environment.ppm");
+            cam.write_image(out, a);
+        }
+    }
+}
+
+// Node visits per ray for the infinity room's walls and mirrors over a few hundred spheres, with the
+// median-split bvh_node against SAH trees allowed more and more spatial-split references
+void spatial_split_comparison() {
+    hittable_list scene = infinity_room_scene();
+    auto ball = make_shared<lambertian>(colour(0.5, 0.5, 0.5));
+    for (int i = 0; i < 500; i++) {
+        scene.add(make_shared<sphere>(point3::random(20, 535), random_double(2, 8), ball));
+    }
+
+    // Camera rays from the usual viewpoint, then rays leaving random points on the walls
+    std::vector<ray> rays;
+    for (int i = 0; i < 100000; i++) {
+        vec3 direction = point3(278, 278, 100) + vec3::random(-100, 100) - point3(200, 278, 5);
+        rays.push_back(ray(point3(200, 278, 5), direction));
+    }
+    for (int i = 0; i < 100000; i++) {
+        int wall = random_int(0, 5);
+        point3 origin = point3::random(1, 554);
+        vec3 direction = random_unit_vector();
+        if (wall < 3) {
+            origin[wall] = 0.5;
+            direction[wall] = std::fabs(direction[wall]);
+        } else {
+            origin[wall - 3] = 554.5;
+            direction[wall - 3] = -std::fabs(direction[wall - 3]);
+        }
+        rays.push_back(ray(origin, direction));
+    }
+
+    auto measure = [](const std::string &name, const hittable &accel, const std::vector<ray> &rays) {
+        render_counters before = render_stats;
+        auto start = std::chrono::steady_clock::now();
+        size_t hits = 0;
+        double t_sum = 0;
+        for (const ray &r : rays) {
+            hit_record rec;
+            if (accel.hit(r, interval(0.001, infinity), rec)) {
+                hits++;
+                t_sum += rec.t;
+            }
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        double count = double(rays.size());
+        std::cout << name << ": " << (render_stats.nodes_visited - before.nodes_visited) / count << " nodes/ray, "
+                  << (render_stats.primitive_tests - before.primitive_tests) / count << " primitive tests/ray, "
+                  << count / elapsed.count() / 1e6 << " Mrays/s, " << hits << " hits, t sum " << t_sum << '\n';
+    };
+
+    auto compare = [&](const hittable_list &objects, const std::vector<ray> &rays) {
+        measure("bvh_node", bvh_node(objects), rays);
+        for (double growth : {0.0, 0.1, 0.5, 2.0}) {
+            sbvh tree(objects, growth);
+            measure("sbvh growth " + std::to_string(growth).substr(0, 3) + " (" + std::to_string(tree.reference_count())
+                    + " references, " + std::to_string(tree.node_count()) + " nodes)", tree, rays);
+        }
+    };
+
+    // The walls are axis-aligned and the spheres small, so the plain tree already separates them and
+    // sbvh keeps it at every growth
+    std::cout << "Room with spheres:\n";
+    compare(scene, rays);
+
+    // Long planks at random angles have boxes far larger than themselves and overlap every cluster of
+    // spheres, which is where cutting them pays off
+    hittable_list planks;
+    auto grey = make_shared<lambertian>(colour(0.5, 0.5, 0.5));
+    for (int i = 0; i < 30; i++) {
+        point3 centre = point3::random(200, 800);
+        vec3 length = 800 * random_unit_vector();
+        vec3 width = 20 * unit_vector(cross(length, random_unit_vector()));
+        planks.add(make_shared<quad>(centre - 0.5 * length - 0.5 * width, length, width, grey));
+    }
+    for (int i = 0; i < 2000; i++) {
+        planks.add(make_shared<sphere>(point3::random(0, 1000), random_double(2, 8), ball));
+    }
+    std::vector<ray> plank_rays;
+    for (int i = 0; i < 200000; i++) {
+        point3 origin = point3::random(0, 1000);
+        plank_rays.push_back(ray(origin, random_unit_vector()));
+    }
+
+    std::cout << "Diagonal planks among spheres:\n";
+    compare(planks, plank_rays);
+}
+
+// Renders through the in-process API into a padded float buffer, as an embedding service would, then
+// again with a cancel request once half the rows are done
+void render_to_buffer() {
+    hittable_list scene;
+    auto checker = make_shared<checker_texture>(0.32, colour(0.2, 0.3, 0.1), colour(0.9, 0.9, 0.9));
+    scene.add(make_shared<sphere>(point3(0, -10, 0), 10, make_shared<lambertian>(checker)));
+    scene.add(make_shared<sphere>(point3(0, 10, 0), 10, make_shared<lambertian>(checker)));
+
+    camera cam;
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.image_width = 400;
+    cam.samples_per_pixel = 20;
+    cam.max_depth = 10;
+    cam.background = colour(0.70, 0.80, 1.00);
+    cam.vfov = 20;
+    cam.lookfrom = point3(13, 2, 3);
+    cam.lookat = point3(0, 0, 0);
+    cam.vup = vec3(0, 1, 0);
+
+    // Rows padded to a multiple of 64 floats, like a pipeline's aligned image planes
+    int height = cam.output_height();
+    size_t stride = (size_t(3 * cam.image_width) + 63) / 64 * 64;
+    std::vector<float> pixels(stride * height, -1.0f);
+
+    camera::render_callbacks callbacks;
+    callbacks.progress = [](int done, int total) {
+        if (done % 25 == 0 || done == total) std::cout << "  " << done << "/" << total << " rows\n";
+    };
+
+    bool finished = cam.render_into(scene, pixels.data(), stride, callbacks);
+    double sum = 0;
+    for (int row = 0; row < height; row++) {
+        for (int i = 0; i < 3 * cam.image_width; i++) sum += pixels[row * stride + i];
+    }
+    std::cout << (finished ? "Finished" : "Cancelled") << ", mean " << sum / (3.0 * cam.image_width * height) << "\n";
+
+    std::atomic<int> rows{0};
+    std::fill(pixels.begin(), pixels.end(), -1.0f);
+    callbacks.progress = [&rows](int done, int) { rows = done; };
+    callbacks.cancelled = [&rows, height] { return rows >= height / 2; };
+
+    finished = cam.render_into(scene, pixels.data(), stride, callbacks);
+    int untouched = 0;
+    for (int row = 0; row < height; row++) untouched += pixels[row * stride] < 0;
+    std::cout << (finished ? "Finished" : "Cancelled") << " after " << rows << " rows, " << untouched << " rows untouched\n";
+}
+
+// Preview latency on a shared worker pool, idle and then while a final-quality render of the infinity
+// room runs at a lower priority, which is cancelled at the end
+void scheduled_previews() {
+    hittable_list objects = infinity_room_scene();
+    auto scene = make_shared<bvh_node>(objects);
+
+    camera final_cam;
+    final_cam.image_width = 300;
+    final_cam.samples_per_pixel = 500;
+    final_cam.max_depth = 50;
+    final_cam.background = colour(0, 0, 0);
+    final_cam.vfov = 20;
+    final_cam.lookfrom = point3(200, 278, 5);
+    final_cam.lookat = point3(278, 278, 100);
+    final_cam.lights = make_shared<light_bvh>(objects);
+
+    camera preview_cam = final_cam;
+    preview_cam.image_width = 100;
+    preview_cam.samples_per_pixel = 1;
+    preview_cam.max_depth = 4;
+
+    render_scheduler scheduler;
+    std::cout << scheduler.thread_count() << " worker threads\n";
+
+    auto timed_preview = [&](int priority) {
+        auto start = std::chrono::steady_clock::now();
+        auto preview = scheduler.submit(preview_cam, scene, priority);
+        preview->finished.wait();
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    };
+
+    std::cout << "Preview on an idle pool: " << timed_preview(10) << " ms\n";
+
+    auto final_job = scheduler.submit(final_cam, scene, 0);
+    for (int i = 0; i < 5; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(300));
+        std::cout << "Preview during final render (" << int(100 * final_job->progress()) << "% done): "
+                  << timed_preview(10) << " ms\n";
+    }
+
+    final_job->cancel();
+    bool completed = final_job->finished.get();
+    std::cout << "Final render " << (completed ? "completed" : "cancelled") << " at "
+              << int(100 * final_job->progress()) << "%\n";
+}
+
+// Glass and mirror spheres in a box lit by a small ceiling light: the caustics under them are found by
+// light subpaths that camera paths almost never reproduce. Prints noise over the whole image and over
+// the caustic under the glass sphere, for path tracing at BDPT's sample count and at BDPT's render time.
+void bidirectional_comparison() {
+    hittable_list objects;
+    auto red = make_shared<lambertian>(colour(.65, .05, .05));
+    auto white = make_shared<lambertian>(colour(.73, .73, .73));
+    auto green = make_shared<lambertian>(colour(.12, .45, .15));
+    auto light = make_shared<diffuse_light>(colour(15, 15, 15));
+
+    objects.add(make_shared<quad>(point3(555, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), green));
+    objects.add(make_shared<quad>(point3(0, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), red));
+    objects.add(make_shared<quad>(point3(343, 554, 332), vec3(-130, 0, 0), vec3(0, 0, -105), light));
+    objects.add(make_shared<quad>(point3(0, 0, 0), vec3(555, 0, 0), vec3(0, 0, 555), white));
+    objects.add(make_shared<quad>(point3(555, 555, 555), vec3(-555, 0, 0), vec3(0, 0, -555), white));
+    objects.add(make_shared<quad>(point3(0, 0, 555), vec3(555, 0, 0), vec3(0, 555, 0), white));
+    objects.add(make_shared<sphere>(point3(190, 90, 190), 90, make_shared<dielectric>(1.5)));
+    objects.add(make_shared<sphere>(point3(400, 100, 350), 100, make_shared<metal>(colour(0.8, 0.85, 0.88), 0.0)));
+
+    camera cam;
+    cam.lights = make_shared<light_bvh>(objects);
+    hittable_list scene(make_shared<bvh_node>(objects));
+
+    cam.aspect_ratio = 1.0;
+    cam.image_width = 200;
+    cam.samples_per_pixel = 16;
+    cam.max_depth = 10;
+    cam.background = colour(0, 0, 0);
+    cam.vfov = 40;
+    cam.lookfrom = point3(278, 278, -800);
+    cam.lookat = point3(278, 278, 0);
+    cam.vup = vec3(0, 1, 0);
+
+    // Caustic pixels see the floor directly at a point whose straight line to the light's centre passes
+    // through the glass sphere, so its light arrives refracted
+    point3 light_centre(278, 554, 279.5), glass_centre(190, 90, 190);
+    double glass_radius = 90;
+    std::vector<char> caustic;
+    {
+        int height = int(cam.image_width / cam.aspect_ratio);
+        double h = std::tan(degrees_to_radians(cam.vfov) / 2);
+        vec3 w = unit_vector(cam.lookfrom - cam.lookat);
+        vec3 u = unit_vector(cross(cam.vup, w));
+        vec3 v = cross(w, u);
+        for (int row = 0; row < height; row++) {
+            for (int col = 0; col < cam.image_width; col++) {
+                double x = (2 * (col + 0.5) / cam.image_width - 1) * h * cam.image_width / height;
+                double y = (1 - 2 * (row + 0.5) / height) * h;
+                ray r(cam.lookfrom, x * u + y * v - w);
+                hit_record rec;
+                if (!scene.hit(r, interval(0.001, infinity), rec) || r.at(rec.t).y() >= 1) {
+                    caustic.push_back(false);
+                    continue;
+                }
+
+                point3 p = r.at(rec.t);
+                vec3 to_light = light_centre - p;
+                double along = std::clamp(dot(glass_centre - p, to_light) / to_light.length_squared(), 0.0, 1.0);
+                caustic.push_back((p + along * to_light - glass_centre).length() < glass_radius);
+            }
+        }
+    }
+
+    // Relative noise from the difference of two independent renders, over the whole image and over the
+    // caustic pixels alone; returns the seconds taken by one render
+    auto measure = [&](const std::string &name, const std::string &image_path) {
+        auto start = std::chrono::steady_clock::now();
+        std::vector<colour> a = cam.render_image(scene);
+        std::vector<colour> b = cam.render_image(scene);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        double difference[2] = {}, mean[2] = {};
+        size_t count[2] = {};
+        for (size_t i = 0; i < a.size(); i++) {
+            for (int set : {0, 1}) {
+                if (set == 1 && !caustic[i]) continue;
+                difference[set] += luminance((a[i] - b[i]) * (a[i] - b[i])) / 2;
+                mean[set] += luminance(a[i] + b[i]) / 2;
+                count[set]++;
+            }
+        }
+
+        std::cout << name << cam.samples_per_pixel << " spp, " << elapsed.count() / 2 << " s per render";
+        for (int set : {0, 1}) {
+            double m = mean[set] / count[set];
+            std::cout << (set == 0 ? "; image: mean " : "; caustic (" + std::to_string(count[set]) + " pixels): mean ")
+                      << m << ", relative noise " << std::sqrt(difference[set] / count[set]) / m;
+        }
+        std::cout << '\n';
+
+        std::ofstream out(image_path);
+        cam.write_image(out, a);
+        return elapsed.count() / 2;
+    };
+
+    cam.bidirectional = false;
+    double path_seconds = measure("Path tracing, equal samples: ", "caustics_pt.ppm");
+    cam.bidirectional = true;
+    double bdpt_seconds = measure("BDPT:                        ", "caustics_bdpt.ppm");
+
+    cam.bidirectional = false;
+    cam.samples_per_pixel = std::max(1, int(std::lround(cam.samples_per_pixel * bdpt_seconds / path_seconds)));
+    measure("Path tracing, equal time:    ", "caustics_pt_equal_time.ppm");
+}
+
+void path_guiding_comparison() {
+    hittable_list objects;
+    auto red = make_shared<lambertian>(colour(.65, .05, .05));
+    auto white = make_shared<lambertian>(colour(.73, .73, .73));
+    auto green = make_shared<lambertian>(colour(.12, .45, .15));
+    auto light = make_shared<diffuse_light>(colour(60, 60, 60));
+
+    // The light is in an attic above a panel that leaves only a slit open along the back wall. The room is
+    // lit by what leaks through, which light sampling rarely reaches and BSDF bounces rarely find.
+    objects.add(make_shared<quad>(point3(555, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), green));
+    objects.add(make_shared<quad>(point3(0, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), red));
+    objects.add(make_shared<quad>(point3(343, 554, 332), vec3(-130, 0, 0), vec3(0, 0, -105), light));
+    objects.add(make_shared<quad>(point3(0, 450, 0), vec3(555, 0, 0), vec3(0, 0, 495), white));
+    objects.add(make_shared<quad>(point3(0, 0, 0), vec3(555, 0, 0), vec3(0, 0, 555), white));
+    objects.add(make_shared<quad>(point3(555, 555, 555), vec3(-555, 0, 0), vec3(0, 0, -555), white));
+    objects.add(make_shared<quad>(point3(0, 0, 555), vec3(555, 0, 0), vec3(0, 555, 0), white));
+    objects.add(make_shared<sphere>(point3(190, 90, 190), 90, white));
+    objects.add(make_shared<sphere>(point3(400, 100, 350), 100, white));
+
+    camera cam;
+    cam.lights = make_shared<light_bvh>(objects);
+    hittable_list scene(make_shared<bvh_node>(objects));
+
+    cam.aspect_ratio = 1.0;
+    cam.image_width = 160;
+    cam.max_depth = 10;
+    cam.background = colour(0, 0, 0);
+    cam.vfov = 40;
+    cam.lookfrom = point3(278, 278, -800);
+    cam.lookat = point3(278, 278, 0);
+    cam.vup = vec3(0, 1, 0);
+
+    // Relative MSE, as Müller et al. report, from the difference of two independent renders; plain RMSE is
+    // ruled by the few pixels that see into the lit attic through the slit
+    struct result {
+        std::vector<colour> image;
+        double mean = 0, error = 0, seconds = 0;
+    };
+    auto measure = [&](bool guided, int spp) {
+        cam.path_guiding = guided;
+        cam.samples_per_pixel = spp;
+
+        auto start = std::chrono::steady_clock::now();
+        std::vector<colour> a = cam.render_image(scene);
+        std::vector<colour> b = cam.render_image(scene);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        result r;
+        for (size_t i = 0; i < a.size(); i++) {
+            double mean = luminance(a[i] + b[i]) / 2;
+            r.error += luminance((a[i] - b[i]) * (a[i] - b[i])) / 2 / (mean * mean + 0.01);
+            r.mean += mean;
+        }
+        r.mean /= a.size();
+        r.error /= a.size();
+        r.seconds = elapsed.count() / 2;
+        r.image = std::move(a);
+        return r;
+    };
+    auto report = [](const std::string &name, const result &r) {
+        std::cout << name << ": mean " << r.mean << ", relative MSE " << r.error << ", " << r.seconds << " s\n";
+    };
+
+    // Unguided again at the sample count that takes as long as the guided render
+    result guided = measure(true, 64);
+    result unguided = measure(false, 64);
+    int equal_time_spp = std::max(1, int(std::lround(64 * guided.seconds / unguided.seconds)));
+    result equal_time = measure(false, equal_time_spp);
+
+    report("Unguided, 64 spp", unguided);
+    report("Unguided, " + std::to_string(equal_time_spp) + " spp in equal time", equal_time);
+    report("Guided, 64 spp", guided);
+
+    std::ofstream out_guided("attic_guided.ppm");
+    cam.write_image(out_guided, guided.image);
+    std::ofstream out_unguided("attic_unguided.ppm");
+    cam.write_image(out_unguided, equal_time.image);
+}
+
+void irradiance_caching() {
+    hittable_list objects;
+    auto red = make_shared<lambertian>(colour(.65, .05, .05));
+    auto white = make_shared<lambertian>(colour(.73, .73, .73));
+    auto green = make_shared<lambertian>(colour(.12, .45, .15));
+    auto light = make_shared<diffuse_light>(colour(15, 15, 15));
+
+    objects.add(make_shared<quad>(point3(555, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), green));
+    objects.add(make_shared<quad>(point3(0, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), red));
+    objects.add(make_shared<quad>(point3(343, 554, 332), vec3(-130, 0, 0), vec3(0, 0, -105), light));
+    objects.add(make_shared<quad>(point3(0, 0, 0), vec3(555, 0, 0), vec3(0, 0, 555), white));
+    objects.add(make_shared<quad>(point3(555, 555, 555), vec3(-555, 0, 0), vec3(0, 0, -555), white));
+    objects.add(make_shared<quad>(point3(0, 0, 555), vec3(555, 0, 0), vec3(0, 555, 0), white));
+    objects.add(make_shared<sphere>(point3(190, 90, 190), 90, white));
+    objects.add(make_shared<sphere>(point3(400, 100, 350), 100, white));
+
+    camera cam;
+    cam.lights = make_shared<light_bvh>(objects);
+    hittable_list scene(make_shared<bvh_node>(objects));
+
+    cam.aspect_ratio = 1.0;
+    cam.image_width = 160;
+    cam.max_depth = 10;
+    cam.background = colour(0, 0, 0);
+    cam.vfov = 40;
+    cam.lookfrom = point3(278, 278, -800);
+    cam.lookat = point3(278, 278, 0);
+    cam.vup = vec3(0, 1, 0);
+
+    // Stratified samples keep the direct light, which every pixel still samples itself, from hiding the
+    // difference the cache makes to the indirect light
+    cam.pixel_sampler = make_shared<sobol_sampler>();
+
+    auto timed_render = [&](int spp, double &seconds) {
+        cam.samples_per_pixel = spp;
+        auto start = std::chrono::steady_clock::now();
+        std::vector<colour> image = cam.render_image(scene);
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return image;
+    };
+
+    double seconds;
+    std::vector<colour> reference = timed_render(1024, seconds);
+    double reference_mean = 0;
+    for (const colour &c : reference) reference_mean += luminance(c) / reference.size();
+
+    auto report = [&](const std::string &name, const std::vector<colour> &image) {
+        // Pixels on the light only measure its antialiased edge
+        double squared_error = 0;
+        size_t counted = 0;
+        for (size_t i = 0; i < image.size(); i++) {
+            if (luminance(reference[i]) > 1) continue;
+            squared_error += luminance((image[i] - reference[i]) * (image[i] - reference[i]));
+            counted++;
+        }
+        std::cout << name << ": relative RMSE " << std::sqrt(squared_error / counted) / reference_mean
+                  << ", " << seconds << " s\n";
+    };
+    std::cout << "Reference, 1024 spp: " << seconds << " s\n";
+
+    for (int spp : {16, 64}) report("Path tracing, " + std::to_string(spp) + " spp", timed_render(spp, seconds));
+
+    // The second frame finds every record it needs already cached
+    cam.irradiance = make_shared<irradiance_cache>();
+    std::vector<colour> cached = timed_render(16, seconds);
+    report("Irradiance cache, 16 spp, first frame", cached);
+    std::cout << "  " << cam.irradiance->size() << " records\n";
+    report("Irradiance cache, 16 spp, next frame", timed_render(16, seconds));
+
+    std::ofstream out("irradiance_cache.ppm");
+    cam.write_image(out, cached);
+}
+
+// A random network of nested checkers evaluated through its virtual calls, then as a compiled
+// texture_program one point at a time and in batches of 256
+void texture_programs() {
+    const colour palette[] = {colour(0.8, 0.1, 0.1), colour(0.1, 0.8, 0.1), colour(0.1, 0.1, 0.8), colour(0.8, 0.8, 0.8)};
+    const double scales[] = {0.5, 0.75, 1, 1.5, 2, 3, 4, 6};
+
+    size_t node_count = 0;
+    std::function<shared_ptr<texture>(int)> network = [&](int depth) -> shared_ptr<texture> {
+        node_count++;
+        if (depth == 0) return make_shared<solid_colour>(palette[random_int(0, 3)]);
+        return make_shared<checker_texture>(scales[random_int(0, 7)], network(depth - 1), network(depth - 1));
+    };
+    shared_ptr<texture> root = network(9);
+    texture_program program(*root);
+    std::cout << node_count << " texture nodes compile to " << program.size() << " instructions\n";
+
+    // Few enough points to stay in cache, evaluated repeatedly
+    const size_t n = 16384, repeats = 100, run = 256;
+    std::vector<texture_query> queries(n);
+    for (auto &q : queries) q = {random_double(), random_double(), point3::random(-20, 20), 0};
+
+    auto time_ns = [&](auto &&f) {
+        auto start = std::chrono::steady_clock::now();
+        for (size_t r = 0; r < repeats; r++) f();
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        return elapsed.count() / (n * repeats);
+    };
+
+    std::vector<colour> tree(n), single(n), batched(n);
+    double tree_ns = time_ns([&] {
+        for (size_t i = 0; i < n; i++) tree[i] = root->filtered_value(queries[i].u, queries[i].v, queries[i].p, 0);
+    });
+    double single_ns = time_ns([&] {
+        for (size_t i = 0; i < n; i++) single[i] = program.evaluate(queries[i].u, queries[i].v, queries[i].p, 0);
+    });
+    double batched_ns = time_ns([&] {
+        for (size_t i = 0; i < n; i += run) program.evaluate(&queries[i], std::min(run, n - i), &batched[i]);
+    });
+
+    size_t mismatches = 0;
+    for (size_t i = 0; i < n; i++) {
+        for (int c = 0; c < 3; c++) mismatches += single[i][c] != tree[i][c] || batched[i][c] != tree[i][c];
+    }
+
+    std::cout << "Virtual calls: " << tree_ns << " ns per point\n";
+    std::cout << "Program:       " << single_ns << " ns per point\n";
+    std::cout << "Batched:       " << batched_ns << " ns per point\n";
+    std::cout << mismatches << " channels differ\n";
+}
+
+// A field of spheres streaking sideways, rendered still, then blurred over the shutter through a SAH tree
+// whose boxes span each sphere's whole path and through motion_bvh's linear bounds
+void motion_blur() {
+    hittable_list objects;
+    objects.add(make_shared<sphere>(point3(0, -1000, 0), 1000, make_shared<lambertian>(colour(0.5, 0.5, 0.5))));
+
+    auto material = make_shared<lambertian>(colour(0.7, 0.3, 0.3));
+    for (int a = -30; a < 30; a++) {
+        for (int b = -30; b < 30; b++) {
+            point3 center(a + 0.9 * random_double(), 0.2, b + 0.9 * random_double());
+            objects.add(make_shared<moving_sphere>(center, center + vec3(random_double(1, 3), 0, 0), 0.2, material));
+        }
+    }
+
+    // A glass ball that drops, bounces and drifts, keyed in four places
+    auto ball = make_shared<sphere>(point3(0, 0, 0), 1, make_shared<dielectric>(1.5));
+    objects.add(make_shared<keyframed_translate>(ball, std::vector<std::pair<double, vec3>>{
+        {0, vec3(0, 2.5, 0)}, {0.4, vec3(0.3, 1, 0)}, {0.7, vec3(0.6, 1.8, 0)}, {1, vec3(0.9, 1.2, 0)}}));
+
+    camera cam;
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.image_width = 320;
+    cam.samples_per_pixel = 16;
+    cam.max_depth = 8;
+    cam.background = colour(0.70, 0.80, 1.00);
+    cam.vfov = 30;
+    cam.lookfrom = point3(13, 3, 3);
+    cam.lookat = point3(0, 0, 0);
+    cam.vup = vec3(0, 1, 0);
+
+    // Best of three, as single renders vary by more than the trees differ
+    auto timed_render = [&](const std::string &name, const hittable &scene, double shutter) {
+        cam.shutter_close = shutter;
+        std::vector<colour> image;
+        double best = infinity;
+        for (int run = 0; run < 3; run++) {
+            auto start = std::chrono::steady_clock::now();
+            image = cam.render_image(scene);
+            best = std::fmin(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        }
+        std::cout << name << ": " << best << " s\n";
+        return image;
+    };
+
+    hittable_list union_boxes(make_shared<sbvh>(objects, 0));
+    hittable_list linear_bounds(make_shared<motion_bvh>(objects));
+
+    // Traversal work for rays into the field, at time 0 and then spread over the shutter
+    std::vector<ray> rays;
+    for (int i = 0; i < 200000; i++) {
+        point3 target(random_double(-30, 30), random_double(0, 1), random_double(-30, 30));
+        rays.push_back(ray(cam.lookfrom, target - cam.lookfrom));
+    }
+    auto traversal = [&](const std::string &name, const hittable &scene, double shutter) {
+        render_counters before = render_stats;
+        for (const ray &r : rays) {
+            hit_record rec;
+            scene.hit(ray(r.origin(), r.direction(), shutter * random_double()), interval(0.001, infinity), rec);
+        }
+        double count = double(rays.size());
+        std::cout << name << ": " << (render_stats.nodes_visited - before.nodes_visited) / count << " nodes/ray, "
+                  << (render_stats.primitive_tests - before.primitive_tests) / count << " primitive tests/ray\n";
+    };
+    traversal("Still, SAH over whole-shutter boxes", union_boxes, 0);
+    traversal("Still, motion_bvh", linear_bounds, 0);
+    traversal("Blurred, SAH over whole-shutter boxes", union_boxes, 1);
+    traversal("Blurred, motion_bvh", linear_bounds, 1);
+
+    timed_render("Still frame, motion_bvh", linear_bounds, 0);
+    timed_render("Blurred frame, SAH over whole-shutter boxes", union_boxes, 1);
+    std::vector<colour> blurred = timed_render("Blurred frame, motion_bvh", linear_bounds, 1);
+
+    std::ofstream out("motion_blur.ppm");
+    cam.write_image(out, blurred);
+}
+
+// Smoke in a Cornell box as a 64^3 voxel grid filling the room, mostly empty. Majorant grids of 1 (plain
+// delta tracking), 8 and 32 cells a side are compared by the density lookups their rays make.
+void participating_media() {
+    const int n = 64;
+    aabb room(point3(1, 1, 1), point3(554, 554, 554));
+    std::vector<float> values(size_t(n) * n * n, 0.0f);
+    std::vector<std::pair<point3, double>> puffs;
+    for (int i = 0; i < 12; i++) {
+        puffs.push_back({point3(random_double(180, 380), random_double(120, 300), random_double(180, 380)),
+                         random_double(30, 60)});
+    }
+    for (int z = 0; z < n; z++) {
+        for (int y = 0; y < n; y++) {
+            for (int x = 0; x < n; x++) {
+                point3 p(1 + (x + 0.5) * 553 / n, 1 + (y + 0.5) * 553 / n, 1 + (z + 0.5) * 553 / n);
+                double d = 0;
+                for (const auto &puff : puffs) {
+                    double r = (p - puff.first).length() / puff.second;
+                    d += std::fmax(0.0, 1 - r * r);
+                }
+                values[(size_t(z) * n + y) * n + x] = float(std::fmin(d, 1.0));
+            }
+        }
+    }
+    auto smoke = make_shared<voxel_density>(room, n, n, n, values);
+
+    hittable_list walls;
+    auto red = make_shared<lambertian>(colour(.65, .05, .05));
+    auto white = make_shared<lambertian>(colour(.73, .73, .73));
+    auto green = make_shared<lambertian>(colour(.12, .45, .15));
+    auto light = make_shared<diffuse_light>(colour(15, 15, 15));
+    walls.add(make_shared<quad>(point3(555, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), green));
+    walls.add(make_shared<quad>(point3(0, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), red));
+    walls.add(make_shared<quad>(point3(343, 554, 332), vec3(-130, 0, 0), vec3(0, 0, -105), light));
+    walls.add(make_shared<quad>(point3(0, 0, 0), vec3(555, 0, 0), vec3(0, 0, 555), white));
+    walls.add(make_shared<quad>(point3(555, 555, 555), vec3(-555, 0, 0), vec3(0, 0, -555), white));
+    walls.add(make_shared<quad>(point3(0, 0, 555), vec3(555, 0, 0), vec3(0, 555, 0), white));
+
+    camera cam;
+    cam.lights = make_shared<light_bvh>(walls);
+    cam.aspect_ratio = 1.0;
+    cam.image_width = 160;
+    cam.samples_per_pixel = 32;
+    cam.max_depth = 10;
+    cam.background = colour(0, 0, 0);
+    cam.vfov = 40;
+    cam.lookfrom = point3(278, 278, -800);
+    cam.lookat = point3(278, 278, 0);
+    cam.vup = vec3(0, 1, 0);
+
+    // Rays between random points of the room, as bounces and shadow rays inside it would go
+    std::vector<ray> rays;
+    double length = 0;
+    for (int i = 0; i < 100000; i++) {
+        point3 from = point3::random(1, 554), to = point3::random(1, 554);
+        rays.push_back(ray(from, to - from));
+        length += (to - from).length();
+    }
+    double voxel = 553.0 / n;
+    std::cout << "Marching in voxel-sized steps: " << length / rays.size() / voxel << " density lookups/ray\n";
+
+    std::vector<colour> image;
+    for (int resolution : {1, 8, 32}) {
+        auto medium = make_shared<heterogeneous_medium>(smoke, 0.05, colour(0.8, 0.8, 0.8), resolution);
+
+        render_counters before = render_stats;
+        size_t collisions = 0;
+        for (const ray &r : rays) collisions += medium->occluded(r, interval(0, 1)) ? 1 : 0;
+        double queries = double(render_stats.medium_queries - before.medium_queries);
+        double lookups = double(render_stats.density_lookups - before.density_lookups);
+
+        hittable_list scene = walls;
+        scene.add(medium);
+        auto start = std::chrono::steady_clock::now();
+        image = cam.render_image(hittable_list(make_shared<bvh_node>(scene)));
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        std::cout << "Majorant grid " << resolution << "^3: "
+                  << lookups / queries << " density lookups/ray, "
+                  << double(collisions) / rays.size() << " of rays collide; render " << seconds << " s\n";
+    }
+
+    std::ofstream out("participating_media.ppm");
+    cam.write_image(out, image);
+}
+
+// Renders through a shading_cache, swaps the material of the centre sphere and reshades only the tiles
+// that see it, then checks the cached path against a full render of the edited scene: every tile
+// reshaded from the cache must match exactly, and the dirty tiles alone miss only the edit's reflections
+void incremental_reshade() {
+    auto ground = make_shared<lambertian>(make_shared<checker_texture>(0.5, colour(0.2, 0.3, 0.1), colour(0.9, 0.9, 0.9)));
+    auto matte = make_shared<lambertian>(colour(0.7, 0.3, 0.3));
+    auto mirror = make_shared<metal>(colour(0.8, 0.8, 0.9), 0.05);
+    auto gold = make_shared<metal>(colour(0.8, 0.6, 0.2), 0.3);
+
+    auto make_scene = [&](shared_ptr<material> centre) {
+        hittable_list objects;
+        objects.add(make_shared<sphere>(point3(0, -1000, 0), 1000, ground));
+        objects.add(make_shared<sphere>(point3(0, 1, 0), 1, centre));
+        objects.add(make_shared<sphere>(point3(-2.2, 1, -0.5), 1, mirror));
+        objects.add(make_shared<sphere>(point3(2.2, 1, 0.5), 1, make_shared<dielectric>(1.5)));
+        return hittable_list(make_shared<bvh_node>(objects));
+    };
+
+    camera cam;
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.image_width = 240;
+    cam.samples_per_pixel = 16;
+    cam.max_depth = 10;
+    cam.background = colour(0.70, 0.80, 1.00);
+    cam.vfov = 25;
+    cam.lookfrom = point3(0, 3, 12);
+    cam.lookat = point3(0, 1, 0);
+    cam.vup = vec3(0, 1, 0);
+    cam.pixel_sampler = make_shared<sobol_sampler>();
+
+    auto seconds_for = [](auto &&f) {
+        auto start = std::chrono::steady_clock::now();
+        f();
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+    auto rmse = [](const std::vector<colour> &a, const std::vector<colour> &b) {
+        double sum = 0;
+        for (size_t i = 0; i < a.size(); i++) sum += luminance((a[i] - b[i]) * (a[i] - b[i]));
+        return std::sqrt(sum / a.size());
+    };
+
+    shading_cache cache;
+    hittable_list before = make_scene(matte);
+    std::cout << "First render, tracing every primary ray: "
+              << seconds_for([&] { cam.render_image(before, cache); }) << " s\n";
+
+    // The cache's copy of the centre material changes; the geometry, and so the scene, stays the same
+    hittable_list after = make_scene(gold);
+    cache.replace_material(matte, gold);
+    int dirty = cache.dirty_tiles();
+    std::vector<colour> reshaded;
+    double reshade_seconds = seconds_for([&] { reshaded = cam.render_image(after, cache); });
+
+    std::vector<colour> full;
+    double full_seconds = seconds_for([&] { full = cam.render_image(after); });
+    std::cout << "Reshading " << dirty << " dirty tiles: " << reshade_seconds << " s, against " << full_seconds
+              << " s for a full render; RMSE " << rmse(reshaded, full) << " from reflections of the edit\n";
+
+    cache.invalidate_all();
+    std::vector<colour> all = cam.render_image(after, cache);
+    size_t mismatches = 0;
+    for (size_t i = 0; i < all.size(); i++) {
+        for (int c = 0; c < 3; c++) mismatches += all[i][c] != full[i][c];
+    }
+    std::cout << "Reshading every tile from the cache: RMSE " << rmse(all, full) << ", " << mismatches
+              << " channels differ from the full render\n";
+
+    std::ofstream out("incremental_reshade.ppm");
+    cam.write_image(out, reshaded);
+}
+
+// Writes a 1024x1024 tiled texture, then renders a ground plane streaming it through a tile cache that
+// holds every tile and through one an eighth that size, reporting each cache's hits and misses
+void texture_streaming() {
+    const int size = 1024;
+    std::vector<colour> pixels(size_t(size) * size);
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+            // Offset bricks with darker mortar lines
+            int row = y / 32;
+            int column = (x + (row % 2) * 32) / 64;
+            bool mortar = y % 32 < 3 || (x + (row % 2) * 32) % 64 < 3;
+            double shade = 0.6 + 0.4 * ((row * 7 + column * 13) % 5) / 4.0;
+            pixels[size_t(y) * size + x] = mortar ? colour(0.3, 0.3, 0.3) : shade * colour(0.6, 0.25, 0.15);
+        }
+    }
+
+    const std::string path = "bricks.rtmt";
+    if (!write_tiled_texture(path, size, size, pixels)) {
+        std::cerr << "ERROR: Could not write '" << path << "'.\n";
+        return;
+    }
+
+    camera cam;
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.image_width = 320;
+    cam.samples_per_pixel = 16;
+    cam.max_depth = 4;
+    cam.background = colour(0.70, 0.80, 1.00);
+    cam.vfov = 40;
+    cam.lookfrom = point3(0, 2, 10);
+    cam.lookat = point3(0, 0, -10);
+    cam.vup = vec3(0, 1, 0);
+
+    tiled_texture_file file(path);
+    size_t texture_bytes = 0;
+    for (int l = 0; l < file.level_count(); l++) {
+        texture_bytes += size_t(file.level(l).tiles_x) * file.level(l).tiles_y * file.tile_bytes();
+    }
+
+    std::vector<colour> image;
+    for (size_t divisor : {1, 8}) {
+        texture_tile_cache cache(texture_bytes / divisor);
+        auto bricks = make_shared<lambertian>(make_shared<image_texture>(path, 40.0, cache));
+        hittable_list world;
+        world.add(make_shared<quad>(point3(-20, 0, 10), vec3(40, 0, 0), vec3(0, 0, -40), bricks));
+
+        auto start = std::chrono::steady_clock::now();
+        image = cam.render_image(world);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        std::cout << "Cache for 1/" << divisor << " of the texture, render " << seconds << " s\n";
+        cache.report(std::cout);
+    }
+
+    std::ofstream out("texture_streaming.ppm");
+    cam.write_image(out, image);
+}
+
+int main(int argc, char **argv) {
+    std::string mode = (argc > 1) ? argv[1] : "";
+
+    if (mode == "sampler-convergence") {
+        sampler_convergence();
+    } else if (mode == "out-of-core") {
+        out_of_core_spheres();
+    } else if (mode == "progressive" && argc == 3) {
+        infinity_room(std::stod(argv[2]));
+    } else if (mode == "shadow-rays") {
+        shadow_ray_benchmark();
+    } else if (mode == "bvh-layouts") {
+        bvh_layout_comparison();
+    } else if (mode == "memory-budget") {
+        memory_budget();
+    } else if (mode == "turntable") {
+        turntable();
+    } else if (mode == "fast-math-accuracy") {
+        fast_math_accuracy();
+    } else if (mode == "cost-map") {
+        cost_maps();
+    } else if (mode == "environment") {
+        environment_lighting(argc > 2 ? argv[2] : "");
+    } else if (mode == "spatial-splits") {
+        spatial_split_comparison();
+    } else if (mode == "render-to-buffer") {
+        render_to_buffer();
+    } else if (mode == "scheduler") {
+        scheduled_previews();
+    } else if (mode == "bidirectional") {
+        bidirectional_comparison();
+    } else if (mode == "path-guiding") {
+        path_guiding_comparison();
+    } else if (mode == "irradiance-cache") {
+        irradiance_caching();
+    } else if (mode == "texture-programs") {
+        texture_programs();
+    } else if (mode == "motion-blur") {
+        motion_blur();
+    } else if (mode == "participating-media") {
+        participating_media();
+    } else if (mode == "incremental-reshade") {
+        incremental_reshade();
+    } else if (mode == "many-lights") {
+        many_lights_benchmark();
+    } else if (mode == "texture-streaming") {
+        texture_streaming();
+    } else if (mode == "tile-texture" && argc == 4) {
+        // Convert a PPM image into the tiled mip-mapped format read by image_texture
+        int width, height;
+        std::vector<colour> pixels;
+        if (!read_ppm(argv[2], width, height, pixels) || !write_tiled_texture(argv[3], width, height, pixels)) {
+            std::cerr << "ERROR: Could not convert '" << argv[2] << "'.\n";
+            return 1;
+        }
+    } else {
+        infinity_room();
+    }
 }
\ No newline at end of file
@@ -2,6 +2,7 @@
 #define MATERIAL_H
 
 #include "hittable.h"
+#include "sampler.h"
 #include "texture.h"
 
 class material {
@@ -15,24 +16,80 @@ class material {
         virtual bool scatter(const ray &r_in, const hit_record &rec, colour &attenuation, ray &scattered) const {
             return false;
         }
+
+        // Density scatter() draws scattered from; zero for specular materials, which skip light sampling
+        virtual double scattering_pdf(const ray &r_in, const hit_record &rec, const ray &scattered) const {
+            return 0;
+        }
+
+        // BRDF times the cosine term for light leaving along scattered after arriving along r_in, for
+        // connecting paths; zero for specular materials, which cannot be connected to
+        virtual colour scattering_value(const ray &r_in, const hit_record &rec, const ray &scattered) const {
+            return colour(0, 0, 0);
+        }
+
+        // scatter() for count hits on this material at once, setting did_scatter[k] to its result for hit k
+        virtual void scatter_batch(const ray *r_in, const hit_record *recs, size_t count, colour *attenuation,
+                                   ray *scattered, bool *did_scatter) const {
+            for (size_t k = 0; k < count; k++) did_scatter[k] = scatter(r_in[k], recs[k], attenuation[k], scattered[k]);
+        }
+
+        // Whether shading reads the hit's u and v
+        virtual bool uses_uv() const { return false; }
+
+        // Adds the estimated heap bytes of this material and its textures
+        virtual void account_memory(memory_report &report) const {}
 };
 
 class lambertian : public material {
     public:
-        lambertian(const colour &albedo) : tex(make_shared<solid_colour>(albedo)) {}
-        lambertian(shared_ptr<texture> tex) : tex(tex) {}
+        lambertian(const colour &albedo) : albedo(albedo) {}
+        lambertian(shared_ptr<texture> tex) : tex(tex), albedo(*tex) {}
 
         bool scatter(const ray &r_in, const hit_record &rec, colour &attenuation, ray &scattered) const override {
-            vec3 scatter_direction = rec.normal + random_unit_vector();
+            vec3 scatter_direction = rec.normal + sample_unit_vector();
             if (scatter_direction.near_zero()) scatter_direction = rec.normal;
 
-            scattered = ray(rec.p, scatter_direction);
-            attenuation = tex->value(rec.u, rec.v, rec.p);
+            scattered = ray(rec.p, scatter_direction, r_in.time());
+            attenuation = albedo.evaluate(rec.u, rec.v, rec.p, rec.footprint);
             return true;
         }
 
+        void scatter_batch(const ray *r_in, const hit_record *recs, size_t count, colour *attenuation,
+                           ray *scattered, bool *did_scatter) const override {
+            std::vector<texture_query> queries(count);
+            for (size_t k = 0; k < count; k++) queries[k] = {recs[k].u, recs[k].v, recs[k].p, recs[k].footprint};
+            albedo.evaluate(queries.data(), count, attenuation);
+
+            for (size_t k = 0; k < count; k++) {
+                vec3 scatter_direction = recs[k].normal + sample_unit_vector();
+                if (scatter_direction.near_zero()) scatter_direction = recs[k].normal;
+                scattered[k] = ray(recs[k].p, scatter_direction, r_in[k].time());
+                did_scatter[k] = true;
+            }
+        }
+
+        // Cosine-weighted, so attenuation * scattering_pdf is the BRDF times the cosine term
+        double scattering_pdf(const ray &r_in, const hit_record &rec, const ray &scattered) const override {
+            double cos_theta = dot(rec.normal, unit_vector(scattered.direction()));
+            return cos_theta < 0 ? 0 : cos_theta / pi;
+        }
+
+        colour scattering_value(const ray &r_in, const hit_record &rec, const ray &scattered) const override {
+            return albedo.evaluate(rec.u, rec.v, rec.p, rec.footprint) * scattering_pdf(r_in, rec, scattered);
+        }
+
+        bool uses_uv() const override { return albedo.uses_uv(); }
+
+        void account_memory(memory_report &report) const override {
+            if (!report.first_visit(this)) return;
+            report.add(memory_report::materials, shared_bytes<lambertian>() + albedo.bytes());
+            if (tex) tex->account_memory(report);
+        }
+
     private:
-        shared_ptr<texture> tex;
+        shared_ptr<texture> tex;           // Null for a plain colour; keeps the textures albedo calls alive
+        texture_program albedo;
 };
 
 class metal : public material {
@@ -41,12 +98,17 @@ class metal : public material {
 
         bool scatter(const ray &r_in, const hit_record &rec, colour &attenuation, ray &scattered) const override {
             vec3 reflected = reflect(r_in.direction(), rec.normal);
-            reflected = unit_vector(reflected) + (fuzz * random_unit_vector());
-            scattered = ray(rec.p, reflected);
+            reflected = unit_vector(reflected) + (fuzz * sample_unit_vector());
+            scattered = ray(rec.p, reflected, r_in.time());
             attenuation = albedo;
             return (dot(scattered.direction(), rec.normal) > 0);
         }
 
+        void account_memory(memory_report &report) const override {
+            if (!report.first_visit(this)) return;
+            report.add(memory_report::materials, shared_bytes<metal>());
+        }
+
     private:
         colour albedo;
         double fuzz;
@@ -66,37 +128,85 @@ class dielectric : public material {
 
             vec3 direction;
             
-            if (ri * sin_theta > 1.0 || reflectance(cos_theta, ri) > random_double()) {
+            if (ri * sin_theta > 1.0 || reflectance(cos_theta, ri) > sample_1d()) {
                 direction = reflect(unit_direction, rec.normal);
             } else {
                 direction = refract(unit_direction, rec.normal, ri);
             }
 
-            scattered = ray(rec.p, direction);
+            scattered = ray(rec.p, direction, r_in.time());
             return true;
         }
 
+        void account_memory(memory_report &report) const override {
+            if (!report.first_visit(this)) return;
+            report.add(memory_report::materials, shared_bytes<dielectric>());
+        }
+
     private:
         double refraction_index;
 
         static double reflectance(double cosine, double refraction_index) {
             double r0 = (1 - refraction_index) / (1 + refraction_index);
             r0 *= r0;
-            return r0 + (1 - r0) * std::pow((1 - cosine), 5);
+            return r0 + (1 - r0) * pow5(1 - cosine);
         }
 };
 
 class diffuse_light : public material {
     public:
-        diffuse_light(shared_ptr<texture> text) : tex(tex) {}
-        diffuse_light(const colour &emit) : tex(make_shared<solid_colour>(emit)) {}
+        diffuse_light(shared_ptr<texture> tex) : tex(tex), emission(*tex) {}
+        diffuse_light(const colour &emit) : emission(emit) {}
 
         colour emitted(double u, double v, const point3 &p) const override {
-            return tex->value(u, v, p);
+            return emission.evaluate(u, v, p, 0);
+        }
+
+        bool uses_uv() const override { return emission.uses_uv(); }
+
+        void account_memory(memory_report &report) const override {
+            if (!report.first_visit(this)) return;
+            report.add(memory_report::materials, shared_bytes<diffuse_light>() + emission.bytes());
+            if (tex) tex->account_memory(report);
+        }
+
+    private:
+        shared_ptr<texture> tex;
+        texture_program emission;
+};
+
+// Scatters equally in every direction, for points inside participating media; albedo is the share of
+// the extinction that scatters rather than absorbs
+class isotropic : public material {
+    public:
+        isotropic(const colour &albedo) : albedo(albedo) {}
+        isotropic(shared_ptr<texture> tex) : tex(tex), albedo(*tex) {}
+
+        bool scatter(const ray &r_in, const hit_record &rec, colour &attenuation, ray &scattered) const override {
+            scattered = ray(rec.p, sample_unit_vector(), r_in.time());
+            attenuation = albedo.evaluate(rec.u, rec.v, rec.p, rec.footprint);
+            return true;
+        }
+
+        double scattering_pdf(const ray &r_in, const hit_record &rec, const ray &scattered) const override {
+            return 1 / (4 * pi);
+        }
+
+        colour scattering_value(const ray &r_in, const hit_record &rec, const ray &scattered) const override {
+            return albedo.evaluate(rec.u, rec.v, rec.p, rec.footprint) / (4 * pi);
+        }
+
+        bool uses_uv() const override { return albedo.uses_uv(); }
+
+        void account_memory(memory_report &report) const override {
+            if (!report.first_visit(this)) return;
+            report.add(memory_report::materials, shared_bytes<isotropic>() + albedo.bytes());
+            if (tex) tex->account_memory(report);
         }
 
     private:
         shared_ptr<texture> tex;
+        texture_program albedo;
 };
 
 #endif
@@ -0,0 +1,270 @@
+#ifndef MEDIUM_H
+#define MEDIUM_H
+
+#include "hittable.h"
+#include "material.h"
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+// Density of a participating medium inside bounds, zero outside
+class density_field {
+    public:
+        virtual ~density_field() = default;
+
+        virtual double density(const point3 &p) const = 0;
+
+        // Upper bound on density() over box, for majorants
+        virtual double max_density(const aabb &box) const = 0;
+
+        virtual aabb bounds() const = 0;
+
+        virtual void account_memory(memory_report &report) const {}
+};
+
+// Densities at the centres of nx x ny x nz voxels filling box, x fastest, interpolated trilinearly
+class voxel_density : public density_field {
+    public:
+        voxel_density(const aabb &box, int nx, int ny, int nz, std::vector<float> values)
+          : box(box), values(std::move(values)) {
+            n[0] = nx;
+            n[1] = ny;
+            n[2] = nz;
+        }
+
+        double density(const point3 &p) const override {
+            int i[3];
+            double f[3];
+            for (int a = 0; a < 3; a++) {
+                double x = voxel_coordinate(p[a], a);
+                if (x < -0.5 || x > n[a] - 0.5) return 0;
+                double base = std::floor(x);
+                i[a] = int(base);
+                f[a] = x - base;
+            }
+
+            double result = 0;
+            for (int corner = 0; corner < 8; corner++) {
+                double weight = 1;
+                int index[3];
+                for (int a = 0; a < 3; a++) {
+                    int offset = (corner >> a) & 1;
+                    weight *= offset ? f[a] : 1 - f[a];
+                    index[a] = std::clamp(i[a] + offset, 0, n[a] - 1);
+                }
+                result += weight * at(index[0], index[1], index[2]);
+            }
+            return result;
+        }
+
+        // Largest voxel any point of the box interpolates from
+        double max_density(const aabb &query) const override {
+            int low[3], high[3];
+            for (int a = 0; a < 3; a++) {
+                const interval &extent = query.axis_interval(a);
+                low[a] = std::clamp(int(std::floor(voxel_coordinate(extent.min, a))), 0, n[a] - 1);
+                high[a] = std::clamp(int(std::floor(voxel_coordinate(extent.max, a))) + 1, 0, n[a] - 1);
+            }
+
+            double result = 0;
+            for (int z = low[2]; z <= high[2]; z++) {
+                for (int y = low[1]; y <= high[1]; y++) {
+                    for (int x = low[0]; x <= high[0]; x++) result = std::fmax(result, at(x, y, z));
+                }
+            }
+            return result;
+        }
+
+        aabb bounds() const override { return box; }
+
+        void account_memory(memory_report &report) const override {
+            if (report.first_visit(this)) report.add(memory_report::geometry, shared_bytes<voxel_density>() + vector_bytes(values));
+        }
+
+    private:
+        aabb box;
+        int n[3];
+        std::vector<float> values;
+
+        double at(int x, int y, int z) const { return values[(size_t(z) * n[1] + y) * n[0] + x]; }
+
+        // Position along axis a in voxels, with voxel centres at whole numbers
+        double voxel_coordinate(double p, int a) const {
+            const interval &extent = box.axis_interval(a);
+            return (p - extent.min) / extent.size() * n[a] - 0.5;
+        }
+};
+
+// Density from a function, which may change by at most lipschitz per unit of distance; that bounds it
+// over any box from its value at the centre
+class procedural_density : public density_field {
+    public:
+        procedural_density(const aabb &box, double lipschitz, std::function<double(const point3 &)> field)
+          : box(box), lipschitz(lipschitz), field(std::move(field)) {}
+
+        double density(const point3 &p) const override {
+            if (!box.x.contains(p.x()) || !box.y.contains(p.y()) || !box.z.contains(p.z())) return 0;
+            return std::fmax(0.0, field(p));
+        }
+
+        double max_density(const aabb &query) const override {
+            point3 centre(0.5 * (query.x.min + query.x.max), 0.5 * (query.y.min + query.y.max), 0.5 * (query.z.min + query.z.max));
+            double half_diagonal = 0.5 * vec3(query.x.size(), query.y.size(), query.z.size()).length();
+            return std::fmax(0.0, field(centre) + lipschitz * half_diagonal);
+        }
+
+        aabb bounds() const override { return box; }
+
+    private:
+        aabb box;
+        double lipschitz;
+        std::function<double(const point3 &)> field;
+};
+
+// Heterogeneous participating medium whose extinction is density_scale times the field's density. Free
+// paths are sampled by delta tracking (Woodcock tracking) against a coarse grid of majorants walked cell
+// by cell, so empty cells are stepped over without looking at the density and thin ones in a few long
+// strides. A hit is a real collision: it lands on the phase function material with a zero normal, as
+// points off any surface have. occluded() tracks the same way, which estimates transmittance without bias.
+// Tracking draws independent randoms, since the number it takes varies from ray to ray.
+class heterogeneous_medium : public hittable {
+    public:
+        heterogeneous_medium(shared_ptr<density_field> field, double density_scale, shared_ptr<material> phase,
+                             int majorant_resolution = 16)
+          : field(field), density_scale(density_scale), phase(phase), box(field->bounds()) {
+            for (int a = 0; a < 3; a++) {
+                const interval &extent = box.axis_interval(a);
+                cells[a] = majorant_resolution;
+                cell_size[a] = extent.size() / cells[a];
+            }
+
+            majorants.resize(size_t(cells[0]) * cells[1] * cells[2]);
+            for (int z = 0; z < cells[2]; z++) {
+                for (int y = 0; y < cells[1]; y++) {
+                    for (int x = 0; x < cells[0]; x++) {
+                        point3 low(box.x.min + x * cell_size[0], box.y.min + y * cell_size[1], box.z.min + z * cell_size[2]);
+                        point3 high = low + vec3(cell_size[0], cell_size[1], cell_size[2]);
+                        majorants[cell_index(x, y, z)] = density_scale * field->max_density(aabb(low, high));
+                    }
+                }
+            }
+        }
+
+        heterogeneous_medium(shared_ptr<density_field> field, double density_scale, const colour &albedo,
+                             int majorant_resolution = 16)
+          : heterogeneous_medium(field, density_scale, make_shared<isotropic>(albedo), majorant_resolution) {}
+
+        bool hit(const ray &r, interval ray_t, hit_record &rec) const override {
+            double t;
+            if (!track(r, ray_t, t)) return false;
+            rec.t = t;
+            rec.prim = this;
+            return true;
+        }
+
+        bool occluded(const ray &r, interval ray_t) const override {
+            double t;
+            return track(r, ray_t, t);
+        }
+
+        void complete(const ray &r, hit_record &rec, bool need_uv) const override {
+            rec.p = r.at(rec.t);
+            rec.normal = vec3(0, 0, 0);
+            rec.front_face = true;
+            rec.u = rec.v = 0;
+            rec.mat = phase;
+        }
+
+        aabb bounding_box() const override { return box; }
+
+        void account_memory(memory_report &report) const override {
+            if (!report.first_visit(this)) return;
+            report.add(memory_report::geometry, shared_bytes<heterogeneous_medium>() + vector_bytes(majorants));
+            field->account_memory(report);
+            phase->account_memory(report);
+        }
+
+    private:
+        shared_ptr<density_field> field;
+        double density_scale;
+        shared_ptr<material> phase;
+        aabb box;
+        int cells[3];
+        double cell_size[3];
+        std::vector<double> majorants;
+
+        size_t cell_index(int x, int y, int z) const { return (size_t(z) * cells[1] + y) * cells[0] + x; }
+
+        // First real collision along r within ray_t, in the ray's parameter
+        bool track(const ray &r, interval ray_t, double &t_hit) const {
+            render_stats.medium_queries++;
+
+            // Clip to the box
+            const point3 &origin = r.origin();
+            const vec3 &direction = r.direction();
+            for (int a = 0; a < 3; a++) {
+                const interval &extent = box.axis_interval(a);
+                double inverse = 1 / direction[a];
+                double t0 = (extent.min - origin[a]) * inverse;
+                double t1 = (extent.max - origin[a]) * inverse;
+                if (t0 > t1) std::swap(t0, t1);
+                ray_t.min = std::fmax(ray_t.min, t0);
+                ray_t.max = std::fmin(ray_t.max, t1);
+            }
+            if (!(ray_t.max > ray_t.min)) return false;
+
+            // Cell walk (Amanatides and Woo) from where the ray enters
+            double speed = direction.length();
+            point3 entry = r.at(ray_t.min);
+            int cell[3], step[3];
+            double next[3], delta[3];
+            for (int a = 0; a < 3; a++) {
+                const interval &extent = box.axis_interval(a);
+                cell[a] = std::clamp(int((entry[a] - extent.min) / cell_size[a]), 0, cells[a] - 1);
+                if (direction[a] > 0) {
+                    step[a] = 1;
+                    next[a] = (extent.min + (cell[a] + 1) * cell_size[a] - origin[a]) / direction[a];
+                    delta[a] = cell_size[a] / direction[a];
+                } else if (direction[a] < 0) {
+                    step[a] = -1;
+                    next[a] = (extent.min + cell[a] * cell_size[a] - origin[a]) / direction[a];
+                    delta[a] = -cell_size[a] / direction[a];
+                } else {
+                    step[a] = 0;
+                    next[a] = delta[a] = infinity;
+                }
+            }
+
+            double t = ray_t.min;
+            while (t < ray_t.max) {
+                int axis = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2) : (next[1] < next[2] ? 1 : 2);
+                double cell_exit = std::fmin(next[axis], ray_t.max);
+
+                // Free paths are memoryless, so tracking restarts at each cell boundary with its majorant
+                double majorant = majorants[cell_index(cell[0], cell[1], cell[2])] * speed;
+                if (majorant > 0) {
+                    double s = t;
+                    while (true) {
+                        s -= std::log(1 - random_double()) / majorant;
+                        if (s >= cell_exit) break;
+
+                        render_stats.density_lookups++;
+                        if (random_double() * majorant < density_scale * field->density(r.at(s)) * speed) {
+                            t_hit = s;
+                            return true;
+                        }
+                    }
+                }
+
+                t = cell_exit;
+                cell[axis] += step[axis];
+                if (cell[axis] < 0 || cell[axis] >= cells[axis]) break;
+                next[axis] += delta[axis];
+            }
+
+            return false;
+        }
+};
+
+#endif
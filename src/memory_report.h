@@ -0,0 +1,58 @@
+#ifndef MEMORY_REPORT_H
+#define MEMORY_REPORT_H
+
+#include <cstddef>
+#include <iostream>
+#include <unordered_set>
+#include <vector>
+
+// Estimated heap bytes of a render, by category. Scene objects add themselves through account_memory();
+// anything reachable through several shared_ptrs is counted once.
+class memory_report {
+    public:
+        enum category { geometry, bvh, materials, textures, framebuffers, thread_state, category_count };
+
+        void add(category c, size_t bytes) { totals[c] += bytes; }
+
+        // True the first time an object is seen, so shared materials and textures count once
+        bool first_visit(const void *object) { return seen.insert(object).second; }
+
+        size_t bytes(category c) const { return totals[c]; }
+
+        size_t total() const {
+            size_t sum = 0;
+            for (size_t bytes : totals) sum += bytes;
+            return sum;
+        }
+
+        void print(std::ostream &out) const {
+            static const char *names[category_count] = {
+                "geometry", "BVH", "materials", "textures", "framebuffers", "per-thread state"
+            };
+
+            for (int c = 0; c < category_count; c++) {
+                out << "  " << names[c] << ": " << mebibytes(totals[c]) << " MiB\n";
+            }
+            out << "  total: " << mebibytes(total()) << " MiB\n";
+        }
+
+        static double mebibytes(size_t bytes) { return bytes / (1024.0 * 1024.0); }
+
+    private:
+        size_t totals[category_count] = {};
+        std::unordered_set<const void *> seen;
+};
+
+// Heap bytes of an object made with make_shared: the object plus its in-place control block (a vtable
+// pointer and two reference counts)
+template <typename T>
+constexpr size_t shared_bytes() {
+    return sizeof(T) + sizeof(void *) + 2 * sizeof(int);
+}
+
+template <typename T>
+size_t vector_bytes(const std::vector<T> &v) {
+    return v.capacity() * sizeof(T);
+}
+
+#endif
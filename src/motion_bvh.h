@@ -0,0 +1,310 @@
+#ifndef MOTION_BVH_H
+#define MOTION_BVH_H
+
+#include "aabb.h"
+#include "hittable.h"
+#include "hittable_list.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// BVH over moving objects with linear bounds: every node keeps a box for time 0 and one for time 1 and a
+// ray is tested against their interpolation at its own time. Since each object's motion_bounds() hold it
+// at every time between, so do their merged boxes, and a node only ever spans where its objects are at
+// that moment rather than everywhere they pass through the shutter. Splits are binned SAH over the
+// centroids at mid-shutter, costed by the area averaged over the two ends.
+class motion_bvh : public hittable {
+    public:
+        motion_bvh(hittable_list list) : owned(list.objects) {
+            bbox = aabb::empty;
+            for (const auto &object : owned) bbox = aabb(bbox, object->bounding_box());
+
+            if (owned.empty()) return;
+
+            std::vector<reference> references;
+            for (const auto &object : owned) {
+                reference ref;
+                ref.object = object.get();
+                object->motion_bounds(ref.start, ref.end);
+                references.push_back(ref);
+            }
+
+            nodes.reserve(2 * owned.size());
+            primitives.reserve(owned.size());
+            build(references, 0, references.size(), 0);
+        }
+
+        bool hit(const ray &r, interval ray_t, hit_record &rec) const override {
+            if (nodes.empty()) return false;
+
+            node_ray nr(r);
+            uint32_t stack[2 * max_depth + 2];
+            int top = 0;
+            stack[top++] = 0;
+
+            bool hit_anything = false;
+            double closest = ray_t.max;
+
+            while (top > 0) {
+                uint32_t index = stack[--top];
+                const node &n = nodes[index];
+                render_stats.nodes_visited++;
+                if (!hit_node(n, nr, interval(ray_t.min, closest))) continue;
+
+                if (n.count > 0) {
+                    for (uint32_t i = n.first; i < n.first + n.count; i++) {
+                        if (primitives[i]->hit(r, interval(ray_t.min, closest), rec)) {
+                            hit_anything = true;
+                            closest = rec.t;
+                        }
+                    }
+                    continue;
+                }
+
+                if (r.direction()[n.axis] < 0) {
+                    stack[top++] = index + 1;
+                    stack[top++] = n.first;
+                } else {
+                    stack[top++] = n.first;
+                    stack[top++] = index + 1;
+                }
+            }
+
+            return hit_anything;
+        }
+
+        bool occluded(const ray &r, interval ray_t) const override {
+            if (nodes.empty()) return false;
+
+            node_ray nr(r);
+            uint32_t stack[2 * max_depth + 2];
+            int top = 0;
+            stack[top++] = 0;
+
+            while (top > 0) {
+                uint32_t index = stack[--top];
+                const node &n = nodes[index];
+                render_stats.nodes_visited++;
+                if (!hit_node(n, nr, ray_t)) continue;
+
+                if (n.count > 0) {
+                    for (uint32_t i = n.first; i < n.first + n.count; i++) {
+                        if (primitives[i]->occluded(r, ray_t)) return true;
+                    }
+                    continue;
+                }
+
+                stack[top++] = n.first;
+                stack[top++] = index + 1;
+            }
+
+            return false;
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        void motion_bounds(aabb &start, aabb &end) const override {
+            if (nodes.empty()) {
+                start = end = bbox;
+                return;
+            }
+            const node &root = nodes[0];
+            start = aabb(point3(root.bounds[0][0], root.bounds[0][1], root.bounds[0][2]),
+                         point3(root.bounds[1][0], root.bounds[1][1], root.bounds[1][2]));
+            end = aabb(point3(root.bounds[0][0] + root.motion[0][0], root.bounds[0][1] + root.motion[0][1],
+                              root.bounds[0][2] + root.motion[0][2]),
+                       point3(root.bounds[1][0] + root.motion[1][0], root.bounds[1][1] + root.motion[1][1],
+                              root.bounds[1][2] + root.motion[1][2]));
+        }
+
+        size_t node_count() const { return nodes.size(); }
+
+        void account_memory(memory_report &report) const override {
+            if (!report.first_visit(this)) return;
+            report.add(memory_report::bvh, shared_bytes<motion_bvh>() + vector_bytes(nodes) + vector_bytes(primitives));
+            report.add(memory_report::geometry, vector_bytes(owned));
+            for (const auto &object : owned) object->account_memory(report);
+        }
+
+    private:
+        static constexpr int max_depth = 48;
+        static constexpr int bin_count = 16;
+        static constexpr size_t max_leaf_size = 4;
+        static constexpr double traversal_cost = 1;
+        static constexpr double intersection_cost = 1;
+
+        // Corners at time 0 and how far each moves by time 1, [0] the minimum and [1] the maximum, so
+        // the box at a ray's time is one multiply-add per slab
+        struct node {
+            double bounds[2][3];
+            double motion[2][3];
+            uint32_t first = 0;            // Right child of an interior node, first primitive of a leaf
+            uint32_t count = 0;            // Primitives in a leaf; 0 for interior nodes, whose left child follows
+            int axis = 0;
+        };
+
+        struct reference {
+            const hittable *object;
+            aabb start, end;
+        };
+
+        // Per-ray terms of the slab test, with each axis's near slab picked by the direction's sign
+        struct node_ray {
+            double origin[3];
+            double inverse[3];
+            int near[3];
+            double time;
+
+            node_ray(const ray &r) : time(r.time()) {
+                for (int axis = 0; axis < 3; axis++) {
+                    origin[axis] = r.origin()[axis];
+                    inverse[axis] = 1 / r.direction()[axis];
+                    near[axis] = inverse[axis] < 0 ? 1 : 0;
+                }
+            }
+        };
+
+        std::vector<node> nodes;
+        std::vector<const hittable *> primitives;
+        std::vector<shared_ptr<hittable>> owned;
+        aabb bbox;
+
+        uint32_t build(std::vector<reference> &references, size_t begin, size_t end, int depth) {
+            uint32_t index = uint32_t(nodes.size());
+            nodes.emplace_back();
+
+            aabb start_box = aabb::empty, end_box = aabb::empty;
+            for (size_t i = begin; i < end; i++) {
+                start_box = aabb(start_box, references[i].start);
+                end_box = aabb(end_box, references[i].end);
+            }
+            for (int axis = 0; axis < 3; axis++) {
+                const interval &a = start_box.axis_interval(axis);
+                const interval &b = end_box.axis_interval(axis);
+                nodes[index].bounds[0][axis] = a.min;
+                nodes[index].bounds[1][axis] = a.max;
+                nodes[index].motion[0][axis] = b.min - a.min;
+                nodes[index].motion[1][axis] = b.max - a.max;
+            }
+
+            size_t n = end - begin;
+            if (n == 1 || depth >= max_depth) return make_leaf(index, references, begin, end);
+
+            // Binned SAH over mid-shutter centroids
+            double best_cost = infinity;
+            int best_axis = 0;
+            double best_position = 0;
+            for (int axis = 0; axis < 3; axis++) {
+                interval extent = interval::empty;
+                for (size_t i = begin; i < end; i++) {
+                    double c = centroid(references[i], axis);
+                    extent = interval(extent, interval(c, c));
+                }
+                if (extent.size() <= 0) continue;
+
+                aabb bin_start[bin_count], bin_end[bin_count];
+                size_t counts[bin_count] = {};
+                for (int b = 0; b < bin_count; b++) bin_start[b] = bin_end[b] = aabb::empty;
+                for (size_t i = begin; i < end; i++) {
+                    int b = bin_of(centroid(references[i], axis), extent);
+                    bin_start[b] = aabb(bin_start[b], references[i].start);
+                    bin_end[b] = aabb(bin_end[b], references[i].end);
+                    counts[b]++;
+                }
+
+                double right_area[bin_count];
+                size_t right_count[bin_count];
+                aabb right_start = aabb::empty, right_end = aabb::empty;
+                size_t right_total = 0;
+                for (int b = bin_count - 1; b > 0; b--) {
+                    right_start = aabb(right_start, bin_start[b]);
+                    right_end = aabb(right_end, bin_end[b]);
+                    right_total += counts[b];
+                    right_area[b] = mean_area(right_start, right_end);
+                    right_count[b] = right_total;
+                }
+
+                aabb left_start = aabb::empty, left_end = aabb::empty;
+                size_t left_total = 0;
+                for (int plane = 1; plane < bin_count; plane++) {
+                    left_start = aabb(left_start, bin_start[plane - 1]);
+                    left_end = aabb(left_end, bin_end[plane - 1]);
+                    left_total += counts[plane - 1];
+                    if (left_total == 0 || right_count[plane] == 0) continue;
+
+                    double cost = traversal_cost + intersection_cost
+                                * (mean_area(left_start, left_end) * left_total + right_area[plane] * right_count[plane])
+                                / mean_area(start_box, end_box);
+                    if (cost < best_cost) {
+                        best_cost = cost;
+                        best_axis = axis;
+                        best_position = extent.min + extent.size() * plane / bin_count;
+                    }
+                }
+            }
+
+            if (best_cost >= intersection_cost * n && n <= max_leaf_size) return make_leaf(index, references, begin, end);
+
+            size_t mid = begin;
+            if (best_cost < infinity) {
+                auto split = std::partition(references.begin() + begin, references.begin() + end, [&](const reference &ref) {
+                    return centroid(ref, best_axis) < best_position;
+                });
+                mid = size_t(split - references.begin());
+            }
+
+            // Coincident centroids leave nothing to split on, so halve the range
+            if (mid == begin || mid == end) {
+                mid = begin + n / 2;
+                best_axis = aabb(start_box, end_box).longest_axis();
+            }
+
+            nodes[index].axis = best_axis;
+            build(references, begin, mid, depth + 1);
+            uint32_t right_index = build(references, mid, end, depth + 1);
+            nodes[index].first = right_index;
+            return index;
+        }
+
+        uint32_t make_leaf(uint32_t index, const std::vector<reference> &references, size_t begin, size_t end) {
+            nodes[index].first = uint32_t(primitives.size());
+            nodes[index].count = uint32_t(end - begin);
+            for (size_t i = begin; i < end; i++) primitives.push_back(references[i].object);
+            return index;
+        }
+
+        // Slab test against the node's box at the ray's time
+        static bool hit_node(const node &n, const node_ray &r, interval ray_t) {
+            for (int axis = 0; axis < 3; axis++) {
+                int near = r.near[axis], far = 1 - near;
+                double t0 = (n.bounds[near][axis] + r.time * n.motion[near][axis] - r.origin[axis]) * r.inverse[axis];
+                double t1 = (n.bounds[far][axis] + r.time * n.motion[far][axis] - r.origin[axis]) * r.inverse[axis];
+                ray_t.min = std::max(ray_t.min, t0);
+                ray_t.max = std::min(ray_t.max, t1);
+            }
+            return ray_t.max > ray_t.min;
+        }
+
+        static int bin_of(double x, const interval &extent) {
+            int b = int((x - extent.min) / extent.size() * bin_count);
+            return std::clamp(b, 0, bin_count - 1);
+        }
+
+        static double centroid(const reference &ref, int axis) {
+            const interval &a = ref.start.axis_interval(axis);
+            const interval &b = ref.end.axis_interval(axis);
+            return 0.25 * (a.min + a.max + b.min + b.max);
+        }
+
+        static double surface_area(const aabb &box) {
+            double dx = std::fmax(0.0, box.x.size()), dy = std::fmax(0.0, box.y.size()), dz = std::fmax(0.0, box.z.size());
+            return 2 * (dx * dy + dy * dz + dz * dx);
+        }
+
+        static double mean_area(const aabb &start, const aabb &end) {
+            return 0.5 * (surface_area(start) + surface_area(end));
+        }
+};
+
+#endif
@@ -0,0 +1,631 @@
+#ifndef PAGED_SCENE_H
+#define PAGED_SCENE_H
+
+#include "bvh.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "quad.h"
+#include "sphere.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Paged geometry files. Layout (little-endian):
+//   char[4] "RTPG", uint32 version (2), uint32 page_count
+//   per page: double bounds[6] (x, y, z min/max), uint64 offset, uint32 record count, uint32 node count
+//   pages: a primitive_record array followed by the page's tree as a page_node array
+struct primitive_record {
+    enum kind : uint32_t { sphere_kind = 0, quad_kind = 1 };
+
+    uint32_t type;
+    int32_t material_id;               // Index into the material table handed to paged_scene
+    double data[9];                    // sphere: center, radius; quad: Q, u, v
+
+    aabb bounds() const {
+        if (type == sphere_kind) {
+            vec3 rvec(data[3], data[3], data[3]);
+            point3 center(data[0], data[1], data[2]);
+            return aabb(center - rvec, center + rvec);
+        }
+
+        point3 Q(data[0], data[1], data[2]);
+        vec3 u(data[3], data[4], data[5]);
+        vec3 v(data[6], data[7], data[8]);
+        return aabb(aabb(Q, Q + u + v), aabb(Q + u, Q + v));
+    }
+};
+
+// Node of a page's stored tree. An interior node has count 0, its left child right after it and its right
+// child at first; a leaf covers count records from first, counted within the page.
+struct page_node {
+    double bounds[6];                  // x, y, z min/max
+    uint32_t first;
+    uint32_t count;
+};
+
+// Collects primitive records and writes them as spatially coherent pages. Only the compact records are
+// held in memory while writing, never the hittable objects themselves.
+class paged_scene_writer {
+    public:
+        paged_scene_writer(const std::string &path, size_t page_primitives = 4096)
+         : path(path), page_primitives(std::max<size_t>(1, page_primitives)) {}
+
+        void add_sphere(const point3 &center, double radius, int material_id) {
+            primitive_record record{primitive_record::sphere_kind, material_id, {}};
+            for (int i = 0; i < 3; i++) record.data[i] = center[i];
+            record.data[3] = std::fmax(0, radius);
+            records.push_back(record);
+        }
+
+        void add_quad(const point3 &Q, const vec3 &u, const vec3 &v, int material_id) {
+            primitive_record record{primitive_record::quad_kind, material_id, {}};
+            for (int i = 0; i < 3; i++) {
+                record.data[i] = Q[i];
+                record.data[3 + i] = u[i];
+                record.data[6 + i] = v[i];
+            }
+            records.push_back(record);
+        }
+
+        bool finish() {
+            pages.clear();
+            if (!records.empty()) partition(0, records.size());
+            for (auto &page : pages) build_tree(page, page.start, page.end);
+
+            std::ofstream out(path, std::ios::binary);
+            if (!out) return false;
+
+            auto put = [&](auto value) { out.write(reinterpret_cast<const char *>(&value), sizeof(value)); };
+
+            out.write("RTPG", 4);
+            put(uint32_t(2));
+            put(uint32_t(pages.size()));
+
+            uint64_t offset = 4 + 2 * sizeof(uint32_t) + pages.size() * (6 * sizeof(double) + sizeof(uint64_t) + 2 * sizeof(uint32_t));
+            for (const auto &page : pages) {
+                for (int a = 0; a < 3; a++) {
+                    put(page.bounds.axis_interval(a).min);
+                    put(page.bounds.axis_interval(a).max);
+                }
+                put(offset);
+                put(uint32_t(page.end - page.start));
+                put(uint32_t(page.nodes.size()));
+                offset += (page.end - page.start) * sizeof(primitive_record) + page.nodes.size() * sizeof(page_node);
+            }
+
+            for (const auto &page : pages) {
+                out.write(reinterpret_cast<const char *>(records.data() + page.start),
+                          std::streamsize((page.end - page.start) * sizeof(primitive_record)));
+                out.write(reinterpret_cast<const char *>(page.nodes.data()),
+                          std::streamsize(page.nodes.size() * sizeof(page_node)));
+            }
+
+            return bool(out);
+        }
+
+    private:
+        struct page_range {
+            size_t start, end;
+            aabb bounds;
+            std::vector<page_node> nodes;
+        };
+
+        static constexpr size_t max_leaf_size = 4;
+
+        std::string path;
+        size_t page_primitives;
+        std::vector<primitive_record> records;
+        std::vector<page_range> pages;
+
+        // Median splits on the longest axis of the centroids, down to page-sized groups
+        void partition(size_t start, size_t end) {
+            aabb bounds = aabb::empty;
+            aabb centroids = aabb::empty;
+            for (size_t i = start; i < end; i++) {
+                aabb box = records[i].bounds();
+                bounds = aabb(bounds, box);
+                point3 c(box.x.min + box.x.size() / 2, box.y.min + box.y.size() / 2, box.z.min + box.z.size() / 2);
+                centroids = aabb(centroids, aabb(c, c));
+            }
+
+            if (end - start <= page_primitives) {
+                pages.push_back({start, end, bounds, {}});
+                return;
+            }
+
+            size_t mid = median_split(start, end, centroids.longest_axis());
+            partition(start, mid);
+            partition(mid, end);
+        }
+
+        // The same median splits within a page, down to small leaves, reordering the page's records so
+        // every leaf covers a contiguous run of them
+        uint32_t build_tree(page_range &page, size_t start, size_t end) {
+            uint32_t index = uint32_t(page.nodes.size());
+            page.nodes.emplace_back();
+
+            aabb bounds = aabb::empty;
+            aabb centroids = aabb::empty;
+            for (size_t i = start; i < end; i++) {
+                aabb box = records[i].bounds();
+                bounds = aabb(bounds, box);
+                point3 c(box.x.min + box.x.size() / 2, box.y.min + box.y.size() / 2, box.z.min + box.z.size() / 2);
+                centroids = aabb(centroids, aabb(c, c));
+            }
+            for (int a = 0; a < 3; a++) {
+                page.nodes[index].bounds[2 * a] = bounds.axis_interval(a).min;
+                page.nodes[index].bounds[2 * a + 1] = bounds.axis_interval(a).max;
+            }
+
+            if (end - start <= max_leaf_size) {
+                page.nodes[index].first = uint32_t(start - page.start);
+                page.nodes[index].count = uint32_t(end - start);
+                return index;
+            }
+
+            size_t mid = median_split(start, end, centroids.longest_axis());
+            build_tree(page, start, mid);
+            uint32_t right = build_tree(page, mid, end);
+            page.nodes[index].first = right;
+            page.nodes[index].count = 0;
+            return index;
+        }
+
+        size_t median_split(size_t start, size_t end, int axis) {
+            size_t mid = start + (end - start) / 2;
+            std::nth_element(records.begin() + start, records.begin() + mid, records.begin() + end,
+                [axis](const primitive_record &a, const primitive_record &b) {
+                    interval ia = a.bounds().axis_interval(axis);
+                    interval ib = b.bounds().axis_interval(axis);
+                    return ia.min + ia.max < ib.min + ib.max;
+                });
+            return mid;
+        }
+};
+
+// Scene whose pages of geometry are loaded on demand into a geometry cache with a memory budget. The
+// page bounds and the top-level tree over them stay resident. hit() faults pages in one ray at a time;
+// hit_batch() queues rays per missing page and loads each page once for its whole queue.
+class paged_scene : public hittable {
+    public:
+        paged_scene(const std::string &path, std::vector<shared_ptr<material>> materials,
+                    size_t memory_budget = size_t(1) << 30)
+         : in(path, std::ios::binary), materials(std::move(materials)), budget(memory_budget) {
+            char magic[4];
+            uint32_t version = 0;
+            uint32_t page_count = 0;
+            in.read(magic, 4);
+            read(version);
+            read(page_count);
+
+            if (!in || std::string(magic, 4) != "RTPG" || version != 2) {
+                std::cerr << "ERROR: Could not load paged scene '" << path << "'.\n";
+                bbox = aabb::empty;
+                return;
+            }
+
+            hittable_list proxies;
+            for (uint32_t i = 0; i < page_count; i++) {
+                page_info info;
+                double b[6];
+                for (double &value : b) read(value);
+                read(info.offset);
+                read(info.count);
+                read(info.node_count);
+                info.bounds = aabb(interval(b[0], b[1]), interval(b[2], b[3]), interval(b[4], b[5]));
+                pages.push_back(info);
+                proxies.add(make_shared<page_proxy>(this, i));
+            }
+
+            if (!in) {
+                std::cerr << "ERROR: Page table of '" << path << "' is truncated.\n";
+                pages.clear();
+                bbox = aabb::empty;
+                return;
+            }
+            loaded_before.assign(pages.size(), 0);
+
+            bbox = proxies.bounding_box();
+            if (!proxies.objects.empty()) top_level = make_shared<bvh_node>(proxies);
+        }
+
+        bool hit(const ray &r, interval ray_t, hit_record &rec) const override {
+            return top_level && top_level->hit(r, ray_t, rec);
+        }
+
+        bool occluded(const ray &r, interval ray_t) const override {
+            return top_level && top_level->occluded(r, ray_t);
+        }
+
+        void hit_batch(const std::vector<ray> &rays, interval ray_t,
+                       std::vector<hit_record> &recs, std::vector<char> &hits) const override {
+            size_t n = rays.size();
+            recs.resize(n);
+            hits.assign(n, 0);
+            if (!top_level) return;
+
+            std::vector<double> closest(n, ray_t.max);
+            std::vector<std::vector<uint32_t>> queued(n);
+
+            // Intersect with resident pages right away; remember the missing ones
+            #pragma omp parallel for schedule(dynamic, 64)
+            for (size_t i = 0; i < n; i++) {
+                std::vector<uint32_t> candidates;
+                collect_pages(rays[i], ray_t, candidates);
+
+                for (uint32_t id : candidates) {
+                    shared_ptr<page> p = resident(id);
+                    if (!p) {
+                        queued[i].push_back(id);
+                        continue;
+                    }
+                    if (p->root->hit(rays[i], interval(ray_t.min, closest[i]), recs[i])) {
+                        hits[i] = 1;
+                        closest[i] = recs[i].t;
+                        complete_page_hit(rays[i], recs[i]);
+                    }
+                }
+            }
+
+            std::unordered_map<uint32_t, std::vector<size_t>> queues;
+            for (size_t i = 0; i < n; i++) {
+                for (uint32_t id : queued[i]) queues[id].push_back(i);
+            }
+
+            // One load per page, then every ray waiting on it. Hits in pages handled earlier may have
+            // moved a ray's closest hit in front of a page it queued for, so those rays are dropped
+            // first, and pages no ray still needs are never loaded.
+            std::vector<size_t> live;
+            for (const auto &[id, ray_indices] : queues) {
+                live.clear();
+                for (size_t i : ray_indices) {
+                    if (pages[id].bounds.hit(rays[i], interval(ray_t.min, closest[i]))) live.push_back(i);
+                }
+                if (live.empty()) {
+                    std::lock_guard<std::mutex> lock(cache_mutex);
+                    culled++;
+                    continue;
+                }
+
+                shared_ptr<page> p = load(id);
+
+                #pragma omp parallel for schedule(dynamic, 64)
+                for (size_t k = 0; k < live.size(); k++) {
+                    size_t i = live[k];
+                    if (p->root->hit(rays[i], interval(ray_t.min, closest[i]), recs[i])) {
+                        hits[i] = 1;
+                        closest[i] = recs[i].t;
+                        complete_page_hit(rays[i], recs[i]);
+                    }
+                }
+            }
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        // Resident pages are bounded by the geometry budget, so that is what gets counted
+        void account_memory(memory_report &report) const override {
+            if (!report.first_visit(this)) return;
+            report.add(memory_report::geometry, shared_bytes<paged_scene>() + vector_bytes(pages) + budget);
+            if (top_level) top_level->account_memory(report);
+            for (const auto &mat : materials) mat->account_memory(report);
+        }
+
+        size_t page_count() const { return pages.size(); }
+
+        size_t page_loads() const {
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            return loads;
+        }
+
+        // Loads of pages that had been loaded and evicted before
+        size_t page_reloads() const {
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            return reloads;
+        }
+
+        double build_seconds() const {
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            return build_time;
+        }
+
+        size_t resident_bytes() const {
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            return bytes;
+        }
+
+        void report(std::ostream &out) const {
+            out << "Geometry cache: " << pages.size() << " pages, " << page_loads() << " page loads ("
+                << page_reloads() << " reloads), " << culled << " queued pages skipped, "
+                << resident_bytes() / 1024 << " KiB resident of " << budget / 1024 << " KiB, "
+                << build_seconds() << " s building pages\n";
+        }
+
+    private:
+        struct page_info {
+            aabb bounds;
+            uint64_t offset;
+            uint32_t count;
+            uint32_t node_count;
+        };
+
+        struct page {
+            shared_ptr<hittable> root;
+            size_t bytes;
+        };
+
+        // A page's primitives under its stored tree, walked without recursion
+        class page_tree : public hittable {
+            public:
+                struct node {
+                    aabb box;
+                    uint32_t first;
+                    uint32_t count;
+                };
+
+                static constexpr int max_depth = 64;
+
+                page_tree(std::vector<node> nodes, std::vector<shared_ptr<hittable>> objects)
+                 : nodes(std::move(nodes)), objects(std::move(objects)) {}
+
+                bool hit(const ray &r, interval ray_t, hit_record &rec) const override {
+                    if (nodes.empty()) return false;
+
+                    uint32_t stack[max_depth + 1];
+                    int top = 0;
+                    stack[top++] = 0;
+
+                    bool hit_anything = false;
+                    double closest = ray_t.max;
+
+                    while (top > 0) {
+                        uint32_t index = stack[--top];
+                        const node &n = nodes[index];
+                        render_stats.nodes_visited++;
+                        if (!n.box.hit(r, interval(ray_t.min, closest))) continue;
+
+                        if (n.count > 0) {
+                            for (uint32_t i = n.first; i < n.first + n.count; i++) {
+                                if (objects[i]->hit(r, interval(ray_t.min, closest), rec)) {
+                                    hit_anything = true;
+                                    closest = rec.t;
+                                }
+                            }
+                            continue;
+                        }
+
+                        stack[top++] = n.first;
+                        stack[top++] = index + 1;
+                    }
+
+                    return hit_anything;
+                }
+
+                bool occluded(const ray &r, interval ray_t) const override {
+                    if (nodes.empty()) return false;
+
+                    uint32_t stack[max_depth + 1];
+                    int top = 0;
+                    stack[top++] = 0;
+
+                    while (top > 0) {
+                        uint32_t index = stack[--top];
+                        const node &n = nodes[index];
+                        render_stats.nodes_visited++;
+                        if (!n.box.hit(r, ray_t)) continue;
+
+                        if (n.count > 0) {
+                            for (uint32_t i = n.first; i < n.first + n.count; i++) {
+                                if (objects[i]->occluded(r, ray_t)) return true;
+                            }
+                            continue;
+                        }
+
+                        stack[top++] = n.first;
+                        stack[top++] = index + 1;
+                    }
+
+                    return false;
+                }
+
+                aabb bounding_box() const override { return nodes.empty() ? aabb::empty : nodes[0].box; }
+
+                size_t bytes() const {
+                    size_t object_bytes = std::max(sizeof(sphere), sizeof(quad)) + 2 * sizeof(long);
+                    return sizeof(page_tree) + vector_bytes(nodes) + objects.size() * (sizeof(shared_ptr<hittable>) + object_bytes);
+                }
+
+            private:
+                std::vector<node> nodes;
+                std::vector<shared_ptr<hittable>> objects;
+        };
+
+        // Leaf of the resident top-level tree standing in for one page
+        class page_proxy : public hittable {
+            public:
+                page_proxy(const paged_scene *scene, uint32_t id) : scene(scene), id(id) {}
+
+                bool hit(const ray &r, interval ray_t, hit_record &rec) const override {
+                    if (collector) {
+                        collector->push_back(id);
+                        return false;
+                    }
+                    if (!scene->load(id)->root->hit(r, ray_t, rec)) return false;
+                    complete_page_hit(r, rec);
+                    return true;
+                }
+
+                bool occluded(const ray &r, interval ray_t) const override {
+                    return scene->load(id)->root->occluded(r, ray_t);
+                }
+
+                aabb bounding_box() const override { return scene->pages[id].bounds; }
+
+            private:
+                const paged_scene *scene;
+                uint32_t id;
+        };
+
+        // While set, page proxies report themselves instead of intersecting
+        static inline thread_local std::vector<uint32_t> *collector = nullptr;
+
+        mutable std::ifstream in;
+        mutable std::mutex file_mutex;
+        mutable std::mutex cache_mutex;
+        std::vector<page_info> pages;
+        std::vector<shared_ptr<material>> materials;
+        shared_ptr<hittable> top_level;
+        aabb bbox;
+
+        size_t budget;
+        mutable size_t bytes = 0;
+        mutable size_t loads = 0;
+        mutable size_t reloads = 0;
+        mutable size_t culled = 0;
+        mutable double build_time = 0;            // Spent building pages, including loads that lost a race
+        mutable std::vector<char> loaded_before;
+        mutable std::list<uint32_t> lru;          // Most recently used first
+        mutable std::unordered_map<uint32_t, std::pair<shared_ptr<page>, std::list<uint32_t>::iterator>> cache;
+
+        template <typename T>
+        void read(T &value) { in.read(reinterpret_cast<char *>(&value), sizeof(T)); }
+
+        // Page primitives can be evicted once the page is released, so their hits are completed eagerly
+        static void complete_page_hit(const ray &r, hit_record &rec) {
+            complete_hit(r, rec, true);
+            rec.prim = nullptr;
+        }
+
+        void collect_pages(const ray &r, interval ray_t, std::vector<uint32_t> &out) const {
+            hit_record unused;
+            collector = &out;
+            top_level->hit(r, ray_t, unused);
+            collector = nullptr;
+        }
+
+        // Leaves must stay within the page's records and children must follow their parent, which also
+        // bounds the traversal stack
+        static bool valid_tree(const std::vector<page_node> &nodes, size_t record_count) {
+            std::vector<int> depth(nodes.size(), 0);
+            for (size_t i = 0; i < nodes.size(); i++) {
+                const page_node &n = nodes[i];
+                if (depth[i] >= page_tree::max_depth) return false;
+                if (n.count > 0) {
+                    if (uint64_t(n.first) + n.count > record_count) return false;
+                    continue;
+                }
+                if (i + 1 >= nodes.size() || n.first <= i + 1 || n.first >= nodes.size()) return false;
+                depth[i + 1] = std::max(depth[i + 1], depth[i] + 1);
+                depth[n.first] = std::max(depth[n.first], depth[i] + 1);
+            }
+            return true;
+        }
+
+        shared_ptr<page> resident(uint32_t id) const {
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            auto it = cache.find(id);
+            if (it == cache.end()) return nullptr;
+            lru.splice(lru.begin(), lru, it->second.second);
+            return it->second.first;
+        }
+
+        // Pages that cannot be read are reported and load as empty pages. Page trees are
+        // rebuilt from the records on every load rather than stored in the file; report() shows what that costs.
+        shared_ptr<page> load(uint32_t id) const {
+            if (auto p = resident(id)) return p;
+
+            const page_info &info = pages[id];
+            std::vector<primitive_record> records(info.count);
+            std::vector<page_node> stored(info.node_count);
+            bool read_ok;
+            {
+                std::lock_guard<std::mutex> lock(file_mutex);
+                in.clear();
+                in.seekg(std::streamoff(info.offset));
+                in.read(reinterpret_cast<char *>(records.data()), std::streamsize(records.size() * sizeof(primitive_record)));
+                in.read(reinterpret_cast<char *>(stored.data()), std::streamsize(stored.size() * sizeof(page_node)));
+                read_ok = bool(in);
+            }
+            if (read_ok && !valid_tree(stored, records.size())) {
+                std::cerr << "ERROR: Page " << id << " of the paged scene has a corrupt tree.\n";
+                read_ok = false;
+            } else if (!read_ok) {
+                std::cerr << "ERROR: Could not read page " << id << " of the paged scene.\n";
+            }
+            if (!read_ok) {
+                records.clear();
+                stored.clear();
+            }
+
+            auto start = std::chrono::steady_clock::now();
+
+            // Bad records keep their slot, which the tree's leaves index, as an object nothing hits
+            static const shared_ptr<hittable> nothing = make_shared<hittable_list>();
+            std::vector<shared_ptr<hittable>> objects;
+            objects.reserve(records.size());
+            size_t bad_records = 0;
+            for (const auto &record : records) {
+                const double *d = record.data;
+                if (record.material_id < 0 || size_t(record.material_id) >= materials.size()
+                    || record.type > primitive_record::quad_kind) {
+                    bad_records++;
+                    objects.push_back(nothing);
+                    continue;
+                }
+                shared_ptr<material> mat = materials[record.material_id];
+                if (record.type == primitive_record::sphere_kind) {
+                    objects.push_back(make_shared<sphere>(point3(d[0], d[1], d[2]), d[3], mat));
+                } else {
+                    objects.push_back(make_shared<quad>(point3(d[0], d[1], d[2]), vec3(d[3], d[4], d[5]), vec3(d[6], d[7], d[8]), mat));
+                }
+            }
+            if (bad_records > 0) {
+                std::cerr << "ERROR: Skipped " << bad_records << " records of page " << id
+                          << " with an unknown type or material id.\n";
+            }
+
+            std::vector<page_tree::node> nodes(stored.size());
+            for (size_t i = 0; i < stored.size(); i++) {
+                const double *b = stored[i].bounds;
+                nodes[i] = {aabb(interval(b[0], b[1]), interval(b[2], b[3]), interval(b[4], b[5])), stored[i].first, stored[i].count};
+            }
+
+            auto p = make_shared<page>();
+            auto tree = make_shared<page_tree>(std::move(nodes), std::move(objects));
+            p->bytes = tree->bytes();
+            p->root = tree;
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            build_time += seconds;
+            auto it = cache.find(id);
+            if (it != cache.end()) return it->second.first;
+
+            lru.push_front(id);
+            cache[id] = {p, lru.begin()};
+            bytes += p->bytes;
+            loads++;
+            if (loaded_before[id]) reloads++;
+            loaded_before[id] = 1;
+
+            // Pages still referenced by a caller stay alive through their shared_ptr
+            while (bytes > budget && lru.size() > 1) {
+                uint32_t victim = lru.back();
+                bytes -= cache[victim].first->bytes;
+                cache.erase(victim);
+                lru.pop_back();
+            }
+
+            return p;
+        }
+};
+
+#endif
@@ -0,0 +1,324 @@
+#ifndef PATH_GUIDING_H
+#define PATH_GUIDING_H
+
+#include "aabb.h"
+#include "utils.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Incident light over the sphere of directions, as a quadtree over the square that maps to the sphere with
+// equal area (x is the cosine of the polar angle, y the azimuth). Each cell holds the light recorded in it,
+// so cells subdivide where light is concentrated. Records from the current pass are summed into separate
+// atomic counters, leaving the learned energies read-only for sampling.
+class directional_tree {
+    public:
+        // Every cell subdivided to depth levels, for recording before anything is known of the light
+        explicit directional_tree(int depth = 1) {
+            add_uniform(depth);
+            allocate_recorded();
+        }
+
+        directional_tree(const directional_tree &) = delete;
+        directional_tree &operator=(const directional_tree &) = delete;
+
+        bool trained() const { return total > 0; }
+        uint64_t samples() const { return sample_count; }
+        size_t node_count() const { return nodes.size(); }
+
+        // Adds value to the cell holding direction; safe to call from any number of threads
+        void record(const vec3 &direction, double value) {
+            sample_count.fetch_add(1, std::memory_order_relaxed);
+            if (value <= 0) return;
+
+            double x, y;
+            to_square(direction, x, y);
+
+            int index = 0, q;
+            while (true) {
+                q = quadrant(x, y);
+                if (!nodes[index].child[q]) break;
+                index = nodes[index].child[q];
+            }
+
+            std::atomic<double> &sum = recorded[4 * index + q];
+            double old = sum.load(std::memory_order_relaxed);
+            while (!sum.compare_exchange_weak(old, old + value, std::memory_order_relaxed)) {}
+        }
+
+        // Ends a pass: what was recorded becomes the learned energy. Not thread-safe.
+        void gather() {
+            for (size_t i = 0; i < nodes.size(); i++) {
+                for (int q = 0; q < 4; q++) nodes[i].energy[q] = recorded[4 * i + q].load();
+            }
+
+            // Children always come after their parent
+            for (size_t i = nodes.size(); i-- > 0;) {
+                for (int q = 0; q < 4; q++) {
+                    int c = nodes[i].child[q];
+                    if (c) nodes[i].energy[q] = nodes[c].energy[0] + nodes[c].energy[1] + nodes[c].energy[2] + nodes[c].energy[3];
+                }
+            }
+            total = nodes[0].energy[0] + nodes[0].energy[1] + nodes[0].energy[2] + nodes[0].energy[3];
+        }
+
+        // An empty tree for the next pass, with cells holding more than fraction of the energy subdivided
+        // and cells holding less merged back into their parent
+        std::unique_ptr<directional_tree> refined(double fraction = 0.01, int max_depth = 20) const {
+            auto result = std::make_unique<directional_tree>();
+            result->nodes.clear();
+            refine_node(*result, 0, nodes[0].energy, 1, fraction * total, max_depth);
+            result->allocate_recorded();
+            return result;
+        }
+
+        // Direction drawn in proportion to the learned energy; the tree must be trained
+        vec3 sample(double u1, double u2) const {
+            int index = 0;
+            double x0 = 0, y0 = 0, size = 1;
+            while (true) {
+                const quad_node &n = nodes[index];
+
+                // Pick a column, then a cell within it
+                double left = n.energy[0] + n.energy[2];
+                double p_left = left / (left + n.energy[1] + n.energy[3]);
+                int qx = u1 < p_left ? 0 : 1;
+                u1 = qx == 0 ? u1 / p_left : (u1 - p_left) / (1 - p_left);
+
+                double p_low = n.energy[qx] / (n.energy[qx] + n.energy[qx + 2]);
+                int qy = u2 < p_low ? 0 : 1;
+                u2 = qy == 0 ? u2 / p_low : (u2 - p_low) / (1 - p_low);
+
+                u1 = std::fmin(u1, 0.99999999999999989);
+                u2 = std::fmin(u2, 0.99999999999999989);
+                size /= 2;
+                x0 += qx * size;
+                y0 += qy * size;
+
+                int q = qx + 2 * qy;
+                if (!n.child[q]) break;
+                index = n.child[q];
+            }
+
+            return from_square(x0 + u1 * size, y0 + u2 * size);
+        }
+
+        // Solid-angle density of sample() returning direction
+        double pdf(const vec3 &direction) const {
+            if (!trained()) return 0;
+
+            double x, y;
+            to_square(direction, x, y);
+
+            int index = 0;
+            double density = 1;
+            while (true) {
+                const quad_node &n = nodes[index];
+                double sum = n.energy[0] + n.energy[1] + n.energy[2] + n.energy[3];
+                if (sum <= 0) return 0;
+
+                int q = quadrant(x, y);
+                density *= 4 * n.energy[q] / sum;
+                if (!n.child[q]) break;
+                index = n.child[q];
+            }
+
+            return density / (4 * pi);
+        }
+
+    private:
+        struct quad_node {
+            int child[4] = {0, 0, 0, 0};   // Node subdividing each quadrant; 0 for an undivided one
+            double energy[4] = {0, 0, 0, 0};
+        };
+
+        std::vector<quad_node> nodes;
+        std::unique_ptr<std::atomic<double>[]> recorded; // Four per node, summed this pass
+        std::atomic<uint64_t> sample_count{0};
+        double total = 0;
+
+        int add_uniform(int depth) {
+            int index = int(nodes.size());
+            nodes.emplace_back();
+            for (int q = 0; q < 4 && depth > 1; q++) {
+                int child = add_uniform(depth - 1);
+                nodes[index].child[q] = child;
+            }
+            return index;
+        }
+
+        void allocate_recorded() {
+            recorded.reset(new std::atomic<double>[4 * nodes.size()]);
+            for (size_t i = 0; i < 4 * nodes.size(); i++) recorded[i].store(0, std::memory_order_relaxed);
+        }
+
+        // Appends a node to result whose quadrants hold energy, following source (0 past the end of this
+        // tree's subdivision, where energy is spread evenly); returns its index
+        int refine_node(directional_tree &result, int source, const double energy[4], int depth, double threshold,
+                        int max_depth) const {
+            int index = int(result.nodes.size());
+            result.nodes.emplace_back();
+
+            for (int q = 0; q < 4; q++) {
+                if (energy[q] <= threshold || depth >= max_depth) continue;
+
+                int child_source = source >= 0 ? nodes[source].child[q] : 0;
+                double child_energy[4];
+                for (int k = 0; k < 4; k++) child_energy[k] = child_source ? nodes[child_source].energy[k] : energy[q] / 4;
+
+                int child = refine_node(result, child_source ? child_source : -1, child_energy, depth + 1, threshold,
+                                        max_depth);
+                result.nodes[index].child[q] = child;
+            }
+            return index;
+        }
+
+        // Quadrant of the point, which is rescaled to that quadrant
+        static int quadrant(double &x, double &y) {
+            int qx = x < 0.5 ? 0 : 1;
+            int qy = y < 0.5 ? 0 : 1;
+            x = std::fmin(2 * x - qx, 0.99999999999999989);
+            y = std::fmin(2 * y - qy, 0.99999999999999989);
+            return qx + 2 * qy;
+        }
+
+        static void to_square(const vec3 &direction, double &x, double &y) {
+            vec3 d = unit_vector(direction);
+            x = std::fmin(std::fmax(0.5 * (d.z() + 1), 0.0), 0.99999999999999989);
+            double phi = std::atan2(d.y(), d.x());
+            if (phi < 0) phi += 2 * pi;
+            y = std::fmin(phi / (2 * pi), 0.99999999999999989);
+        }
+
+        static vec3 from_square(double x, double y) {
+            double cos_theta = 2 * x - 1;
+            double sin_theta = std::sqrt(std::fmax(0.0, 1 - cos_theta * cos_theta));
+            double phi = 2 * pi * y;
+            return vec3(sin_theta * std::cos(phi), sin_theta * std::sin(phi), cos_theta);
+        }
+};
+
+// Learned incident light for path guiding (Müller et al. 2017): a binary tree over the scene's bounds
+// whose leaves each hold a directional_tree. Rendering goes in passes; each pass samples bounces from the
+// trees learned in the previous one while recording into fresh ones. Between passes, regions that recorded
+// many samples are halved and every directional tree is refined, so the field sharpens as the passes grow.
+class guiding_field {
+    public:
+        // A region is halved once a pass records more than split_samples times sqrt(2^pass) samples in it, and
+        // guides only once it has learned from at least min_samples
+        guiding_field(const aabb &bounds, double split_samples = 4000, uint64_t min_samples = 256)
+          : bounds(bounds), split_samples(split_samples), min_samples(min_samples) {
+            nodes.emplace_back();
+            nodes[0].building = std::make_unique<directional_tree>(initial_depth);
+        }
+
+        // Region holding p, which the calls below take so that a path vertex finds it once
+        int region(const point3 &p) const { return leaf_index(p); }
+
+        // Learned distribution for the region; null until it has recorded enough light
+        const directional_tree *distribution(int region) const {
+            const spatial_node &leaf = nodes[region];
+            bool learned = leaf.sampling && leaf.sampling->trained() && leaf.sampling->samples() >= min_samples;
+            return learned ? leaf.sampling.get() : nullptr;
+        }
+
+        // Records value, incident radiance over the density its direction was sampled with; zero still
+        // counts towards splitting the region. Thread-safe.
+        void record(int region, const vec3 &direction, double value) {
+            if (!frozen && value >= 0 && std::isfinite(value)) nodes[region].building->record(direction, value);
+        }
+
+        // Stops recording for a last pass, whose light would never be learned from
+        void freeze() { frozen = true; }
+
+        // Ends pass (counting from 0): the recorded light becomes the learned light. Not thread-safe.
+        void refine(int pass) {
+            refine_subtree(0, bounds, split_samples * std::sqrt(std::pow(2.0, pass)));
+        }
+
+        size_t leaf_count() const {
+            size_t count = 0;
+            for (const auto &n : nodes) count += n.child[0] ? 0 : 1;
+            return count;
+        }
+
+    private:
+        struct spatial_node {
+            int child[2] = {0, 0};         // Lower and upper halves; 0 for a leaf
+            int axis = 0;
+            double split = 0;
+            shared_ptr<const directional_tree> sampling;   // Leaves only; shared by the halves of a split
+            std::unique_ptr<directional_tree> building;    // Leaves only
+        };
+
+        static constexpr int initial_depth = 3;   // 64 cells for regions with nothing learned yet
+
+        aabb bounds;
+        double split_samples;
+        uint64_t min_samples;
+        bool frozen = false;
+        std::vector<spatial_node> nodes;
+
+        int leaf_index(const point3 &p) const {
+            int index = 0;
+            while (nodes[index].child[0]) {
+                const spatial_node &n = nodes[index];
+                index = p[n.axis] < n.split ? n.child[0] : n.child[1];
+            }
+            return index;
+        }
+
+        void refine_subtree(int index, const aabb &box, double threshold) {
+            if (nodes[index].child[0]) {
+                int axis = nodes[index].axis;
+                double split = nodes[index].split;
+                refine_subtree(nodes[index].child[0], half(box, axis, split, false), threshold);
+                refine_subtree(nodes[index].child[1], half(box, axis, split, true), threshold);
+                return;
+            }
+
+            nodes[index].building->gather();
+            uint64_t samples = nodes[index].building->samples();
+            // Light learned over a region cut into more than four says little about each part, so they
+            // record afresh for a pass rather than guide with it
+            shared_ptr<const directional_tree> learned(std::move(nodes[index].building));
+            subdivide(index, box, samples <= 4 * threshold ? learned : nullptr, double(samples), threshold);
+        }
+
+        // Halves the leaf until each part would have seen at most threshold samples; every part starts
+        // from learned, or from a uniformly subdivided tree without it
+        void subdivide(int index, const aabb &box, const shared_ptr<const directional_tree> &learned, double samples,
+                       double threshold) {
+            if (samples <= threshold) {
+                nodes[index].sampling = learned;
+                nodes[index].building = learned ? learned->refined() : std::make_unique<directional_tree>(initial_depth);
+                return;
+            }
+
+            int axis = box.longest_axis();
+            const interval &extent = box.axis_interval(axis);
+            double split = 0.5 * (extent.min + extent.max);
+
+            int lower = int(nodes.size());
+            nodes.emplace_back();
+            nodes.emplace_back();
+            nodes[index].child[0] = lower;
+            nodes[index].child[1] = lower + 1;
+            nodes[index].axis = axis;
+            nodes[index].split = split;
+            nodes[index].sampling.reset();
+
+            subdivide(lower, half(box, axis, split, false), learned, samples / 2, threshold);
+            subdivide(lower + 1, half(box, axis, split, true), learned, samples / 2, threshold);
+        }
+
+        static aabb half(const aabb &box, int axis, double split, bool upper) {
+            interval extent[3] = {box.x, box.y, box.z};
+            extent[axis] = upper ? interval(split, extent[axis].max) : interval(extent[axis].min, split);
+            return aabb(extent[0], extent[1], extent[2]);
+        }
+};
+
+#endif
@@ -3,6 +3,7 @@
 
 #include "hittable.h"
 #include "hittable_list.h"
+#include "material.h"
 
 class quad : public hittable {
     public: quad(const point3 &Q, const vec3 &u, const vec3 &v, shared_ptr<material> mat)
@@ -11,6 +12,7 @@ class quad : public hittable {
         normal = unit_vector(n);
         D = dot(normal, Q);
         w = n / dot(n, n);
+        area = n.length();
 
         set_bounding_box();
     }
@@ -22,25 +24,63 @@ class quad : public hittable {
     }
 
     bool hit(const ray &r, interval ray_t, hit_record &rec) const override {
-        double denom = dot(normal, r.direction());
+        double t;
+        if (!intersect(r, ray_t, t, rec)) return false;
 
-        if (std::fabs(denom) < 1e-8) return false;
-
-        double t = (D - dot(normal, r.origin())) / denom;
-        if (!ray_t.contains(t)) return false;
+        rec.t = t;
+        rec.prim = this;
 
-        point3 intersection = r.at(t);
-        vec3 planar_hitpt_vector = intersection - Q;
-        double alpha = dot(w, cross(planar_hitpt_vector, v));
-        double beta = dot(w, cross(u, planar_hitpt_vector));
+        return true;
+    }
 
-        if (!is_interior(alpha, beta, rec)) return false;
+    bool occluded(const ray &r, interval ray_t) const override {
+        double t;
+        hit_record scratch;
+        return intersect(r, ray_t, t, scratch);
+    }
 
-        rec.t = t;
-        rec.p = intersection;
+    // u and v were already stored as the planar coordinates during the hit
+    void complete(const ray &r, hit_record &rec, bool need_uv) const override {
+        rec.p = r.at(rec.t);
         rec.mat = mat;
         rec.set_face_normal(r, normal);
-        
+    }
+
+    double pdf_value(const point3 &origin, const vec3 &direction) const override {
+        double t;
+        hit_record scratch;
+        if (!intersect(ray(origin, direction), interval(0.001, infinity), t, scratch)) return 0;
+
+        double distance_squared = t * t * direction.length_squared();
+        double cosine = std::fabs(dot(direction, normal) / direction.length());
+        return distance_squared / (cosine * area);
+    }
+
+    vec3 random(const point3 &origin) const override {
+        double a, b;
+        sample_2d(a, b);
+        point3 p = Q + (a * u) + (b * v);
+        return p - origin;
+    }
+
+    bool sample_surface(double u1, double u2, point3 &p, vec3 &n) const override {
+        p = Q + (u1 * u) + (u2 * v);
+        n = normal;
+        return true;
+    }
+
+    double surface_area() const override { return area; }
+
+    // Emits from both faces, so the normal cone covers the whole sphere of directions
+    bool emission_bound(light_bound &bound) const override {
+        double power = luminance(mat->emitted(0.5, 0.5, Q + 0.5 * (u + v))) * 2 * area * pi;
+        if (power <= 0) return false;
+
+        bound.bounds = bbox;
+        bound.power = power;
+        bound.axis = normal;
+        bound.cos_theta_o = -1;
+        bound.cos_theta_e = 0;
         return true;
     }
 
@@ -54,7 +94,60 @@ class quad : public hittable {
 
     aabb bounding_box() const override { return bbox; }
 
+    // Clips the parallelogram against each face of box in turn
+    aabb clipped_bounds(const aabb &box) const override {
+        std::vector<point3> polygon = {Q, Q + u, Q + u + v, Q + v};
+        std::vector<point3> clipped;
+
+        for (int axis = 0; axis < 3 && !polygon.empty(); axis++) {
+            for (int side = 0; side < 2 && !polygon.empty(); side++) {
+                double plane = side == 0 ? box.axis_interval(axis).min : box.axis_interval(axis).max;
+                double sign = side == 0 ? 1 : -1;
+
+                clipped.clear();
+                for (size_t i = 0; i < polygon.size(); i++) {
+                    const point3 &a = polygon[i];
+                    const point3 &b = polygon[(i + 1) % polygon.size()];
+                    double da = sign * (a[axis] - plane), db = sign * (b[axis] - plane);
+                    if (da >= 0) clipped.push_back(a);
+                    if ((da < 0) != (db < 0)) clipped.push_back(a + (da / (da - db)) * (b - a));
+                }
+                std::swap(polygon, clipped);
+            }
+        }
+
+        if (polygon.empty()) return hittable::clipped_bounds(box);
+
+        aabb result = aabb::empty;
+        for (const point3 &p : polygon) result = aabb(result, aabb(p, p));
+        return result;
+    }
+
+    void account_memory(memory_report &report) const override {
+        if (!report.first_visit(this)) return;
+        report.add(memory_report::geometry, shared_bytes<quad>());
+        mat->account_memory(report);
+    }
+
     private:
+        // Plane hit at t inside the shape; is_interior() leaves the planar coordinates in rec.u and rec.v
+        bool intersect(const ray &r, interval ray_t, double &t, hit_record &rec) const {
+            render_stats.primitive_tests++;
+            double denom = dot(normal, r.direction());
+
+            if (std::fabs(denom) < 1e-8) return false;
+
+            t = (D - dot(normal, r.origin())) / denom;
+            if (!ray_t.contains(t)) return false;
+
+            point3 intersection = r.at(t);
+            vec3 planar_hitpt_vector = intersection - Q;
+            double alpha = dot(w, cross(planar_hitpt_vector, v));
+            double beta = dot(w, cross(u, planar_hitpt_vector));
+
+            return is_interior(alpha, beta, rec);
+        }
+
         point3 Q;
         vec3 u, v;
         vec3 w;
@@ -62,6 +155,7 @@ class quad : public hittable {
         aabb bbox;
         vec3 normal;
         double D;
+        double area;
 };
 
 inline shared_ptr<hittable_list> box(const point3 &a, const point3 &b, shared_ptr<material> mat) {
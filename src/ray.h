@@ -6,16 +6,18 @@
 class ray {
     public:
         ray() {}
-        ray(const point3 &origin, const vec3 &direction) : orig(origin), dir(direction) {}
+        ray(const point3 &origin, const vec3 &direction, double time = 0) : orig(origin), dir(direction), tm(time) {}
 
         const point3 &origin() const { return orig; }
         const vec3 &direction() const { return dir; }
+        double time() const { return tm; }             // Within the shutter, which opens at 0 and closes by 1
 
         point3 at(double t) const { return orig + t * dir; }
 
     private:
         point3 orig;
         vec3 dir;
+        double tm = 0;
 };
 
 #endif
@@ -0,0 +1,117 @@
+#ifndef RENDER_COST_H
+#define RENDER_COST_H
+
+#include "utils.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Per-pixel cost of a render, one buffer per metric. Each metric is written as a false-colour PPM for
+// looking at and a PFM holding the raw values for tools.
+class render_cost {
+    public:
+        enum metric { time_us, nodes_visited, primitive_tests, path_depth, density_lookups, metric_count };
+
+        render_cost(int width, int height) : width(width), height(height) {
+            for (auto &buffer : values) buffer.assign(size_t(width) * height, 0.0f);
+        }
+
+        void set(metric m, int col, int row, double value) { values[m][size_t(row) * width + col] = float(value); }
+
+        double get(metric m, int col, int row) const { return values[m][size_t(row) * width + col]; }
+
+        // Writes <prefix>_<metric>.ppm and <prefix>_<metric>.pfm for every metric
+        bool write(const std::string &prefix) const {
+            bool ok = true;
+            for (int m = 0; m < metric_count; m++) {
+                std::string path = prefix + "_" + names[m];
+                ok = write_heatmap(path + ".ppm", values[m]) && ok;
+                ok = write_pfm(path + ".pfm", values[m]) && ok;
+            }
+            return ok;
+        }
+
+        // Most expensive tiles by total time, with their share of every metric
+        void report_tiles(std::ostream &out, int tile_size, int count) const {
+            struct tile_cost {
+                int x0, y0;
+                double totals[metric_count];
+            };
+
+            double image_totals[metric_count] = {};
+            std::vector<tile_cost> tiles;
+            for (int y0 = 0; y0 < height; y0 += tile_size) {
+                for (int x0 = 0; x0 < width; x0 += tile_size) {
+                    tile_cost t{x0, y0, {}};
+                    for (int row = y0; row < std::min(y0 + tile_size, height); row++) {
+                        for (int col = x0; col < std::min(x0 + tile_size, width); col++) {
+                            for (int m = 0; m < metric_count; m++) t.totals[m] += get(metric(m), col, row);
+                        }
+                    }
+                    for (int m = 0; m < metric_count; m++) image_totals[m] += t.totals[m];
+                    tiles.push_back(t);
+                }
+            }
+
+            count = std::min(count, int(tiles.size()));
+            std::partial_sort(tiles.begin(), tiles.begin() + count, tiles.end(), [](const tile_cost &a, const tile_cost &b) {
+                return a.totals[time_us] > b.totals[time_us];
+            });
+
+            out << "Most expensive " << tile_size << "x" << tile_size << " tiles (share of image total):\n";
+            for (int i = 0; i < count; i++) {
+                const tile_cost &t = tiles[i];
+                out << "  (" << t.x0 << ", " << t.y0 << ")";
+                for (int m = 0; m < metric_count; m++) {
+                    if (m == path_depth) continue;
+                    double share = image_totals[m] > 0 ? 100.0 * t.totals[m] / image_totals[m] : 0.0;
+                    out << "  " << names[m] << " " << share << "%";
+                }
+                int pixels = (std::min(t.x0 + tile_size, width) - t.x0) * (std::min(t.y0 + tile_size, height) - t.y0);
+                out << "  mean path_depth " << t.totals[path_depth] / pixels << "\n";
+            }
+        }
+
+    private:
+        static constexpr const char *names[metric_count] = {"time_us", "nodes", "prims", "depth", "density"};
+
+        int width;
+        int height;
+        std::vector<float> values[metric_count];
+
+        // Black-red-yellow-white ramp, scaled to the 99th percentile so a few outliers don't flatten it
+        bool write_heatmap(const std::string &path, const std::vector<float> &buffer) const {
+            std::vector<float> sorted(buffer);
+            size_t index = std::min(sorted.size() - 1, sorted.size() * 99 / 100);
+            std::nth_element(sorted.begin(), sorted.begin() + index, sorted.end());
+            double scale = sorted[index] > 0 ? 1.0 / sorted[index] : 0.0;
+
+            std::ofstream out(path, std::ios::binary);
+            out << "P6\n" << width << ' ' << height << "\n255\n";
+            for (float value : buffer) {
+                double x = std::clamp(value * scale, 0.0, 1.0) * 3;
+                unsigned char rgb[3] = {
+                    (unsigned char)(255 * std::clamp(x, 0.0, 1.0)),
+                    (unsigned char)(255 * std::clamp(x - 1, 0.0, 1.0)),
+                    (unsigned char)(255 * std::clamp(x - 2, 0.0, 1.0)),
+                };
+                out.write(reinterpret_cast<const char *>(rgb), 3);
+            }
+            return bool(out);
+        }
+
+        // Greyscale PFM; a negative scale marks little-endian data, stored bottom row first
+        bool write_pfm(const std::string &path, const std::vector<float> &buffer) const {
+            std::ofstream out(path, std::ios::binary);
+            out << "Pf\n" << width << ' ' << height << "\n-1.0\n";
+            for (int row = height - 1; row >= 0; row--) {
+                out.write(reinterpret_cast<const char *>(&buffer[size_t(row) * width]), std::streamsize(width * sizeof(float)));
+            }
+            return bool(out);
+        }
+};
+
+#endif
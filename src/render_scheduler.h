@@ -0,0 +1,203 @@
+#ifndef RENDER_SCHEDULER_H
+#define RENDER_SCHEDULER_H
+
+#include "camera.h"
+#include "hittable.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Runs any number of render jobs, each a scene and a camera, on one pool of threads. Work is handed out
+// a tile at a time, to the highest-priority job first and in submission order within a priority. After
+// every row a worker checks whether a higher-priority job is waiting and, if so, puts the rest of its
+// tile back, so a preview waits at most one row of a final render per worker.
+class render_scheduler {
+    public:
+        // Handle to a submitted job. finished becomes true once the image is complete, or false once a
+        // cancelled job's last in-flight row has stopped; image() is valid after either.
+        class job {
+            public:
+                std::shared_future<bool> finished;
+
+                void cancel() { cancel_requested = true; }
+
+                double progress() const { return double(rows_done) / rows_total; }
+
+                int width() const { return image_width; }
+                int height() const { return image_height; }
+
+                // Linear colours, row-major; rows a cancelled job never reached stay black
+                const std::vector<colour> &image() const { return pixels; }
+
+            private:
+                friend class render_scheduler;
+
+                struct tile {
+                    int x0, y0;
+                    int row;               // First row not yet rendered
+                };
+
+                camera cam;
+                shared_ptr<hittable> scene;
+                int priority = 0;
+                uint64_t sequence = 0;
+                int image_width = 0;
+                int image_height = 0;
+                std::vector<colour> pixels;
+
+                std::deque<tile> pending;  // Guarded by the scheduler's mutex
+                int in_flight = 0;         // Guarded by the scheduler's mutex
+                std::promise<bool> done;
+
+                std::atomic<bool> cancel_requested{false};
+                std::atomic<int> rows_done{0};
+                int rows_total = 1;
+        };
+
+        render_scheduler(int thread_count = int(std::thread::hardware_concurrency())) {
+            for (int i = 0; i < std::max(thread_count, 1); i++) workers.emplace_back([this] { work(); });
+        }
+
+        // Cancels whatever is still queued or running and waits for the workers to stop
+        ~render_scheduler() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+                for (auto &j : active) j->cancel();
+            }
+            wake.notify_all();
+            for (auto &worker : workers) worker.join();
+        }
+
+        // Higher priorities run first; the camera is copied, so it can be changed and submitted again
+        shared_ptr<job> submit(const camera &cam, shared_ptr<hittable> scene, int priority = 0) {
+            auto j = make_shared<job>();
+            j->cam = cam;
+            j->cam.initialize();
+            j->scene = scene;
+            j->priority = priority;
+            j->image_width = j->cam.image_width;
+            j->image_height = j->cam.image_height;
+            j->pixels.assign(size_t(j->image_width) * j->image_height, colour(0, 0, 0));
+            int edge = std::max(cam.tile_size, 1);
+            j->rows_total = std::max(1, j->image_height * ((j->image_width + edge - 1) / edge));
+            j->finished = j->done.get_future().share();
+
+            for (int y0 = 0; y0 < j->image_height; y0 += edge) {
+                for (int x0 = 0; x0 < j->image_width; x0 += edge) j->pending.push_back({x0, y0, y0});
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                j->sequence = next_sequence++;
+                auto position = std::find_if(active.begin(), active.end(), [&](const shared_ptr<job> &other) {
+                    return other->priority < priority;
+                });
+                active.insert(position, j);
+                update_waiting_priority();
+            }
+            wake.notify_all();
+            return j;
+        }
+
+        int thread_count() const { return int(workers.size()); }
+
+    private:
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::vector<std::thread> workers;
+        std::vector<shared_ptr<job>> active;             // By priority, then submission order
+        std::atomic<int> waiting_priority{INT32_MIN};    // Highest priority with tiles queued
+        uint64_t next_sequence = 0;
+        bool stopping = false;
+
+        // Caller holds the mutex
+        void update_waiting_priority() {
+            int best = INT32_MIN;
+            for (const auto &j : active) {
+                if (!j->pending.empty()) best = std::max(best, j->priority);
+            }
+            waiting_priority = best;
+        }
+
+        // Caller holds the mutex. Drops a cancelled job's queued tiles, and retires the job once nothing
+        // of it is running.
+        void retire_if_done(const shared_ptr<job> &j) {
+            if (j->cancel_requested) j->pending.clear();
+            if (!j->pending.empty() || j->in_flight > 0) return;
+
+            active.erase(std::find(active.begin(), active.end(), j));
+            j->done.set_value(!j->cancel_requested);
+        }
+
+        void work() {
+            std::unique_lock<std::mutex> lock(mutex);
+
+            while (true) {
+                for (size_t i = 0; i < active.size();) {
+                    auto j = active[i];
+                    retire_if_done(j);
+                    if (i < active.size() && active[i] == j) i++;
+                }
+                update_waiting_priority();
+
+                auto next = std::find_if(active.begin(), active.end(), [](const shared_ptr<job> &j) {
+                    return !j->pending.empty();
+                });
+                if (next == active.end()) {
+                    if (stopping) return;
+                    wake.wait(lock);
+                    continue;
+                }
+
+                shared_ptr<job> j = *next;
+                job::tile t = j->pending.front();
+                j->pending.pop_front();
+                j->in_flight++;
+                update_waiting_priority();
+
+                lock.unlock();
+                int stopped_at = render_tile(*j, t);
+                lock.lock();
+
+                j->in_flight--;
+                if (stopped_at < std::min(t.y0 + j->cam.tile_size, j->image_height) && !j->cancel_requested) {
+                    j->pending.push_front({t.x0, t.y0, stopped_at});
+                    wake.notify_one();
+                }
+                retire_if_done(j);
+            }
+        }
+
+        // Renders rows of t from t.row on; returns the first row not rendered, early if the job was
+        // cancelled or a higher-priority job is waiting
+        int render_tile(job &j, const job::tile &t) {
+            const camera &cam = j.cam;
+            shared_ptr<sampler> tile_sampler = cam.pixel_sampler->clone();
+            active_sampler = tile_sampler.get();
+
+            int x1 = std::min(t.x0 + cam.tile_size, j.image_width);
+            int y1 = std::min(t.y0 + cam.tile_size, j.image_height);
+            int row = t.row;
+            for (; row < y1; row++) {
+                if (j.cancel_requested || waiting_priority > j.priority) break;
+
+                for (int col = t.x0; col < x1; col++) {
+                    j.pixels[size_t(row) * j.image_width + col] = cam.render_pixel(col, row, *j.scene);
+                }
+                j.rows_done++;
+            }
+
+            active_sampler = nullptr;
+            return row;
+        }
+};
+
+#endif
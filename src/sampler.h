@@ -0,0 +1,185 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "utils.h"
+
+#include <cstdint>
+
+// Source of the random numbers used for one camera sample. Each call to get_1d()/get_2d() consumes the
+// next dimension, so pixel offset, lens position and every bounce decision get their own dimension.
+class sampler {
+    public:
+        virtual ~sampler() = default;
+
+        virtual void start_sample(int i, int j, int sample_index) = 0;
+
+        virtual double get_1d() = 0;
+
+        virtual void get_2d(double &u1, double &u2) = 0;
+
+        // Samplers carry per-sample state, so every thread works on its own copy
+        virtual shared_ptr<sampler> clone() const = 0;
+};
+
+class independent_sampler : public sampler {
+    public:
+        void start_sample(int i, int j, int sample_index) override {}
+
+        double get_1d() override { return random_double(); }
+
+        void get_2d(double &u1, double &u2) override {
+            u1 = random_double();
+            u2 = random_double();
+        }
+
+        shared_ptr<sampler> clone() const override { return make_shared<independent_sampler>(); }
+};
+
+// Owen-scrambled, index-shuffled Sobol points (Burley 2020), padded two dimensions at a time. With
+// blue_noise set, every pixel shares one scramble and is offset by a per-pixel low-discrepancy dither
+// mask, which pushes the remaining error towards high frequencies; otherwise every pixel is scrambled
+// independently.
+class sobol_sampler : public sampler {
+    public:
+        sobol_sampler(bool blue_noise = true, uint32_t seed = 0) : blue_noise(blue_noise), seed(seed) {}
+
+        void start_sample(int i, int j, int sample_index) override {
+            index = uint32_t(sample_index);
+            dimension = 0;
+
+            if (blue_noise) {
+                pixel_seed = seed;
+                mask_x = fract(0.7548776662466927 * i + 0.5698402909980532 * j);
+                mask_y = fract(52.9829189 * fract(0.06711056 * i + 0.00583715 * j));
+            } else {
+                pixel_seed = hash(seed ^ hash(uint32_t(i) ^ hash(uint32_t(j))));
+                mask_x = mask_y = 0;
+            }
+        }
+
+        double get_1d() override {
+            double u1, u2;
+            get_2d(u1, u2);
+            return u1;
+        }
+
+        void get_2d(double &u1, double &u2) override {
+            uint32_t dim_seed = hash(pixel_seed ^ hash(dimension));
+            uint32_t shuffled = nested_uniform_scramble(index, dim_seed);
+
+            u1 = to_unit(nested_uniform_scramble(sobol_dim0(shuffled), hash(dim_seed ^ 0x9e3779b9u)));
+            u2 = to_unit(nested_uniform_scramble(sobol_dim1(shuffled), hash(dim_seed ^ 0x85ebca6bu)));
+
+            if (blue_noise) {
+                // Toroidal shift, decorrelated between dimensions by an irrational step
+                u1 = fract(u1 + mask_x + dimension * 0.6180339887498949);
+                u2 = fract(u2 + mask_y + dimension * 0.4142135623730950);
+            }
+
+            dimension++;
+        }
+
+        shared_ptr<sampler> clone() const override { return make_shared<sobol_sampler>(blue_noise, seed); }
+
+    private:
+        bool blue_noise;
+        uint32_t seed;
+        uint32_t pixel_seed = 0;
+        uint32_t index = 0;
+        uint32_t dimension = 0;
+        double mask_x = 0;
+        double mask_y = 0;
+
+        static double fract(double x) { return x - std::floor(x); }
+
+        static double to_unit(uint32_t x) {
+            return std::fmin(x * (1.0 / 4294967296.0), 0.99999999999999989);
+        }
+
+        static uint32_t hash(uint32_t x) {
+            x ^= x >> 16;
+            x *= 0x7feb352du;
+            x ^= x >> 15;
+            x *= 0x846ca68bu;
+            x ^= x >> 16;
+            return x;
+        }
+
+        static uint32_t reverse_bits(uint32_t x) {
+            x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+            x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+            x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+            x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+            return (x >> 16) | (x << 16);
+        }
+
+        static uint32_t sobol_dim0(uint32_t i) { return reverse_bits(i); }
+
+        static uint32_t sobol_dim1(uint32_t i) {
+            uint32_t result = 0;
+            for (uint32_t v = 1u << 31; i; i >>= 1, v ^= v >> 1) {
+                if (i & 1) result ^= v;
+            }
+            return result;
+        }
+
+        static uint32_t laine_karras_permutation(uint32_t x, uint32_t seed) {
+            x += seed;
+            x ^= x * 0x6c50b47cu;
+            x ^= x * 0xb82f1e52u;
+            x ^= x * 0xc7afe638u;
+            x ^= x * 0x8d22f6e6u;
+            return x;
+        }
+
+        static uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+            return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+        }
+};
+
+// Sampler driving the current thread's camera sample; independent randoms when none is set.
+inline thread_local sampler *active_sampler = nullptr;
+
+inline double sample_1d() {
+    return active_sampler ? active_sampler->get_1d() : random_double();
+}
+
+inline void sample_2d(double &u1, double &u2) {
+    if (active_sampler) {
+        active_sampler->get_2d(u1, u2);
+    } else {
+        u1 = random_double();
+        u2 = random_double();
+    }
+}
+
+// Direct (non-rejection) warps, so that stratification in [0, 1)^2 carries over
+inline vec3 sample_unit_vector() {
+    double u1, u2;
+    sample_2d(u1, u2);
+    double z = 1 - 2 * u1;
+    double r = std::sqrt(std::fmax(0.0, 1 - z * z));
+    double phi = 2 * pi * u2;
+    return vec3(r * std::cos(phi), r * std::sin(phi), z);
+}
+
+inline vec3 sample_in_unit_disk() {
+    double u1, u2;
+    sample_2d(u1, u2);
+    double a = 2 * u1 - 1;
+    double b = 2 * u2 - 1;
+    if (a == 0 && b == 0) return vec3(0, 0, 0);
+
+    // Shirley-Chiu concentric mapping
+    double r, theta;
+    if (std::fabs(a) > std::fabs(b)) {
+        r = a;
+        theta = (pi / 4) * (b / a);
+    } else {
+        r = b;
+        theta = (pi / 2) - (pi / 4) * (a / b);
+    }
+    return vec3(r * std::cos(theta), r * std::sin(theta), 0);
+}
+
+#endif
@@ -0,0 +1,458 @@
+#ifndef SBVH_H
+#define SBVH_H
+
+#include "aabb.h"
+#include "hittable.h"
+#include "hittable_list.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Spatial-split BVH (Stich, Friedrich and Dietrich 2009). Each node takes the cheapest split under the
+// surface area heuristic, either a binned object split or, where the best object split leaves children
+// that overlap, a plane that cuts straddling objects into one reference per side with clipped bounds. A
+// room-sized quad then sits in many small boxes instead of making every box room-sized. max_growth caps
+// the extra references as a fraction of the object count; 0 gives a plain SAH tree. Each split is judged
+// as if its children were leaves, which can favour spatial splits that make the whole tree dearer, so
+// the plain tree is built as well and kept unless the spatial tree's SAH cost is clearly lower. The SAH
+// assumes rays from outside each box; rays starting inside a room cross the slabs spatial splits cut it
+// into, so a few percent predicted is not a real gain.
+class sbvh : public hittable {
+    public:
+        sbvh(hittable_list list, double max_growth = 0.5) : owned(list.objects) {
+            bbox = aabb::empty;
+            for (const auto &object : owned) bbox = aabb(bbox, object->bounding_box());
+
+            if (owned.empty()) return;
+
+            std::vector<reference> references;
+            for (const auto &object : owned) references.push_back({object.get(), object->bounding_box()});
+            root_area = surface_area(bbox);
+
+            std::vector<reference> plain_references = references;
+            reference_budget = size_t(owned.size() * (1 + std::max(0.0, max_growth)));
+            references_made = owned.size();
+            build(references, 0);
+            if (references_made == owned.size()) return;
+
+            std::vector<node> spatial_nodes;
+            std::vector<const hittable *> spatial_primitives;
+            nodes.swap(spatial_nodes);
+            primitives.swap(spatial_primitives);
+            reference_budget = references_made = owned.size();
+            build(plain_references, 0);
+
+            if (tree_cost(spatial_nodes) < (1 - min_saving) * tree_cost(nodes)) {
+                nodes.swap(spatial_nodes);
+                primitives.swap(spatial_primitives);
+            }
+        }
+
+        bool hit(const ray &r, interval ray_t, hit_record &rec) const override {
+            if (nodes.empty()) return false;
+
+            uint32_t stack[2 * max_depth + 2];
+            int top = 0;
+            stack[top++] = 0;
+
+            bool hit_anything = false;
+            double closest = ray_t.max;
+
+            while (top > 0) {
+                uint32_t index = stack[--top];
+                const node &n = nodes[index];
+                render_stats.nodes_visited++;
+                if (!n.box.hit(r, interval(ray_t.min, closest))) continue;
+
+                if (n.count > 0) {
+                    for (uint32_t i = n.first; i < n.first + n.count; i++) {
+                        if (primitives[i]->hit(r, interval(ray_t.min, closest), rec)) {
+                            hit_anything = true;
+                            closest = rec.t;
+                        }
+                    }
+                    continue;
+                }
+
+                // Left children lie below the split, so a ray heading down the axis visits the right first
+                if (r.direction()[n.axis] < 0) {
+                    stack[top++] = index + 1;
+                    stack[top++] = n.first;
+                } else {
+                    stack[top++] = n.first;
+                    stack[top++] = index + 1;
+                }
+            }
+
+            return hit_anything;
+        }
+
+        bool occluded(const ray &r, interval ray_t) const override {
+            if (nodes.empty()) return false;
+
+            uint32_t stack[2 * max_depth + 2];
+            int top = 0;
+            stack[top++] = 0;
+
+            while (top > 0) {
+                uint32_t index = stack[--top];
+                const node &n = nodes[index];
+                render_stats.nodes_visited++;
+                if (!n.box.hit(r, ray_t)) continue;
+
+                if (n.count > 0) {
+                    for (uint32_t i = n.first; i < n.first + n.count; i++) {
+                        if (primitives[i]->occluded(r, ray_t)) return true;
+                    }
+                    continue;
+                }
+
+                stack[top++] = n.first;
+                stack[top++] = index + 1;
+            }
+
+            return false;
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        size_t node_count() const { return nodes.size(); }
+
+        // Leaf entries; above the object count by however many references spatial splits added
+        size_t reference_count() const { return primitives.size(); }
+
+        void account_memory(memory_report &report) const override {
+            if (!report.first_visit(this)) return;
+            report.add(memory_report::bvh, shared_bytes<sbvh>() + vector_bytes(nodes) + vector_bytes(primitives));
+            report.add(memory_report::geometry, vector_bytes(owned));
+            for (const auto &object : owned) object->account_memory(report);
+        }
+
+    private:
+        static constexpr int max_depth = 48;
+        static constexpr int bin_count = 32;
+        static constexpr size_t max_leaf_size = 8;
+        static constexpr double traversal_cost = 1;
+        static constexpr double intersection_cost = 1;
+        static constexpr double min_overlap = 1e-5;    // Child overlap, relative to the root's area, worth a spatial split
+        static constexpr double min_saving = 0.1;      // Share of the plain tree's cost the spatial tree must save
+
+        struct node {
+            aabb box;
+            uint32_t first = 0;            // Right child of an interior node, first primitive of a leaf
+            uint32_t count = 0;            // Primitives in a leaf; 0 for interior nodes, whose left child follows
+            int axis = 0;
+        };
+
+        struct reference {
+            const hittable *object;
+            aabb bounds;                   // Clipped to the node holding this reference
+        };
+
+        struct split {
+            double cost = infinity;
+            int axis = 0;
+            bool spatial = false;
+            double position = 0;           // Centroid threshold or plane
+            aabb left = aabb::empty, right = aabb::empty;
+        };
+
+        std::vector<node> nodes;
+        std::vector<const hittable *> primitives;
+        std::vector<shared_ptr<hittable>> owned;
+        aabb bbox;
+        double root_area = 0;
+        size_t reference_budget = 0;
+        size_t references_made = 0;
+
+        uint32_t build(std::vector<reference> &references, int depth) {
+            uint32_t index = uint32_t(nodes.size());
+            nodes.emplace_back();
+
+            aabb box = bounds_of(references);
+            nodes[index].box = box;
+
+            size_t n = references.size();
+            double leaf_cost = intersection_cost * n;
+            if (n == 1 || depth >= max_depth) return make_leaf(index, references);
+
+            split best = object_split(references, box);
+            std::vector<reference> left, right;
+            if (best.cost < infinity && references_made < reference_budget) {
+                aabb overlap = intersection(best.left, best.right);
+                if (overlap.x.size() > 0 && overlap.y.size() > 0 && overlap.z.size() > 0
+                    && surface_area(overlap) > min_overlap * root_area) {
+                    split candidate = spatial_split(references, box);
+                    if (candidate.cost < best.cost) {
+                        // Unsplitting changes the children the bins predicted, so the split is judged again
+                        // as made, with every duplicated reference counted on both sides
+                        partition_spatial(references, candidate, left, right);
+                        candidate.cost = sah(box, surface_area(bounds_of(left)), left.size(),
+                                             surface_area(bounds_of(right)), right.size());
+                        if (candidate.cost < best.cost) {
+                            best = candidate;
+                        } else {
+                            left.clear();
+                            right.clear();
+                        }
+                    }
+                }
+            }
+
+            // A leaf holds each reference once, so splitting has to pay for the duplicates it makes
+            if (best.cost >= leaf_cost && n <= max_leaf_size) return make_leaf(index, references);
+
+            if (best.spatial) {
+                references_made += left.size() + right.size() - n;
+            } else if (best.cost < infinity) {
+                for (const auto &ref : references) {
+                    (centroid(ref.bounds, best.axis) < best.position ? left : right).push_back(ref);
+                }
+            }
+
+            // Coincident centroids leave nothing to split on, so halve the list
+            if (left.empty() || right.empty()) {
+                left.assign(references.begin(), references.begin() + n / 2);
+                right.assign(references.begin() + n / 2, references.end());
+                best.axis = box.longest_axis();
+            }
+
+            references.clear();
+            references.shrink_to_fit();
+
+            nodes[index].axis = best.axis;
+            build(left, depth + 1);
+            uint32_t right_index = build(right, depth + 1);
+            nodes[index].first = right_index;
+            return index;
+        }
+
+        uint32_t make_leaf(uint32_t index, const std::vector<reference> &references) {
+            nodes[index].first = uint32_t(primitives.size());
+            nodes[index].count = uint32_t(references.size());
+            for (const auto &ref : references) primitives.push_back(ref.object);
+            return index;
+        }
+
+        double sah(const aabb &box, double left_area, size_t left_count, double right_area, size_t right_count) const {
+            return traversal_cost + intersection_cost * (left_area * left_count + right_area * right_count) / surface_area(box);
+        }
+
+        // Binned over reference centroids on each axis
+        split object_split(const std::vector<reference> &references, const aabb &box) const {
+            split best;
+
+            for (int axis = 0; axis < 3; axis++) {
+                interval extent = interval::empty;
+                for (const auto &ref : references) {
+                    double c = centroid(ref.bounds, axis);
+                    extent = interval(extent, interval(c, c));
+                }
+                if (extent.size() <= 0) continue;
+
+                aabb bins[bin_count];
+                size_t counts[bin_count] = {};
+                for (int b = 0; b < bin_count; b++) bins[b] = aabb::empty;
+                for (const auto &ref : references) {
+                    int b = bin_of(centroid(ref.bounds, axis), extent);
+                    bins[b] = aabb(bins[b], ref.bounds);
+                    counts[b]++;
+                }
+
+                sweep(box, bins, counts, counts, [&](int plane, const split &candidate) {
+                    if (candidate.cost >= best.cost) return;
+                    best = candidate;
+                    best.axis = axis;
+                    best.spatial = false;
+                    best.position = extent.min + extent.size() * plane / bin_count;
+                });
+            }
+
+            return best;
+        }
+
+        // Binned over the node box; a reference is clipped into every bin it crosses, entering the first
+        // and leaving the last
+        split spatial_split(const std::vector<reference> &references, const aabb &box) const {
+            split best;
+            size_t remaining = reference_budget - references_made;
+
+            for (int axis = 0; axis < 3; axis++) {
+                const interval &extent = box.axis_interval(axis);
+                if (extent.size() <= 0) continue;
+
+                aabb bins[bin_count];
+                size_t entries[bin_count] = {}, exits[bin_count] = {};
+                for (int b = 0; b < bin_count; b++) bins[b] = aabb::empty;
+
+                for (const auto &ref : references) {
+                    const interval &span = ref.bounds.axis_interval(axis);
+                    int first = bin_of(span.min, extent);
+                    int last = bin_of(span.max, extent);
+                    entries[first]++;
+                    exits[last]++;
+
+                    if (first == last) {
+                        bins[first] = aabb(bins[first], ref.bounds);
+                        continue;
+                    }
+                    for (int b = first; b <= last; b++) {
+                        double lo = extent.min + extent.size() * b / bin_count;
+                        double hi = extent.min + extent.size() * (b + 1) / bin_count;
+                        bins[b] = aabb(bins[b], clip(ref, axis, lo, hi));
+                    }
+                }
+
+                sweep(box, bins, entries, exits, [&](int plane, const split &candidate) {
+                    if (candidate.cost >= best.cost) return;
+
+                    size_t left_count = 0, right_count = 0;
+                    for (int b = 0; b < plane; b++) left_count += entries[b];
+                    for (int b = plane; b < bin_count; b++) right_count += exits[b];
+                    if (left_count + right_count - references.size() > remaining) return;
+
+                    best = candidate;
+                    best.axis = axis;
+                    best.spatial = true;
+                    best.position = extent.min + extent.size() * plane / bin_count;
+                });
+            }
+
+            return best;
+        }
+
+        // Calls found(plane, candidate) for each plane between bins; left counts come from left_counts of
+        // the bins below the plane and right counts from right_counts of the bins above
+        template <typename F>
+        void sweep(const aabb &box, const aabb *bins, const size_t *left_counts, const size_t *right_counts,
+                   F found) const {
+            aabb right_boxes[bin_count];
+            size_t right_totals[bin_count];
+            aabb right = aabb::empty;
+            size_t right_count = 0;
+            for (int b = bin_count - 1; b > 0; b--) {
+                right = aabb(right, bins[b]);
+                right_count += right_counts[b];
+                right_boxes[b] = right;
+                right_totals[b] = right_count;
+            }
+
+            aabb left = aabb::empty;
+            size_t left_count = 0;
+            for (int plane = 1; plane < bin_count; plane++) {
+                left = aabb(left, bins[plane - 1]);
+                left_count += left_counts[plane - 1];
+                if (left_count == 0 || right_totals[plane] == 0) continue;
+
+                split candidate;
+                candidate.left = left;
+                candidate.right = right_boxes[plane];
+                candidate.cost = sah(box, surface_area(left), left_count, surface_area(right_boxes[plane]), right_totals[plane]);
+                found(plane, candidate);
+            }
+        }
+
+        // Straddling references go to both sides unless keeping one whole on a side is cheaper
+        // ("reference unsplitting")
+        void partition_spatial(const std::vector<reference> &references, const split &s,
+                               std::vector<reference> &left, std::vector<reference> &right) const {
+            aabb left_box = aabb::empty, right_box = aabb::empty;
+            size_t left_count = 0, right_count = 0;
+            std::vector<const reference *> straddling;
+
+            for (const auto &ref : references) {
+                const interval &span = ref.bounds.axis_interval(s.axis);
+                if (span.max <= s.position) {
+                    left.push_back(ref);
+                    left_box = aabb(left_box, ref.bounds);
+                    left_count++;
+                } else if (span.min >= s.position) {
+                    right.push_back(ref);
+                    right_box = aabb(right_box, ref.bounds);
+                    right_count++;
+                } else {
+                    straddling.push_back(&ref);
+                }
+            }
+
+            for (const reference *ref : straddling) {
+                const interval &extent = ref->bounds.axis_interval(s.axis);
+                aabb left_part = clip(*ref, s.axis, extent.min, s.position);
+                aabb right_part = clip(*ref, s.axis, s.position, extent.max);
+
+                aabb split_left = aabb(left_box, left_part), split_right = aabb(right_box, right_part);
+                aabb whole_left = aabb(left_box, ref->bounds), whole_right = aabb(right_box, ref->bounds);
+
+                double split_cost = surface_area(split_left) * (left_count + 1) + surface_area(split_right) * (right_count + 1);
+                double left_cost = surface_area(whole_left) * (left_count + 1) + surface_area(right_box) * right_count;
+                double right_cost = surface_area(left_box) * left_count + surface_area(whole_right) * (right_count + 1);
+
+                if (left_cost < split_cost && left_cost <= right_cost) {
+                    left.push_back(*ref);
+                    left_box = whole_left;
+                    left_count++;
+                } else if (right_cost < split_cost) {
+                    right.push_back(*ref);
+                    right_box = whole_right;
+                    right_count++;
+                } else {
+                    left.push_back({ref->object, left_part});
+                    right.push_back({ref->object, right_part});
+                    left_box = split_left;
+                    right_box = split_right;
+                    left_count++;
+                    right_count++;
+                }
+            }
+        }
+
+        // The part of a reference between lo and hi on axis
+        static aabb clip(const reference &ref, int axis, double lo, double hi) {
+            aabb slab = ref.bounds;
+            interval &span = axis == 0 ? slab.x : axis == 1 ? slab.y : slab.z;
+            span = interval(std::fmax(span.min, lo), std::fmin(span.max, hi));
+            return ref.object->clipped_bounds(slab);
+        }
+
+        // Expected cost of a ray through the root under the SAH: interior nodes by traversal, leaves by tests
+        double tree_cost(const std::vector<node> &tree) const {
+            double cost = 0;
+            for (const auto &n : tree) {
+                double area = surface_area(n.box) / root_area;
+                cost += n.count > 0 ? area * intersection_cost * n.count : area * traversal_cost;
+            }
+            return cost;
+        }
+
+        static aabb bounds_of(const std::vector<reference> &references) {
+            aabb box = aabb::empty;
+            for (const auto &ref : references) box = aabb(box, ref.bounds);
+            return box;
+        }
+
+        static int bin_of(double x, const interval &extent) {
+            int b = int((x - extent.min) / extent.size() * bin_count);
+            return std::clamp(b, 0, bin_count - 1);
+        }
+
+        static double centroid(const aabb &box, int axis) {
+            const interval &span = box.axis_interval(axis);
+            return 0.5 * (span.min + span.max);
+        }
+
+        static double surface_area(const aabb &box) {
+            double dx = std::fmax(0.0, box.x.size()), dy = std::fmax(0.0, box.y.size()), dz = std::fmax(0.0, box.z.size());
+            return 2 * (dx * dy + dy * dz + dz * dx);
+        }
+
+        static aabb intersection(const aabb &a, const aabb &b) {
+            aabb result;
+            result.x = interval(std::fmax(a.x.min, b.x.min), std::fmin(a.x.max, b.x.max));
+            result.y = interval(std::fmax(a.y.min, b.y.min), std::fmin(a.y.max, b.y.max));
+            result.z = interval(std::fmax(a.z.min, b.z.min), std::fmin(a.z.max, b.z.max));
+            return result;
+        }
+};
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef SCENE_BUDGET_H
+#define SCENE_BUDGET_H
+
+#include "bvh.h"
+#include "camera.h"
+#include "compact_bvh.h"
+#include "hittable_list.h"
+#include "memory_report.h"
+
+// What build_within_budget() does when a bvh_node tree would not fit
+enum class budget_policy { fail, degrade };
+
+// Builds the acceleration structure for objects so that the whole render stays within budget bytes
+// (0 for no limit), counting the objects themselves and the camera's buffers. Under budget_policy::degrade
+// it falls back to compact_bvh16 and then compact_bvh8 before giving up. Sizes are estimated before
+// anything is built, so a render that cannot fit fails here, with a null result, instead of partway
+// through. report holds the accounting of the returned scene, or on failure the estimate for the
+// cheapest structure that was tried.
+inline shared_ptr<hittable> build_within_budget(const hittable_list &objects, camera &cam, size_t budget,
+                                                budget_policy policy, memory_report &report) {
+    memory_report base;
+    objects.account_memory(base);
+    cam.account_memory(base);
+    size_t count = objects.objects.size();
+
+    struct option {
+        const char *name;
+        size_t bytes;
+    };
+    option options[] = {
+        {"bvh_node", bvh_node::estimate_bytes(count)},
+        {"compact_bvh16", compact_bvh16::estimate_bytes(count)},
+        {"compact_bvh8", compact_bvh8::estimate_bytes(count)},
+    };
+    int tries = policy == budget_policy::degrade ? 3 : 1;
+
+    int choice = -1;
+    for (int i = 0; i < tries && choice < 0; i++) {
+        if (budget == 0 || base.total() + options[i].bytes <= budget) choice = i;
+    }
+
+    if (choice < 0) {
+        std::cerr << "ERROR: Scene needs " << memory_report::mebibytes(base.total() + options[tries - 1].bytes)
+                  << " MiB with " << options[tries - 1].name << ", over the budget of "
+                  << memory_report::mebibytes(budget) << " MiB.\n";
+        report = base;
+        report.add(memory_report::bvh, options[tries - 1].bytes);
+        return nullptr;
+    }
+
+    shared_ptr<hittable> scene;
+    if (choice == 0) {
+        scene = make_shared<bvh_node>(objects);
+    } else if (choice == 1) {
+        scene = make_shared<compact_bvh16>(objects);
+    } else {
+        scene = make_shared<compact_bvh8>(objects);
+    }
+    if (choice > 0) std::clog << "Memory budget: using " << options[choice].name << " instead of bvh_node\n";
+
+    report = memory_report();
+    scene->account_memory(report);
+    cam.account_memory(report);
+    return scene;
+}
+
+#endif
@@ -0,0 +1,138 @@
+#ifndef SHADING_CACHE_H
+#define SHADING_CACHE_H
+
+#include "hittable.h"
+#include "material.h"
+
+#include <algorithm>
+#include <vector>
+
+// Per-sample primary hit data for incremental look-dev re-renders. While the camera and geometry stay
+// fixed, materials can be swapped with replace_material() and the next render only reshades the tiles
+// where the swapped material was directly visible, starting from the cached primary hits.
+class shading_cache {
+    public:
+        struct first_hit {
+            point3 p;
+            vec3 normal;
+            vec3 direction;                // Primary ray direction and origin
+            point3 origin;
+            double time;                   // Primary ray time
+            double t;
+            double u;
+            double v;
+            int material_id;               // Index into the tile's material list, -1 for a miss
+            bool front_face;
+        };
+
+        struct tile {
+            int x0, y0, x1, y1;
+            std::vector<int> material_ids; // Global ids of every material directly visible in the tile
+            bool dirty = true;
+        };
+
+        bool valid_for(int width, int height, int spp, int tile_size) const {
+            return width == image_width && height == image_height
+                && spp == samples_per_pixel && tile_size == tile_edge && !hits.empty();
+        }
+
+        // Drop everything; call this whenever the camera or geometry changes.
+        void clear() {
+            hits.clear();
+            tiles.clear();
+            materials.clear();
+            image.clear();
+            image_width = image_height = samples_per_pixel = tile_edge = 0;
+        }
+
+        // Swap every cached reference to old_mat for new_mat and mark the tiles that see it for reshading.
+        // Only directly visible surfaces are tracked, so an edit that matters mostly through secondary
+        // bounces (e.g. a light seen in reflections) should be followed by invalidate_all().
+        void replace_material(const shared_ptr<material> &old_mat, shared_ptr<material> new_mat) {
+            for (size_t id = 0; id < materials.size(); id++) {
+                if (materials[id] != old_mat) continue;
+                materials[id] = new_mat;
+
+                for (auto &t : tiles) {
+                    if (std::find(t.material_ids.begin(), t.material_ids.end(), int(id)) != t.material_ids.end()) {
+                        t.dirty = true;
+                    }
+                }
+            }
+        }
+
+        void invalidate_all() {
+            for (auto &t : tiles) t.dirty = true;
+        }
+
+        int dirty_tiles() const {
+            int count = 0;
+            for (const auto &t : tiles) count += t.dirty ? 1 : 0;
+            return count;
+        }
+
+    private:
+        friend class camera;
+
+        int image_width = 0;
+        int image_height = 0;
+        int samples_per_pixel = 0;
+        int tile_edge = 0;
+
+        std::vector<first_hit> hits;                // [pixel][sample], row-major pixels
+        std::vector<tile> tiles;
+        std::vector<shared_ptr<material>> materials;
+        std::vector<colour> image;                  // Last shaded pixel colours
+
+        void reset(int width, int height, int spp, int tile_size) {
+            clear();
+            image_width = width;
+            image_height = height;
+            samples_per_pixel = spp;
+            tile_edge = tile_size;
+
+            hits.resize(size_t(width) * height * spp);
+            image.resize(size_t(width) * height);
+
+            for (int y = 0; y < height; y += tile_size) {
+                for (int x = 0; x < width; x += tile_size) {
+                    tile t;
+                    t.x0 = x;
+                    t.y0 = y;
+                    t.x1 = std::min(x + tile_size, width);
+                    t.y1 = std::min(y + tile_size, height);
+                    tiles.push_back(t);
+                }
+            }
+        }
+
+        first_hit &at(int col, int row, int sample) {
+            return hits[(size_t(row) * image_width + col) * samples_per_pixel + sample];
+        }
+
+        // Turn tile-local material slots into global ids, sharing one id per distinct material.
+        void register_materials(tile &t, const std::vector<shared_ptr<material>> &local) {
+            std::vector<int> remap(local.size());
+            for (size_t i = 0; i < local.size(); i++) {
+                auto it = std::find(materials.begin(), materials.end(), local[i]);
+                if (it == materials.end()) {
+                    materials.push_back(local[i]);
+                    it = materials.end() - 1;
+                }
+                remap[i] = int(it - materials.begin());
+            }
+
+            for (int row = t.y0; row < t.y1; row++) {
+                for (int col = t.x0; col < t.x1; col++) {
+                    for (int sample = 0; sample < samples_per_pixel; sample++) {
+                        first_hit &h = at(col, row, sample);
+                        if (h.material_id >= 0) h.material_id = remap[h.material_id];
+                    }
+                }
+            }
+
+            t.material_ids = remap;
+        }
+};
+
+#endif
@@ -2,18 +2,98 @@
 #define SPHERE_H
 
 #include "hittable.h"
+#include "material.h"
+#include "onb.h"
 #include "vec3.h"
 
 class sphere : public hittable {
     public:
         sphere(const point3 &center, double radius, shared_ptr<material> mat) 
-         : center(center), radius(std::fmax(0, radius)), mat(mat) {
+         : center(center), radius(std::fmax(0, radius)), mat(mat), mat_uses_uv(mat->uses_uv()) {
             vec3 rvec = vec3(radius, radius, radius);
             bbox = aabb(center - rvec, center + rvec);
          }
 
         bool hit(const ray &r, interval ray_t, hit_record &rec) const override {
-            vec3 oc = center - r.origin();
+            double root;
+            if (!intersect(r, ray_t, center, root)) return false;
+
+            rec.t = root;
+            rec.prim = this;
+
+            return true;
+        }
+
+        bool occluded(const ray &r, interval ray_t) const override {
+            double root;
+            return intersect(r, ray_t, center, root);
+        }
+
+        void complete(const ray &r, hit_record &rec, bool need_uv) const override {
+            complete_at(r, rec, need_uv, center);
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        void account_memory(memory_report &report) const override {
+            if (!report.first_visit(this)) return;
+            report.add(memory_report::geometry, shared_bytes<sphere>());
+            mat->account_memory(report);
+        }
+
+        double pdf_value(const point3 &origin, const vec3 &direction) const override {
+            double root;
+            double distance_squared = (center - origin).length_squared();
+            if (distance_squared <= radius * radius) return 0;
+            if (!intersect(ray(origin, direction), interval(0.001, infinity), center, root)) return 0;
+
+            double cos_theta_max = std::sqrt(1 - radius * radius / distance_squared);
+            double solid_angle = 2 * pi * (1 - cos_theta_max);
+            return 1 / solid_angle;
+        }
+
+        bool sample_surface(double u1, double u2, point3 &p, vec3 &normal) const override {
+            double z = 1 - 2 * u1;
+            double r = std::sqrt(std::fmax(0.0, 1 - z * z));
+            double phi = 2 * pi * u2;
+            normal = vec3(r * std::cos(phi), r * std::sin(phi), z);
+            p = center + radius * normal;
+            return true;
+        }
+
+        double surface_area() const override { return 4 * pi * radius * radius; }
+
+        // Uniform over the cone of directions the sphere subtends from origin
+        vec3 random(const point3 &origin) const override {
+            vec3 direction = center - origin;
+            double distance_squared = direction.length_squared();
+            if (distance_squared <= radius * radius) return vec3(1, 0, 0);
+
+            onb uvw(direction);
+            return uvw.transform(random_to_sphere(radius, distance_squared));
+        }
+
+        bool emission_bound(light_bound &bound) const override {
+            double power = luminance(mat->emitted(0.5, 0.5, center)) * 4 * pi * radius * radius * pi;
+            if (power <= 0) return false;
+
+            bound.bounds = bbox;
+            bound.power = power;
+            bound.cos_theta_o = -1;
+            bound.cos_theta_e = 0;
+            return true;
+        }
+
+    protected:
+        point3 center;                     // At time 0 for a moving_sphere
+        double radius;
+        shared_ptr<material> mat;
+        bool mat_uses_uv;
+        aabb bbox;
+
+        bool intersect(const ray &r, interval ray_t, const point3 &position, double &root) const {
+            render_stats.primitive_tests++;
+            vec3 oc = position - r.origin();
             double a = r.direction().length_squared();
             double h = dot(r.direction(), oc);
             double c = oc.length_squared() - (radius * radius);
@@ -22,7 +102,7 @@ class sphere : public hittable {
             if (discriminant < 0) return false;
 
             double sqrtd = std::sqrt(discriminant);
-            double root = (h - sqrtd) / a;
+            root = (h - sqrtd) / a;
             if (!ray_t.surrounds(root)) {
                 root = (h + sqrtd) / a;
                 if (!ray_t.surrounds(root)) {
@@ -30,30 +110,91 @@ class sphere : public hittable {
                 }
             }
 
-            rec.t = root;
+            return true;
+        }
+
+        void complete_at(const ray &r, hit_record &rec, bool need_uv, const point3 &position) const {
             rec.p = r.at(rec.t);
-            vec3 outward_normal = (rec.p - center) / radius;
+            vec3 outward_normal = (rec.p - position) / radius;
             rec.set_face_normal(r, outward_normal);
-            get_sphere_uv(outward_normal, rec.u, rec.v);
+            if (need_uv || mat_uses_uv) {
+                get_sphere_uv(outward_normal, rec.u, rec.v);
+            } else {
+                rec.u = rec.v = 0;
+            }
             rec.mat = mat;
-
-            return true;
         }
 
-        aabb bounding_box() const override { return bbox; }
-
     private:
-        point3 center;
-        double radius;
-        shared_ptr<material> mat;
-        aabb bbox;
+        static vec3 random_to_sphere(double radius, double distance_squared) {
+            double r1, r2;
+            sample_2d(r1, r2);
+            double z = 1 + r2 * (std::sqrt(1 - radius * radius / distance_squared) - 1);
+
+            double phi = 2 * pi * r1;
+            double x = std::cos(phi) * std::sqrt(1 - z * z);
+            double y = std::sin(phi) * std::sqrt(1 - z * z);
+
+            return vec3(x, y, z);
+        }
 
         static void get_sphere_uv(point3 &p, double &u, double &v) {
-            double theta = std::acos(-p.y());
-            double phi = std::atan2(-p.z(), p.x()) + pi;
+            double theta = fast_math_kernels ? fast_acos(-p.y()) : std::acos(-p.y());
+            double phi = (fast_math_kernels ? fast_atan2(-p.z(), p.x()) : std::atan2(-p.z(), p.x())) + pi;
             u = phi / (2 * pi);
             v = theta / pi;
         }
 };
 
+// Sphere moving from center1 at time 0 to center2 at time 1. Kept apart from sphere so static spheres
+// carry no motion state.
+class moving_sphere : public sphere {
+    public:
+        moving_sphere(const point3 &center1, const point3 &center2, double radius, shared_ptr<material> mat)
+         : sphere(center1, radius, mat), velocity(center2 - center1) {
+            vec3 rvec = vec3(this->radius, this->radius, this->radius);
+            bbox = aabb(aabb(center1 - rvec, center1 + rvec), aabb(center2 - rvec, center2 + rvec));
+        }
+
+        bool hit(const ray &r, interval ray_t, hit_record &rec) const override {
+            double root;
+            if (!intersect(r, ray_t, center_at(r.time()), root)) return false;
+
+            rec.t = root;
+            rec.prim = this;
+
+            return true;
+        }
+
+        bool occluded(const ray &r, interval ray_t) const override {
+            double root;
+            return intersect(r, ray_t, center_at(r.time()), root);
+        }
+
+        void complete(const ray &r, hit_record &rec, bool need_uv) const override {
+            complete_at(r, rec, need_uv, center_at(r.time()));
+        }
+
+        void motion_bounds(aabb &start, aabb &end) const override {
+            vec3 rvec = vec3(radius, radius, radius);
+            start = aabb(center - rvec, center + rvec);
+            end = aabb(center + velocity - rvec, center + velocity + rvec);
+        }
+
+        void account_memory(memory_report &report) const override {
+            if (!report.first_visit(this)) return;
+            report.add(memory_report::geometry, shared_bytes<moving_sphere>());
+            mat->account_memory(report);
+        }
+
+        // Light sampling aims at where the sphere is at time 0, so moving emitters are left out of it;
+        // bounces still find them
+        bool emission_bound(light_bound &bound) const override { return false; }
+
+    private:
+        vec3 velocity;                     // Distance moved over the shutter
+
+        point3 center_at(double time) const { return center + time * velocity; }
+};
+
 #endif
@@ -2,14 +2,242 @@
 #define TEXTURE_H
 
 #include "utils.h"
+#include "memory_report.h"
+#include "texture_cache.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+class texture_compiler;
 
 class texture {
     public:
         virtual ~texture() = default;
 
         virtual colour value(double u, double v, const point3 &p) const = 0;
+
+        // Lookup for a world-space ray footprint width at p; textures without prefiltering ignore it
+        virtual colour filtered_value(double u, double v, const point3 &p, double footprint) const {
+            return value(u, v, p);
+        }
+
+        // Whether value() reads u and v, so hits can skip computing them
+        virtual bool uses_uv() const { return true; }
+
+        // Adds the estimated heap bytes of this texture and anything it references
+        virtual void account_memory(memory_report &report) const {}
+
+        // Emits instructions that evaluate this texture; the default calls filtered_value() back
+        virtual void compile(texture_compiler &compiler) const;
+};
+
+// One shading point for batched texture evaluation
+struct texture_query {
+    double u, v;
+    point3 p;
+    double footprint;
+};
+
+// A texture network flattened into one array of instructions when the scene is built. Checkers become
+// conditional jumps over their even branch, solid colours become inline constants, and checkers whose
+// outcome is already known (both branches equal, or an enclosing checker at the same scale decided it)
+// are folded away, so evaluation walks a short run of instructions without virtual calls. Textures with
+// no instructions of their own, like image_texture, are called through filtered_value(). A network that
+// folds to one colour keeps it inline, with no instructions at all.
+class texture_program {
+    public:
+        texture_program() : folded(0, 0, 0) {}
+        explicit texture_program(const colour &c) : folded(c) {}
+        explicit texture_program(const texture &root);
+
+        colour evaluate(double u, double v, const point3 &p, double footprint) const {
+            if (code.empty()) return folded;
+
+            int pc = 0;
+            while (true) {
+                const instruction &in = code[pc];
+                switch (in.op) {
+                    case constant:
+                        return in.even;
+                    case checker:
+                        pc = is_even(in.inv_scale, p) ? pc + 1 : in.odd_branch;
+                        break;
+                    case checker_constants:
+                        return is_even(in.inv_scale, p) ? in.even : in.odd;
+                    case external:
+                        return in.external->filtered_value(u, v, p, footprint);
+                }
+            }
+        }
+
+        // Evaluates every query, writing out[i] for queries[i]. Points are split between the branches of
+        // each checker in turn, so each instruction runs once over all the points that reach it.
+        void evaluate(const texture_query *queries, size_t count, colour *out) const {
+            if (code.empty()) {
+                for (size_t i = 0; i < count; i++) out[i] = folded;
+                return;
+            }
+
+            std::vector<uint32_t> indices(2 * count);
+            for (size_t i = 0; i < count; i++) indices[i] = uint32_t(i);
+            evaluate_group(0, indices.data(), count, indices.data() + count, queries, out);
+        }
+
+        bool uses_uv() const {
+            for (const auto &in : code) {
+                if (in.op == external && in.external->uses_uv()) return true;
+            }
+            return false;
+        }
+
+        size_t size() const { return code.size(); }
+        size_t bytes() const { return vector_bytes(code); }
+
+    private:
+        friend class texture_compiler;
+
+        enum opcode : uint8_t { constant, checker, checker_constants, external };
+
+        struct instruction {
+            opcode op = constant;
+            int odd_branch = 0;            // checker: index of the odd branch, which follows the even one
+            double inv_scale = 0;
+            colour even;                   // The value of a constant
+            colour odd;
+            const texture *external = nullptr;
+        };
+
+        std::vector<instruction> code;
+        colour folded;                     // The value when code is empty
+
+        static bool is_even(double inv_scale, const point3 &p) {
+            int x = int(std::floor(inv_scale * p.x()));
+            int y = int(std::floor(inv_scale * p.y()));
+            int z = int(std::floor(inv_scale * p.z()));
+            return (x + y + z) % 2 == 0;
+        }
+
+        // scratch holds at least count indices
+        void evaluate_group(int pc, uint32_t *indices, size_t count, uint32_t *scratch, const texture_query *queries,
+                            colour *out) const {
+            while (count > 0) {
+                const instruction &in = code[pc];
+                switch (in.op) {
+                    case constant:
+                        for (size_t i = 0; i < count; i++) out[indices[i]] = in.even;
+                        return;
+                    case checker_constants:
+                        for (size_t i = 0; i < count; i++) {
+                            out[indices[i]] = is_even(in.inv_scale, queries[indices[i]].p) ? in.even : in.odd;
+                        }
+                        return;
+                    case external:
+                        for (size_t i = 0; i < count; i++) {
+                            const texture_query &q = queries[indices[i]];
+                            out[indices[i]] = in.external->filtered_value(q.u, q.v, q.p, q.footprint);
+                        }
+                        return;
+                    case checker: {
+                        // Without branches: every index is written to both lists, but only one count advances
+                        size_t evens = 0, odds = 0;
+                        for (size_t i = 0; i < count; i++) {
+                            uint32_t index = indices[i];
+                            bool even = is_even(in.inv_scale, queries[index].p);
+                            indices[evens] = index;
+                            scratch[odds] = index;
+                            evens += even;
+                            odds += !even;
+                        }
+                        std::copy(scratch, scratch + odds, indices + evens);
+
+                        evaluate_group(pc + 1, indices, evens, scratch, queries, out);
+                        pc = in.odd_branch;
+                        indices += evens;
+                        count = odds;
+                        break;
+                    }
+                }
+            }
+        }
+};
+
+// Builds a texture_program's instructions as texture::compile() calls reach each node
+class texture_compiler {
+    public:
+        void emit_constant(const colour &c) {
+            code.push_back(instruction());
+            code.back().op = texture_program::constant;
+            code.back().even = c;
+        }
+
+        void emit_external(const texture &t) {
+            code.push_back(instruction());
+            code.back().op = texture_program::external;
+            code.back().external = &t;
+        }
+
+        void emit_checker(double inv_scale, const texture &even, const texture &odd) {
+            for (auto it = assumptions.rbegin(); it != assumptions.rend(); ++it) {
+                if (it->first == inv_scale) {
+                    (it->second ? even : odd).compile(*this);
+                    return;
+                }
+            }
+
+            int start = int(code.size());
+            code.push_back(instruction());
+            code[start].op = texture_program::checker;
+            code[start].inv_scale = inv_scale;
+
+            assumptions.push_back({inv_scale, true});
+            even.compile(*this);
+            assumptions.back().second = false;
+            code[start].odd_branch = int(code.size());
+            odd.compile(*this);
+            assumptions.pop_back();
+
+            // Fold a choice between two constants into one instruction, or into a constant if they match
+            int odd_branch = code[start].odd_branch;
+            bool even_constant = odd_branch == start + 2 && code[start + 1].op == texture_program::constant;
+            bool odd_constant = int(code.size()) == odd_branch + 1 && code[odd_branch].op == texture_program::constant;
+            if (!even_constant || !odd_constant) return;
+
+            colour a = code[start + 1].even, b = code[odd_branch].even;
+            code.resize(start);
+            if (a.x() == b.x() && a.y() == b.y() && a.z() == b.z()) {
+                emit_constant(a);
+                return;
+            }
+            code.push_back(instruction());
+            code.back().op = texture_program::checker_constants;
+            code.back().inv_scale = inv_scale;
+            code.back().even = a;
+            code.back().odd = b;
+        }
+
+    private:
+        friend class texture_program;
+        using instruction = texture_program::instruction;
+
+        std::vector<instruction> code;
+        std::vector<std::pair<double, bool>> assumptions;  // Checker outcomes decided by enclosing checkers
 };
 
+inline texture_program::texture_program(const texture &root) : folded(0, 0, 0) {
+    texture_compiler compiler;
+    root.compile(compiler);
+    if (compiler.code.size() == 1 && compiler.code[0].op == constant) {
+        folded = compiler.code[0].even;
+        return;
+    }
+    code = std::move(compiler.code);
+    code.shrink_to_fit();
+}
+
+inline void texture::compile(texture_compiler &compiler) const { compiler.emit_external(*this); }
+
 class solid_colour : public texture {
     public:
         solid_colour(const colour &albedo) : albedo(albedo) {}
@@ -18,6 +246,14 @@ class solid_colour : public texture {
 
         colour value(double u, double v, const point3 &p) const override { return albedo; }
 
+        bool uses_uv() const override { return false; }
+
+        void account_memory(memory_report &report) const override {
+            if (report.first_visit(this)) report.add(memory_report::textures, shared_bytes<solid_colour>());
+        }
+
+        void compile(texture_compiler &compiler) const override { compiler.emit_constant(albedo); }
+
     private:
         colour albedo;
 };
@@ -38,10 +274,106 @@ class checker_texture : public texture {
             return is_even ? even->value(u, v, p) : odd->value(u, v, p);
         }
 
+        colour filtered_value(double u, double v, const point3 &p, double footprint) const override {
+            int x = int(std::floor(inv_scale * p.x()));
+            int y = int(std::floor(inv_scale * p.y()));
+            int z = int(std::floor(inv_scale * p.z()));
+            bool is_even = (x + y + z) % 2 == 0;
+            return is_even ? even->filtered_value(u, v, p, footprint) : odd->filtered_value(u, v, p, footprint);
+        }
+
+        bool uses_uv() const override { return even->uses_uv() || odd->uses_uv(); }
+
+        void compile(texture_compiler &compiler) const override { compiler.emit_checker(inv_scale, *even, *odd); }
+
+        void account_memory(memory_report &report) const override {
+            if (!report.first_visit(this)) return;
+            report.add(memory_report::textures, shared_bytes<checker_texture>());
+            even->account_memory(report);
+            odd->account_memory(report);
+        }
+
     private:
         double inv_scale;
         shared_ptr<texture> even;
         shared_ptr<texture> odd;
 };
 
+// Image texture streamed from a tiled mip-mapped file (see write_tiled_texture) through a tile cache.
+// world_size is the approximate world-space length covered by the unit uv range, used to turn the ray
+// footprint into a mip level.
+class image_texture : public texture {
+    public:
+        image_texture(const std::string &path, double world_size = 1.0,
+                      texture_tile_cache &cache = texture_tile_cache::global())
+         : file(make_shared<tiled_texture_file>(path)), world_size(world_size), cache(cache) {}
+
+        colour value(double u, double v, const point3 &p) const override {
+            return filtered_value(u, v, p, 0);
+        }
+
+        colour filtered_value(double u, double v, const point3 &p, double footprint) const override {
+            // The file reported its failure when it was opened; it reads as black from then on
+            if (!file->valid()) return colour(0, 0, 0);
+
+            double texels = footprint / world_size * file->level(0).width;
+            double level = std::log2(std::fmax(texels, 1.0));
+            level = std::fmin(level, file->level_count() - 1.0);
+
+            int l0 = int(level);
+            int l1 = std::min(l0 + 1, file->level_count() - 1);
+            double blend = level - l0;
+
+            colour c0 = bilinear(l0, u, v);
+            if (blend <= 0 || l1 == l0) return c0;
+            return (1 - blend) * c0 + blend * bilinear(l1, u, v);
+        }
+
+        // Tiles live in the shared cache, which can grow to its capacity however many textures use it
+        void account_memory(memory_report &report) const override {
+            if (!report.first_visit(this)) return;
+            report.add(memory_report::textures, shared_bytes<image_texture>());
+            if (report.first_visit(file.get())) report.add(memory_report::textures, shared_bytes<tiled_texture_file>());
+            if (report.first_visit(&cache)) report.add(memory_report::textures, cache.capacity_bytes());
+        }
+
+    private:
+        shared_ptr<tiled_texture_file> file;
+        double world_size;
+        texture_tile_cache &cache;
+
+        colour bilinear(int level, double u, double v) const {
+            const tiled_texture_file::level_info &info = file->level(level);
+
+            // Repeat in u and v; image rows run top to bottom
+            u = u - std::floor(u);
+            v = 1.0 - (v - std::floor(v));
+
+            double x = u * info.width - 0.5;
+            double y = v * info.height - 0.5;
+            int x0 = int(std::floor(x));
+            int y0 = int(std::floor(y));
+            double fx = x - x0;
+            double fy = y - y0;
+
+            return (1 - fx) * (1 - fy) * texel(level, x0, y0)
+                 + fx * (1 - fy) * texel(level, x0 + 1, y0)
+                 + (1 - fx) * fy * texel(level, x0, y0 + 1)
+                 + fx * fy * texel(level, x0 + 1, y0 + 1);
+        }
+
+        colour texel(int level, int x, int y) const {
+            const tiled_texture_file::level_info &info = file->level(level);
+            int w = int(info.width);
+            int h = int(info.height);
+            x = ((x % w) + w) % w;
+            y = ((y % h) + h) % h;
+
+            int size = file->tile_size();
+            auto tile = cache.tile(*file, level, x / size, y / size);
+            const float *t = tile->data() + ((y % size) * size + (x % size)) * 3;
+            return colour(t[0], t[1], t[2]);
+        }
+};
+
 #endif
@@ -0,0 +1,341 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include "utils.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Tiled, mip-mapped texture files. Layout (little-endian):
+//   char[4] "RTMT", uint32 version, width, height, tile_size, levels
+//   per level: uint32 width, height, tiles_x, tiles_y, uint64 offset of the level's first tile
+//   tiles: tile_size * tile_size RGB float texels each, row-major, edges padded by clamping
+class tiled_texture_file {
+    public:
+        struct level_info {
+            uint32_t width, height, tiles_x, tiles_y;
+            uint64_t offset;
+        };
+
+        tiled_texture_file(const std::string &path) : in(path, std::ios::binary), path(path) {
+            static std::atomic<uint32_t> next_id{0};
+            id = next_id++;
+
+            char magic[4];
+            uint32_t version = 0;
+            uint32_t level_count = 0;
+            in.read(magic, 4);
+            read(version);
+            read(full_width);
+            read(full_height);
+            read(tile_edge);
+            read(level_count);
+
+            if (!in || std::string(magic, 4) != "RTMT" || version != 1 || tile_edge == 0) {
+                std::cerr << "ERROR: Could not load tiled texture '" << path << "'.\n";
+                in.close();
+                return;
+            }
+
+            levels.resize(level_count);
+            for (auto &level : levels) {
+                read(level.width);
+                read(level.height);
+                read(level.tiles_x);
+                read(level.tiles_y);
+                read(level.offset);
+            }
+
+            if (!in) {
+                std::cerr << "ERROR: Tiled texture '" << path << "' is truncated.\n";
+                levels.clear();
+                in.close();
+            }
+        }
+
+        bool valid() const { return !levels.empty(); }
+        uint32_t file_id() const { return id; }
+        int level_count() const { return int(levels.size()); }
+        int tile_size() const { return int(tile_edge); }
+        const level_info &level(int l) const { return levels[l]; }
+        size_t tile_bytes() const { return size_t(tile_edge) * tile_edge * 3 * sizeof(float); }
+
+        // A tile that cannot be read comes back black, so the failure is reported once per tile it is cached under
+        bool read_tile(int l, int tx, int ty, std::vector<float> &texels) {
+            const level_info &info = levels[l];
+            texels.resize(size_t(tile_edge) * tile_edge * 3);
+
+            std::lock_guard<std::mutex> lock(file_mutex);
+            in.clear();
+            in.seekg(std::streamoff(info.offset + (uint64_t(ty) * info.tiles_x + tx) * tile_bytes()));
+            in.read(reinterpret_cast<char *>(texels.data()), std::streamsize(tile_bytes()));
+            if (in) return true;
+
+            std::cerr << "ERROR: Could not read tile (" << tx << ", " << ty << ") of level " << l
+                      << " from tiled texture '" << path << "'.\n";
+            std::fill(texels.begin(), texels.end(), 0.0f);
+            in.clear();
+            return false;
+        }
+
+    private:
+        std::ifstream in;
+        std::string path;
+        std::mutex file_mutex;
+        uint32_t id;
+        uint32_t full_width = 0;
+        uint32_t full_height = 0;
+        uint32_t tile_edge = 0;
+        std::vector<level_info> levels;
+
+        template <typename T>
+        void read(T &value) { in.read(reinterpret_cast<char *>(&value), sizeof(T)); }
+};
+
+// Writes linear RGB pixels (row-major, top row first) as a tiled mip chain built with a 2x2 box filter.
+inline bool write_tiled_texture(const std::string &path, int width, int height,
+                                const std::vector<colour> &pixels, int tile_size = 64) {
+    std::vector<std::vector<colour>> chain{pixels};
+    std::vector<std::pair<int, int>> sizes{{width, height}};
+
+    while (sizes.back().first > 1 || sizes.back().second > 1) {
+        auto [w, h] = sizes.back();
+        int nw = std::max(1, w / 2);
+        int nh = std::max(1, h / 2);
+        const std::vector<colour> &src = chain.back();
+        std::vector<colour> dst(size_t(nw) * nh);
+
+        for (int y = 0; y < nh; y++) {
+            for (int x = 0; x < nw; x++) {
+                int x0 = std::min(2 * x, w - 1), x1 = std::min(2 * x + 1, w - 1);
+                int y0 = std::min(2 * y, h - 1), y1 = std::min(2 * y + 1, h - 1);
+                dst[y * nw + x] = 0.25 * (src[y0 * w + x0] + src[y0 * w + x1] + src[y1 * w + x0] + src[y1 * w + x1]);
+            }
+        }
+
+        chain.push_back(std::move(dst));
+        sizes.push_back({nw, nh});
+    }
+
+    std::ofstream out(path, std::ios::binary);
+    if (!out) return false;
+
+    auto put = [&](auto value) { out.write(reinterpret_cast<const char *>(&value), sizeof(value)); };
+
+    out.write("RTMT", 4);
+    put(uint32_t(1));
+    put(uint32_t(width));
+    put(uint32_t(height));
+    put(uint32_t(tile_size));
+    put(uint32_t(chain.size()));
+
+    size_t tile_bytes = size_t(tile_size) * tile_size * 3 * sizeof(float);
+    uint64_t offset = 4 + 5 * sizeof(uint32_t) + chain.size() * (4 * sizeof(uint32_t) + sizeof(uint64_t));
+
+    for (auto [w, h] : sizes) {
+        uint32_t tiles_x = (w + tile_size - 1) / tile_size;
+        uint32_t tiles_y = (h + tile_size - 1) / tile_size;
+        put(uint32_t(w));
+        put(uint32_t(h));
+        put(tiles_x);
+        put(tiles_y);
+        put(offset);
+        offset += uint64_t(tiles_x) * tiles_y * tile_bytes;
+    }
+
+    std::vector<float> tile(size_t(tile_size) * tile_size * 3);
+    for (size_t l = 0; l < chain.size(); l++) {
+        auto [w, h] = sizes[l];
+        int tiles_x = (w + tile_size - 1) / tile_size;
+        int tiles_y = (h + tile_size - 1) / tile_size;
+
+        for (int ty = 0; ty < tiles_y; ty++) {
+            for (int tx = 0; tx < tiles_x; tx++) {
+                for (int y = 0; y < tile_size; y++) {
+                    for (int x = 0; x < tile_size; x++) {
+                        int sx = std::min(tx * tile_size + x, w - 1);
+                        int sy = std::min(ty * tile_size + y, h - 1);
+                        const colour &c = chain[l][sy * w + sx];
+                        for (int k = 0; k < 3; k++) tile[(y * tile_size + x) * 3 + k] = float(c[k]);
+                    }
+                }
+                out.write(reinterpret_cast<const char *>(tile.data()), std::streamsize(tile.size() * sizeof(float)));
+            }
+        }
+    }
+
+    return bool(out);
+}
+
+// Reads a binary (P6) or plain (P3) PPM into linear colours, undoing the square-root gamma write_colour applies.
+inline bool read_ppm(const std::string &path, int &width, int &height, std::vector<colour> &pixels) {
+    std::ifstream in(path, std::ios::binary);
+    std::string format;
+    int max_value;
+    in >> format >> width >> height >> max_value;
+    if (!in || (format != "P3" && format != "P6") || max_value <= 0 || max_value > 255) return false;
+    in.get();
+
+    pixels.resize(size_t(width) * height);
+    for (auto &pixel : pixels) {
+        for (int k = 0; k < 3; k++) {
+            int value;
+            if (format == "P6") {
+                value = in.get();
+            } else {
+                in >> value;
+            }
+            double encoded = double(value) / max_value;
+            pixel[k] = encoded * encoded;
+        }
+    }
+
+    return bool(in);
+}
+
+// Thread-safe cache of texture tiles with a byte budget and least-recently-used eviction.
+class texture_tile_cache {
+    public:
+        using tile_data = shared_ptr<const std::vector<float>>;
+
+        texture_tile_cache(size_t capacity_bytes = size_t(256) << 20) : capacity(capacity_bytes) {}
+
+        // Cache shared by image textures that are not given one explicitly
+        static texture_tile_cache &global() {
+            static texture_tile_cache cache;
+            return cache;
+        }
+
+        void set_capacity(size_t bytes) {
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            capacity = bytes;
+            evict();
+        }
+
+        tile_data tile(tiled_texture_file &file, int level, int tx, int ty) {
+            uint64_t key = (uint64_t(file.file_id()) << 48) | (uint64_t(level) << 40)
+                         | (uint64_t(ty) << 20) | uint64_t(tx);
+
+            // Consecutive lookups from one thread usually land in the same tile. The thread only keeps a
+            // weak reference, and trusts it while nothing has been evicted since, so the tile is still resident.
+            // Every touch_interval fast hits the tile is moved to the front of the LRU list, so a tile only
+            // this path uses does not age out as if it were idle
+            thread_local const texture_tile_cache *last_cache = nullptr;
+            thread_local uint64_t last_key = 0;
+            thread_local uint64_t last_evictions = 0;
+            thread_local std::weak_ptr<const std::vector<float>> last_tile;
+            thread_local uint32_t fast_hits = 0;
+            if (last_cache == this && last_key == key && last_evictions == eviction_count.load(std::memory_order_acquire)) {
+                if (tile_data resident = last_tile.lock()) {
+                    hit_count.fetch_add(1, std::memory_order_relaxed);
+                    if (++fast_hits % touch_interval == 0) touch(key);
+                    return resident;
+                }
+            }
+
+            uint64_t evictions = eviction_count.load(std::memory_order_acquire);
+
+            tile_data result = find(key);
+            if (result) {
+                hit_count.fetch_add(1, std::memory_order_relaxed);
+            } else {
+                miss_count.fetch_add(1, std::memory_order_relaxed);
+
+                auto texels = make_shared<std::vector<float>>();
+                file.read_tile(level, tx, ty, *texels);
+                result = insert(key, texels);
+            }
+
+            last_cache = this;
+            last_key = key;
+            last_evictions = evictions;
+            last_tile = result;
+            fast_hits = 0;
+            return result;
+        }
+
+        size_t hits() const { return hit_count.load(); }
+        size_t misses() const { return miss_count.load(); }
+
+        size_t capacity_bytes() const {
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            return capacity;
+        }
+
+        size_t resident_bytes() const {
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            return bytes;
+        }
+
+        void report(std::ostream &out) const {
+            size_t h = hits(), m = misses();
+            double rate = (h + m) > 0 ? 100.0 * h / (h + m) : 0.0;
+            out << "Texture cache: " << h << " hits, " << m << " misses (" << rate << "% hit rate), "
+                << resident_bytes() / 1024 << " KiB resident of " << capacity / 1024 << " KiB\n";
+        }
+
+    private:
+        struct entry {
+            uint64_t key;
+            tile_data texels;
+        };
+
+        static constexpr uint32_t touch_interval = 64;
+
+        mutable std::mutex cache_mutex;
+        std::list<entry> lru;                       // Most recently used first
+        std::unordered_map<uint64_t, std::list<entry>::iterator> index;
+        size_t capacity;
+        size_t bytes = 0;
+        std::atomic<size_t> hit_count{0};
+        std::atomic<size_t> miss_count{0};
+        std::atomic<uint64_t> eviction_count{0};
+
+        tile_data find(uint64_t key) {
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            auto it = index.find(key);
+            if (it == index.end()) return nullptr;
+            lru.splice(lru.begin(), lru, it->second);
+            return it->second->texels;
+        }
+
+        void touch(uint64_t key) {
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            auto it = index.find(key);
+            if (it != index.end()) lru.splice(lru.begin(), lru, it->second);
+        }
+
+        tile_data insert(uint64_t key, tile_data texels) {
+            std::lock_guard<std::mutex> lock(cache_mutex);
+
+            // Another thread may have loaded the same tile while this one was reading it
+            auto it = index.find(key);
+            if (it != index.end()) return it->second->texels;
+
+            lru.push_front({key, texels});
+            index[key] = lru.begin();
+            bytes += texels->size() * sizeof(float);
+            evict();
+            return texels;
+        }
+
+        // Tiles still held by a caller stay alive through their shared_ptr after eviction
+        void evict() {
+            while (bytes > capacity && lru.size() > 1) {
+                const entry &victim = lru.back();
+                bytes -= victim.texels->size() * sizeof(float);
+                index.erase(victim.key);
+                lru.pop_back();
+                eviction_count.fetch_add(1, std::memory_order_release);
+            }
+        }
+};
+
+#endif
@@ -46,7 +46,7 @@ class vec3 {
 
         bool near_zero() const {
             auto s = 1e-8;
-            return (std::fabs(e[0] < s) && std::fabs(e[1] < s) && std::fabs(e[2] < s));
+            return (std::fabs(e[0]) < s) && (std::fabs(e[1]) < s) && (std::fabs(e[2]) < s);
         }
 
         static vec3 random() {